@@ -0,0 +1,328 @@
+// ============================================================================
+// aio.c - asynchronous file operations, run in batches by the aio worker
+// ============================================================================
+
+#include <pthread.h>
+
+#include "aio.h"
+
+static FsOp**   g_aioSub     = NULL;    // submitted, not yet run
+static i32      g_aioSubLen  = 0;
+static i32      g_aioSubCap  = 0;
+
+static FsOp**   g_aioDone    = NULL;    // completed, not yet reaped
+static i32      g_aioDoneLen = 0;
+static i32      g_aioDoneCap = 0;
+static i32      g_aioDoneHd  = 0;       // next completion to reap
+static i32      g_aioBusy    = 0;       // # submitted, not yet completed
+
+static pthread_mutex_t g_aioLock  = PTHREAD_MUTEX_INITIALIZER;  // all above
+static pthread_cond_t  g_aioWork  = PTHREAD_COND_INITIALIZER;   // submitted
+static pthread_cond_t  g_aioReady = PTHREAD_COND_INITIALIZER;   // completed
+static pthread_once_t  g_aioOnce  = PTHREAD_ONCE_INIT;
+
+static FsOp**   g_aioRead    = NULL;    // reads whose blocks are queued.  The
+static i32      g_aioReadLen = 0;       //   worker's own, as is the below
+static i32      g_aioReadCap = 0;
+
+static AioCopy* g_aioCopy    = NULL;    // copies owed by queued reads
+static i32      g_aioCopyLen = 0;
+static i32      g_aioCopyCap = 0;
+
+static Incore*  g_aioHeld[MAXVOLUMES * NUMINODES];  // files a run has locked
+static i32      g_aioHeldLen = 0;
+
+
+// ============================================================================
+// Hand back 'numops' FsOps from 'ops' as completed, and wake fsReap
+// ============================================================================
+static void aioComplete(i32 numops, FsOp** ops) {
+  pthread_mutex_lock(&g_aioLock);
+  for (i32 i = 0; i < numops; ++i) {
+    aioPush(&g_aioDone, &g_aioDoneLen, &g_aioDoneCap, ops[i]);
+  }
+  g_aioBusy -= numops;
+  pthread_cond_broadcast(&g_aioReady);
+  pthread_mutex_unlock(&g_aioLock);
+}
+
+
+
+// ============================================================================
+// Aio worker thread: take each submitted batch, and run it without aio's
+// lock, for as long as the process lives.  Operations submitted meanwhile
+// form the next batch
+// ============================================================================
+static void* aioWorker(void* arg) {
+  (void)arg;
+  FsOp** batch = NULL;                    // array swapped with g_aioSub
+  i32    cap   = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&g_aioLock);
+    while (g_aioSubLen == 0) pthread_cond_wait(&g_aioWork, &g_aioLock);
+    FsOp** ops    = g_aioSub;
+    i32    opsCap = g_aioSubCap;
+    i32    len    = g_aioSubLen;
+    g_aioSub    = batch;
+    g_aioSubCap = cap;
+    g_aioSubLen = 0;
+    batch = ops;
+    cap   = opsCap;
+    pthread_mutex_unlock(&g_aioLock);
+
+    aioRun(len, batch);
+  }
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Start the aio worker.  Run once, by pthread_once
+// ============================================================================
+static void aioStart() {
+  pthread_t t;
+  if (pthread_create(&t, NULL, aioWorker, NULL) != 0) FATAL(ENOMEM);
+  pthread_detach(t);
+}
+
+
+
+// ============================================================================
+// Queue 'numops' operations from the array 'ops', and return at once: the
+// aio worker runs them.  Each FsOp must stay valid until it is reaped.  On
+// success, return 'numops'.  On failure, abort
+// ============================================================================
+i32 fsSubmit(i32 numops, FsOp* ops) {
+
+  if (ops == NULL) FATAL(ENULLPTR);
+  if (numops < 0)  FATAL(ENEGNUMB);
+
+  for (i32 i = 0; i < numops; ++i) {
+    FsOp* op = &ops[i];
+    if (op->op < FSOPREAD || op->op > FSOPSYNC) FATAL(ENYI);
+    if (op->op != FSOPSYNC) {
+      bfsFindOFTE(op->fd);                // validate fd now
+      if (op->numb   < 0)  FATAL(ENEGNUMB);
+      if (op->offset < 0)  FATAL(EBADCURS);
+      if (op->buf == NULL) FATAL(ENULLPTR);
+    }
+    op->res = 0;
+  }
+
+  pthread_once(&g_aioOnce, aioStart);
+  pthread_mutex_lock(&g_aioLock);
+  for (i32 i = 0; i < numops; ++i) {
+    aioPush(&g_aioSub, &g_aioSubLen, &g_aioSubCap, &ops[i]);
+  }
+  g_aioBusy += numops;
+  pthread_cond_signal(&g_aioWork);
+  pthread_mutex_unlock(&g_aioLock);
+  return numops;
+}
+
+
+
+// ============================================================================
+// Wait until 'max' FsOps have completed, or every one submitted has, then
+// move up to 'max' of them, in completion order, into 'done'.  Return the
+// number moved: 0 only once nothing is left in flight
+// ============================================================================
+i32 fsReap(i32 max, FsOp** done) {
+
+  if (done == NULL) FATAL(ENULLPTR);
+
+  pthread_mutex_lock(&g_aioLock);
+  while (g_aioBusy > 0 && g_aioDoneLen - g_aioDoneHd < max) {
+    pthread_cond_wait(&g_aioReady, &g_aioLock);
+  }
+
+  i32 n = 0;
+  while (n < max && g_aioDoneHd < g_aioDoneLen) {
+    done[n++] = g_aioDone[g_aioDoneHd++];
+  }
+  if (g_aioDoneHd == g_aioDoneLen) g_aioDoneHd = g_aioDoneLen = 0;
+  pthread_mutex_unlock(&g_aioLock);
+  return n;
+}
+
+
+
+// ============================================================================
+// Run the async engine until it goes idle: reap completed FsOps and call each
+// one's 'done' callback.  A callback may fsSubmit further ops, which the
+// worker runs meanwhile, so chains of operations (read, then write what was
+// read...) proceed without blocking the caller between steps.  This is the
+// hook for continuation-style callers: a coroutine awaiting an FsOp sets
+// 'done' to resume itself.  FsOps reaped here are not returned by a later
+// fsReap.  Return the number of FsOps completed
+// ============================================================================
+i32 fsRun() {
+  FsOp* done[AIOREAPMAX];
+  i32 total = 0;
+
+  for (;;) {
+    i32 n = fsReap(AIOREAPMAX, done);
+    if (n == 0) break;
+    for (i32 i = 0; i < n; ++i) {
+      if (done[i]->done != NULL) done[i]->done(done[i]);
+    }
+    total += n;
+  }
+  return total;
+}
+
+
+
+// ============================================================================
+// Issue the block reads queued so far, copy partial blocks out of their
+// bounce buffers, and complete the reads that were waiting on them.  Then
+// unlock the files aioHold locked for them
+// ============================================================================
+i32 aioFinish() {
+  bioDrain();
+
+  for (i32 i = 0; i < g_aioCopyLen; ++i) {
+    AioCopy* c = &g_aioCopy[i];
+    if (c->src != NULL) memcpy(c->dst, c->src, c->numb);
+    else                memset(c->dst, 0, c->numb);   // hole
+    free(c->block);
+  }
+  g_aioCopyLen = 0;
+
+  for (i32 i = 0; i < g_aioHeldLen; ++i) bfsUnlockInode(g_aioHeld[i]);
+  g_aioHeldLen = 0;
+
+  if (g_aioReadLen > 0) aioComplete(g_aioReadLen, g_aioRead);
+  g_aioReadLen = 0;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Lock shared the files read by the 'numops' reads in 'ops', each once, the
+// lower volume handle, then the lower inum, first.  They stay locked, so
+// their mappings stay put, until aioFinish has copied the blocks out
+// ============================================================================
+static void aioHold(i32 numops, FsOp** ops) {
+  for (i32 i = 0; i < numops; ++i) {
+    Incore* ic = bfsFindOFTE(ops[i]->fd)->ic;
+    i32 k = g_aioHeldLen;
+    for (; k > 0; --k) {
+      Incore* prev = g_aioHeld[k - 1];
+      if (prev->vol->id < ic->vol->id) break;
+      if (prev->vol->id == ic->vol->id && prev->inum <= ic->inum) break;
+    }
+    if (k > 0 && g_aioHeld[k - 1] == ic) continue;      // already held
+    memmove(&g_aioHeld[k + 1], &g_aioHeld[k],
+            (g_aioHeldLen - k) * sizeof(Incore*));
+    g_aioHeld[k] = ic;
+    ++g_aioHeldLen;
+  }
+  for (i32 i = 0; i < g_aioHeldLen; ++i) bfsLockInode(g_aioHeld[i], 0);
+}
+
+
+
+// ============================================================================
+// Plan read 'op' onto the bio queue, without issuing it.  Clamps to EOF, as
+// fsPread does.  A whole block is read straight into the caller's buffer;
+// a partial block goes to a bounce block, copied out by aioFinish.  The
+// caller holds the file locked (aioHold)
+// ============================================================================
+i32 aioPlanRead(FsOp* op) {
+  Incore* ic = bfsFindOFTE(op->fd)->ic;
+
+  i32 inum   = ic->inum;
+  i32 size   = bfsGetSize(inum);
+  i32 offset = op->offset;
+  i32 numb   = (offset >= size) ? 0 : MIN(op->numb, size - offset);
+  i8* dst    = op->buf;
+
+  op->res = numb;
+
+  while (numb > 0) {
+    i32 fbn  = offset / BYTESPERBLOCK;
+    i32 boff = offset % BYTESPERBLOCK;
+    i32 n    = MIN(BYTESPERBLOCK - boff, numb);
+    i32 dbn  = bfsFbnToDbn(inum, fbn);
+
+    if (dbn != ENODBN && n == BYTESPERBLOCK) {
+      bioSubmit(BIOREAD, dbn, dst);
+    } else {
+      AioCopy c = { dst, NULL, n, NULL };
+      if (dbn != ENODBN) {
+        c.block = malloc(BYTESPERBLOCK);
+        if (c.block == NULL) FATAL(ENOMEM);
+        c.src = c.block + boff;
+        bioSubmit(BIOREAD, dbn, c.block);
+      }
+      if (g_aioCopyLen == g_aioCopyCap) {
+        i32 cap = (g_aioCopyCap == 0) ? 64 : 2 * g_aioCopyCap;
+        AioCopy* a = realloc(g_aioCopy, cap * sizeof(AioCopy));
+        if (a == NULL) FATAL(ENOMEM);
+        g_aioCopy    = a;
+        g_aioCopyCap = cap;
+      }
+      g_aioCopy[g_aioCopyLen++] = c;
+    }
+
+    dst    += n;
+    offset += n;
+    numb   -= n;
+  }
+
+  return aioPush(&g_aioRead, &g_aioReadLen, &g_aioReadCap, op);
+}
+
+
+
+// ============================================================================
+// Append 'op' to the growable FsOp* array '*q'.  On failure, abort
+// ============================================================================
+i32 aioPush(FsOp*** q, i32* len, i32* cap, FsOp* op) {
+  if (*len == *cap) {
+    i32 newCap = (*cap == 0) ? 64 : 2 * *cap;
+    FsOp** a = realloc(*q, newCap * sizeof(FsOp*));
+    if (a == NULL) FATAL(ENOMEM);
+    *q   = a;
+    *cap = newCap;
+  }
+  (*q)[(*len)++] = op;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Run the batch of 'numops' FsOps in 'ops', in order, on the aio worker.
+// Runs of reads are planned together, with their files held, so their
+// blocks reach the disk sorted by DBN and merged into large transfers.  A
+// write or sync first finishes the reads before it, then runs alone
+// ============================================================================
+i32 aioRun(i32 numops, FsOp** ops) {
+  for (i32 i = 0; i < numops; ) {
+    if (ops[i]->op == FSOPREAD) {
+      i32 run = 1;
+      while (i + run < numops && ops[i + run]->op == FSOPREAD) ++run;
+      aioHold(run, ops + i);
+      for (i32 k = 0; k < run; ++k) aioPlanRead(ops[i + k]);
+      aioFinish();
+      i += run;
+      continue;
+    }
+
+    FsOp* op = ops[i++];
+    if (op->op == FSOPWRITE) {
+      fsPwrite(op->fd, op->numb, op->buf, op->offset);
+      op->res = op->numb;
+    } else {
+      bfsSyncAll();                       // every volume's disk
+      op->res = 0;
+    }
+    aioComplete(1, &op);
+  }
+  return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef AIO_H
+#define AIO_H
+
+// ===================================================================
+// aio.h - asynchronous file operations.  fsSubmit queues FsOps and
+// returns; the aio worker thread runs each batch through the bio
+// request queue.  fsReap waits for completed FsOps and hands them
+// back.  fsRun is a single-threaded executor that reaps and calls
+// each FsOp's 'done' callback
+// ===================================================================
+
+#include "fs.h"
+#include "bio.h"
+#include "alias.h"
+
+#define AIOREAPMAX 64                   // completions fsRun reaps per pass
+
+typedef struct {          // AioCopy: bounce-buffer copy after a read batch
+  i8* dst;                // caller's bytes
+  i8* src;                // inside the bounce block
+  i32 numb;               // # bytes to copy
+  i8* block;              // bounce block to free, once copied.  Or NULL
+} AioCopy;
+
+i32 aioFinish();
+i32 aioPlanRead(FsOp* op);
+i32 aioPush(FsOp*** q, i32* len, i32* cap, FsOp* op);
+i32 aioRun(i32 numops, FsOp** ops);
+
+#endif
@@ -2,9 +2,60 @@
 // bfs.c
 // ============================================================================
 
+#include <sched.h>
+
 #include "bfs.h"
+#include "epoch.h"
+#include "jnl.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>                  // name compares, 16 bytes at a time
+#endif
+
 // using extern
-OFTE g_oft[NUMOFTENTRIES];
+OFTE** g_oft = NULL;
+
+static i32 g_oftChunks = 0;             // # chunks in g_oft
+static i32 g_oftFree   = -1;            // head of free OFT slots.  -1 => none
+
+// Mounted volumes, by handle.  A Volume is never freed: an unmounted slot
+// is reused by a later bfsMount, so stale pointers to it stay harmless
+static Volume* g_vols[MAXVOLUMES];
+static __thread Volume* t_vol = NULL;   // this thread's current volume
+
+// Locks; see "Lock order" in bfs.h.  Each Volume's metaLock is recursive,
+// since bfs functions that take it call one another
+static pthread_mutex_t g_oftLock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_volsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t  g_lockOnce = PTHREAD_ONCE_INIT;
+
+// Free-block allocator.  A volume's SuperBlock free bitmap is held as words
+// that threads claim bits from with compare-and-swap (Volume.freeWords).
+// Each thread keeps a small cache of claimed DBNs from one volume, refilled
+// ALLOCBATCH at a time; they count as free on disk (Volume.cachedWords)
+// until used, and go back to the map when the thread exits or moves on to
+// another volume.  A DBN belongs to the cache only while its cachedWords bit
+// is set: a thread that finds the map empty takes every such bit back as
+// free, and the owning cache skips those DBNs.  Every load of a map gets a
+// new generation, so a cache from before its volume's map was last loaded is
+// stale
+static i32 g_allocGen = 0;              // last generation handed out
+static pthread_key_t g_cacheKey;        // runs bfsReturnCache at exit
+
+static __thread i16 t_cache[ALLOCBATCH]; // this thread's claimed DBNs
+static __thread i32 t_cacheLen = 0;
+static __thread i32 t_cacheGen = -1;
+static __thread Volume* t_cacheVol = NULL;   // volume they came from
+
+// Each Volume also holds an in-memory index of its Directory.  The Dir block
+// is read once, whatever its format, and each name is kept zero-padded by
+// inum and hashed into a bucket; buckets are chained through dirNext.  So
+// lookup reads no blocks, and create writes just the Dir block.
+//
+// Deferred metadata.  Between bfsBeginMeta and bfsEndMeta the Inodes block
+// lives in Volume.inodes, and stores of the Inodes, Dir and Super blocks just
+// set a bit in Volume.metaDirty.  bfsEndMeta then writes each dirty block
+// once
 
 
 // ============================================================================
@@ -25,39 +76,55 @@ i32 bfsAllocBlock(i32 inum, i32 fbn) {
 
   // Update the corresponding Inode, or IndirectBlock
 
-  i8 buf8[BYTESPERBLOCK] = {0};           // 1-block buffer
-  bioRead(DBNINODES, buf8);
- 
-  Inode* pinodes = (Inode*)buf8;          // array of Inodes
-  Inode* pinode  = &pinodes[inum];        // target Inode
+  bfsMapBlock(inum, fbn, dbn);
 
-  if (fbn < NUMDIRECT) {                  // in direct[] array?
-    pinode->direct[fbn] = dbn;
-    bioWrite(DBNINODES, buf8);
-    return dbn;
-  } else {                                // in indirect block?
-    i16 buf16[I16SPERBLOCK]= {0};
-    i32 dbnIndirect = pinode->indirect;   // DBN of indirect block
-
-    if (dbnIndirect == 0) {               // not yet allocated
-      dbnIndirect = bfsFindFreeBlock();
-      pinode->indirect = dbn;
-    }
+  return dbn;                             // allocated DBN
+
+}
 
-    bioRead(dbnIndirect, buf16);
 
-    buf16[fbn - NUMDIRECT] = dbn;
-    bioWrite(dbnIndirect, buf16);
+
+// ============================================================================
+// Start deferring metadata writes: until the matching bfsEndMeta, updates to
+// the Inodes, Dir and Super blocks stay in memory.  Calls nest.  On success,
+// return 0
+// ============================================================================
+i32 bfsBeginMeta() {
+  Volume* vol = bfsVol();
+  bfsLockMeta();
+  if (vol->metaDepth++ == 0) {
+    bioRead(bfsInodesDbn(), vol->inodes);
+    vol->metaDirty = 0;
   }
+  bfsUnlockMeta();
+  return 0;
+}
 
-  return dbn;                             // allocated DBN
 
+
+// ============================================================================
+// If block 'dbn', mapped at FBN 'fbn' of file 'inum', is shared with a clone,
+// copy-on-write it: map a new block at 'fbn' and drop one owner of 'dbn'.
+// Unless 'old' is NULL, the old contents are read into it first.  This runs
+// under the metaLock, so two clones writing the same shared block cannot both
+// take the last owner.  Return the DBN now mapped at 'fbn'
+// ============================================================================
+i32 bfsCowBlock(i32 inum, i32 fbn, i32 dbn, i8* old) {
+  bfsLockMeta();
+  if (old != NULL) bioRead(dbn, old);
+  if (bfsLoadSuper()->shared[dbn] > 0) {
+    i32 src = dbn;
+    dbn = bfsAllocBlock(inum, fbn);
+    bfsFreeBlock(src);                    // one owner fewer
+  }
+  bfsUnlockMeta();
+  return dbn;
 }
 
 
 
 // ============================================================================
-// Create file 'fname'.  Find a free inum; ie, free slot in the Directory.
+// Create file 'fname'.  Find a free inum; ie, one not named in the Directory.
 // Leave the size of the file as zero, until the user performs a write, or a
 // seek into the file.  On success, return the file's inum.  On failure, abort
 // ============================================================================
@@ -65,40 +132,185 @@ i32 bfsCreateFile(str fname) {
 
   if (fname == NULL) FATAL(ENULLPTR);
 
-  if (strlen(fname) > FNAMESIZE - 1) FATAL(EBIGFNAME);  // fname too big
+  i32 len = strlen(fname);
+  if (len == 0)        FATAL(EBADFNAME);                // no name at all
+  if (len > FNAMEMAX)  FATAL(EBIGFNAME);                // fname too big
+
+  Volume* vol = bfsVol();
+  bfsLockMeta();
+  bfsLoadDir();
+
+  if (vol->dirFormat == DIRFIXED && len > FNAMESIZE - 1) FATAL(EBIGFNAME);
+
+  i32 inum = bfsFindFreeSlot();                         // search Directory
+  if (inum < 0) FATAL(EDIRFULL);                        // no free inum
+
+  DirSnap* dir = malloc(sizeof(DirSnap));               // copy, then change
+  if (dir == NULL) FATAL(ENOMEM);
+  memcpy(dir, vol->dir, sizeof(DirSnap));
+  memcpy(dir->name[inum], fname, len);
+  dir->len[inum] = len;
+
+  i8 buf[BYTESPERBLOCK];
+  if (bfsEncodeDir(dir, buf) == EDIRFULL) {             // Dir block full
+    free(dir);
+    FATAL(EDIRFULL);
+  }
+
+  u32 b = bfsHashName(fname) % NUMDIRBUCKETS;           // add to index
+  dir->next[inum] = dir->head[b];
+  dir->head[b] = inum;
+  bfsPublish((void**)&vol->dir, dir);
+  bfsStoreDirLocked();
+  bfsUnlockMeta();
+
+  return inum;
+}
+
 
-  i8 buf[BYTESPERBLOCK] = {0};
 
-  bioRead(DBNDIR, buf);
+// ============================================================================
+// Drop one reference to in-memory Inode 'ic'.  When no OFT entry uses it any
+// more, it stops shadowing the on-disk Inode, and blocks preallocated past
+// EOF by appends go back to the Freelist
+// ============================================================================
+i32 bfsDerefIncore(Incore* ic) {
+  if (ic == NULL) FATAL(ENULLPTR);
+  bfsLockMeta();
+  if (ic->refs == 1) bfsTrimPrealloc(ic, ic->preEnd);
+  --ic->refs;
+  if (ic->refs == 0) {
+    ic->mapped  = 0;
+    ic->tailFbn = -1;
+  }
+  bfsUnlockMeta();
+  return 0;
+}
+
+
+
+// ============================================================================
+// Free the Open File Table entry for File Descriptor 'fd', dropping its
+// reference to the shared in-memory Inode.  The slot goes back on the free
+// list, for the next open to reuse
+// ============================================================================
+i32 bfsDerefOFT(i32 fd) {
+  OFTE* ofte = bfsFindOFTE(fd);
+  pthread_mutex_lock(&g_oftLock);
+  bfsDerefIncore(ofte->ic);
+  ofte->ic       = NULL;
+  ofte->curs     = 0;
+  ofte->flags    = 0;
+  ofte->nextFree = g_oftFree;
+  g_oftFree      = fd - FDBASE;
+  pthread_mutex_unlock(&g_oftLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return the DBN of the current volume's Dir block: DBNDIR, or on a
+// copy-on-write disk, wherever its last store moved it
+// ============================================================================
+i32 bfsDirDbn() {
+  i32 dbn = bfsLoadSuper()->cowDir;
+  return (dbn != 0) ? dbn : DBNDIR;
+}
+
+
+
+// ============================================================================
+// Note that the current volume's free bitmap or share counts have changed.
+// The SuperBlock is then stored once for many changes: by the next commit
+// on a journaled disk, else at the end of the operation (jnlEnd).  Return 0
+// ============================================================================
+i32 bfsDirtySuper() {
+  Volume* vol = bfsVol();
+  if (!__atomic_load_n(&vol->superDirty, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&vol->superDirty, 1, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
 
-  Dir* dir = (Dir*)buf;
 
-  for (int inum = 0; inum < NUMINODES; ++inum) {        // search Directory
-    if (strlen(dir->fname[inum]) == 0) {                // free slot
-      strcpy(dir->fname[inum], fname);
-      bioWrite(DBNDIR, dir);
-      bfsRefOFT(inum);
-      return inum;
+
+// ============================================================================
+// Encode Directory index 'dir' as a Dir block, in the current volume's
+// format, into 'buf'.  Return 0, or EDIRFULL if the names do not fit
+// ============================================================================
+i32 bfsEncodeDir(DirSnap* dir, i8* buf) {
+  if (dir == NULL || buf == NULL) FATAL(ENULLPTR);
+  memset(buf, 0, BYTESPERBLOCK);
+
+  if (bfsVol()->dirFormat == DIRPACKED) {
+    i32 off = 0;
+    for (i32 inum = 0; inum < NUMINODES; ++inum) {
+      i32 len = dir->len[inum];
+      if (len == 0) continue;
+      i32 reclen = DIRENTSIZE(len);
+      if (off + reclen > BYTESPERBLOCK) return EDIRFULL;
+      DirEnt* de  = (DirEnt*)&buf[off];
+      de->inum    = inum;
+      de->reclen  = reclen;
+      de->namelen = len;
+      memcpy(de->name, dir->name[inum], len);
+      off += reclen;
+    }
+  } else {
+    Dir* fixed = (Dir*)buf;
+    for (i32 inum = 0; inum < NUMINODES; ++inum) {
+      memcpy(fixed->fname[inum], dir->name[inum], dir->len[inum]);
     }
   }
+  return 0;
+}
 
-  FATAL(EDIRFULL);                                      // Directory full
-  return 0;                                             // pacify compiler
+
+
+// ============================================================================
+// Copy volume 'vol's cached SuperBlock into 'buf', with the free bitmap
+// brought up to date.  Cached DBNs are written as free: a crash or exit then
+// loses none.  So are DBNs freed but held back until the free commits.  The
+// caller holds the metaLock, or is a commit with every operation on 'vol'
+// ended, so nothing changes the SuperBlock meanwhile.  On success, return 0
+// ============================================================================
+i32 bfsEncodeSuper(Volume* vol, i8* buf) {
+  if (vol == NULL || buf == NULL) FATAL(ENULLPTR);
+  memset(buf, 0, BYTESPERBLOCK);
+  memcpy(buf, &vol->super, sizeof(Super));
+
+  Super* sb = (Super*)buf;
+  memset(sb->freeMap, 0, FREEMAPBYTES);
+  for (i32 w = 0; w < FREEWORDS; ++w) {
+    u64 free = __atomic_load_n(&vol->freeWords[w],    __ATOMIC_ACQUIRE)
+             | __atomic_load_n(&vol->cachedWords[w],  __ATOMIC_ACQUIRE)
+             | __atomic_load_n(&vol->pendingWords[w], __ATOMIC_ACQUIRE);
+    for (; free != 0; free &= free - 1) {
+      i32 dbn = w * 64 + __builtin_ctzll(free);
+      sb->freeMap[dbn / 8] |= 1 << (dbn % 8);
+    }
+  }
+  return 0;
 }
 
 
 
 // ============================================================================
-// Dereference file with Inode number 'inum' in the Open File Table.  If
-// refcount reaches 0, free up that entry in the OFT
+// End the outermost bfsBeginMeta by writing each metadata block it dirtied,
+// once.  On success, return 0
 // ============================================================================
-i32 bfsDerefOFT(i32 inum) {
-  i32 ofte = bfsFindOFTE(inum);
-  --g_oft[ofte].refs;
-  if (g_oft[ofte].refs == 0) {
-    g_oft[ofte].inum = 0;
-    g_oft[ofte].curs = 0;
+i32 bfsEndMeta() {
+  Volume* vol = bfsVol();
+  bfsLockMeta();
+  if (vol->metaDepth <= 0) FATAL(EBADMETA);
+  if (--vol->metaDepth == 0) {
+    if (vol->metaDirty & METAINODES) bfsStoreInodes(vol->inodes);
+    if (vol->metaDirty & METADIR)    bfsStoreDir();
+    if (vol->metaDirty & METASUPER)  bfsStoreSuper();
+    vol->metaDirty = 0;
   }
+  bfsUnlockMeta();
   return 0;
 }
 
@@ -120,7 +332,9 @@ i32 bfsExtend(i32 inum, i32 fbn) {
 
 // ============================================================================
 // Use Inode to find the DBN used to store file block 'fbn'.  Return ENODBN
-// if not yet mapped
+// if not yet mapped.  For an open file, the Inode and indirect block come
+// from its Incore entry, so no disk reads are needed once cached.  Never
+// allocates: bfsMapBlock adds the indirect block when it is first needed
 // ============================================================================
 i32 bfsFbnToDbn(i32 inum, i32 fbn) {
 
@@ -129,6 +343,18 @@ i32 bfsFbnToDbn(i32 inum, i32 fbn) {
   if (fbn  < 0)       FATAL(EBADFBN);
   if (fbn  > MAXFBN)  FATAL(EBADFBN);
 
+  bfsLockMeta();
+  i32 dbn = bfsFbnToDbnLocked(inum, fbn);
+  bfsUnlockMeta();
+  return dbn;
+}
+
+
+
+// ============================================================================
+// bfsFbnToDbn, for a caller that holds the metaLock
+// ============================================================================
+i32 bfsFbnToDbnLocked(i32 inum, i32 fbn) {
   Inode inode;
   
   bfsReadInode(inum, &inode);
@@ -139,17 +365,21 @@ i32 bfsFbnToDbn(i32 inum, i32 fbn) {
   }
 
   // fbn is not in direct, so check indirect block.  If it doesn't exist,
-  // then allocate an empty indirect block.  But return ENODBN for the
-  // caller to handle grabing a new data block.
+  // nothing past direct[] is mapped yet
 
-  if (inode.indirect == 0) {      // no indirect block yet allocated
-    i32 dbn = bfsFindFreeBlock();
-    inode.indirect = dbn;
-    bfsWriteInode(inum, &inode);
-    return ENODBN;
-  }
+  if (inode.indirect == 0) return ENODBN;
 
-  // Check the indirect block
+  // Check the indirect block, cached in Incore for an open file
+
+  Incore* ic = bfsFindIncore(inum);
+  if (ic != NULL) {
+    if (ic->mapped == 0) {
+      bioRead(inode.indirect, ic->map);
+      ic->mapped = 1;
+    }
+    i32 dbn = ic->map[fbn - NUMDIRECT];
+    return (dbn == 0) ? ENODBN : dbn;
+  }
 
   i16 buf[NUMINDIRECT] = {0};
   bioRead(inode.indirect, buf);
@@ -160,298 +390,1487 @@ i32 bfsFbnToDbn(i32 inum, i32 fbn) {
 
 
 
+// ============================================================================
+// Find the DBNs of the 'count' blocks of file 'inum' from FBN 'fbn' into
+// 'dbns', under one metaLock; 0 marks a block not yet mapped.  The caller
+// holds the file's Incore lock, so they stay valid until it lets go.  On
+// success, return 0
+// ============================================================================
+i32 bfsFbnToDbnRun(i32 inum, i32 fbn, i32 count, i16* dbns) {
+
+  if (dbns == NULL)             FATAL(ENULLPTR);
+  if (count < 0)                FATAL(ENEGNUMB);
+  if (fbn < 0)                  FATAL(EBADFBN);
+  if (fbn + count > MAXFBN + 1) FATAL(EBADFBN);
+
+  bfsLockMeta();
+  for (i32 i = 0; i < count; ++i) {
+    i32 dbn = bfsFbnToDbnLocked(inum, fbn + i);
+    dbns[i] = (dbn == ENODBN) ? 0 : dbn;
+  }
+  bfsUnlockMeta();
+  return 0;
+}
+
+
+
 // ============================================================================
 // Convert FileDescriptor (user-visible) to Inum (internal)
 // ============================================================================
 i32 bfsFdToInum(i32 fd) { 
-  i32 inum = fd - INUMTOFD; 
-  if (inum < 0) FATAL(EBADINUM);
-  return inum;
+  return bfsFindOFTE(fd)->ic->inum;
 }
 
 
 
 
 // ============================================================================
-// Find 'inum' in the Open File Table (OFT).  If not found, create an entry.
-// Return the index within the OFT.  On failure, EOFTFULL
+// Find the first inum not named in the Directory index.  The caller holds
+// the metaLock, with the index loaded.  Return it, or -1 if every inum is in
+// use.  With SSE2, tests the name lengths of 8 inums per
+// compare; else falls back to a scalar loop
 // ============================================================================
-i32 bfsFindOFTE(i32 inum) {
-  for (int i = 0; i < NUMOFTENTRIES; ++i) {
-    if (g_oft[i].inum == inum) return i;
+i32 bfsFindFreeSlot() {
+  DirSnap* dir = bfsVol()->dir;
+  i32 inum = 0;
+
+#if defined(__SSE2__)
+  __m128i zero = _mm_setzero_si128();
+  for (; inum + 8 <= NUMINODES; inum += 8) {
+    __m128i v = _mm_loadl_epi64((__m128i*)&dir->len[inum]);
+    u32 m = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0xFF;
+    if (m != 0) return inum + __builtin_ctz(m);
   }
-  
-  // Not found, so look for an empty OFTE
-
-  for (int i = 0; i < NUMOFTENTRIES; ++i) {
-    if (g_oft[i].inum == 0) {
-      g_oft[i].inum = inum;
-      g_oft[i].curs = 0;
-      g_oft[i].refs = 1;
-      return i;
-    }
+#endif
+
+  for (; inum < NUMINODES; ++inum) {
+    if (dir->len[inum] == 0) return inum;
   }
-  FATAL(EOFTFULL);      // no-return
-  return 0;             // pacify compiler
+  return -1;
 }
 
 
 
 // ============================================================================
-// Allocate the next free block from the Freelist.  Adjust Freelist
-// accordingly.  On success, return DBN.  FATAL otherwise
+// Find the in-memory Inode for 'inum'.  Return it, or NULL if no OFT entry
+// has the file open.  The caller holds the metaLock
 // ============================================================================
-i32 bfsFindFreeBlock() {
-  i8 buf8[BYTESPERBLOCK] = {0};
-  bioRead(DBNSUPER, buf8);
-  Super* super = (Super*)buf8;
+Incore* bfsFindIncore(i32 inum) {
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  Volume* vol = bfsVol();
+  return (vol->incore[inum].refs > 0) ? &vol->incore[inum] : NULL;
+}
+
 
-  i32 dbn = super->firstFree;
-  if (dbn == 0) FATAL(EDISKFULL);
 
-  i16 buf16[I16SPERBLOCK] = {0};      // for next free block
-  bioRead(dbn, buf16);
+// ============================================================================
+// Find the Open File Table entry for File Descriptor 'fd', and return it.  The
+// fd's volume becomes the calling thread's current volume, so the bfs calls
+// that follow act on its file.  Takes no lock: the chunk array is published
+// as a snapshot by bfsGrowOFT.  If 'fd' is not open, abort with EBADFD
+// ============================================================================
+OFTE* bfsFindOFTE(i32 fd) {
+  i32 slot = fd - FDBASE;
+  if (slot < 0) FATAL(EBADFD);
+
+  epochEnter();
+  i32 numChunks = __atomic_load_n(&g_oftChunks, __ATOMIC_SEQ_CST);
+  if (slot >= numChunks * OFTCHUNK) FATAL(EBADFD);
+  OFTE** chunks = __atomic_load_n(&g_oft, __ATOMIC_SEQ_CST);
+  OFTE*  ofte   = &chunks[slot / OFTCHUNK][slot % OFTCHUNK];
+  epochExit();
+
+  if (ofte->ic == NULL) FATAL(EBADFD);
+  t_vol = ofte->ic->vol;
+  return ofte;
+}
 
-  super->firstFree = buf16[0];        // new head of Freelist
 
-  bioWrite(DBNSUPER, buf8);           // update SuperBlock
 
+// ============================================================================
+// Allocate a free block.  On success, return its DBN.  If the disk is full,
+// abort with EDISKFULL
+// ============================================================================
+i32 bfsFindFreeBlock() {
+  i32 dbn = bfsTakeBlock();
+  if (dbn == 0) FATAL(EDISKFULL);
   return dbn;
 }
 
 
+
+// ============================================================================
+// Drop one owner of block 'dbn'.  A block shared by clones just loses one
+// from its share count; a block with a single owner goes back in the free
+// bitmap.  On a journaled disk, it is reusable only once the free commits.
+// On success, return 0
+// ============================================================================
+i32 bfsFreeBlock(i32 dbn) {
+
+  if (dbn < MINDBN)         FATAL(EBADDBN);
+  if (dbn >= BLOCKSPERDISK) FATAL(EBADDBN);
+
+  Volume* vol = bfsVol();
+  bfsLockMeta();
+  Super* super = bfsLoadSuper();
+
+  u64 bit = (u64)1 << (dbn % 64);
+  if (super->shared[dbn] > 0) {
+    --super->shared[dbn];
+  } else if (super->jnlStart != 0 || super->cowInodes != 0) {
+    jnlFree(vol, dbn);                    // reusable once it commits
+  } else {
+    __atomic_fetch_or(&vol->freeWords[dbn / 64],    bit, __ATOMIC_RELEASE);
+  }
+
+  bfsDirtySuper();
+  bfsUnlockMeta();
+  return 0;
+}
+
+
 // ============================================================================
-// Initialize the Freelist
+// Initialize the free bitmap: every block after the metadata, and after the
+// journal, or the first Inodes and Dir of a copy-on-write disk, is free
 // ============================================================================
 i32 bfsInitFreeList() {
-  i16 buf[I16SPERBLOCK] = {0};
-  i32 ret = 0;
+  Volume* vol = bfsVol();
+  i8 buf[BYTESPERBLOCK] = {0};
+  bioRead(DBNSUPER, buf);
+  Super* sb = (Super*)buf;
+
+  i32 first = NUMMETA;
+  if (sb->jnlStart != 0) first = sb->jnlStart + JNLBLOCKS;
+  if (sb->cowDir   != 0) first = MAX(sb->cowInodes, sb->cowDir) + 1;
+  memset(sb->freeMap, 0, FREEMAPBYTES);
+  for (i32 dbn = first; dbn < BLOCKSPERDISK; ++dbn) {
+    sb->freeMap[dbn / 8] |= 1 << (dbn % 8);
+  }
+  sb->firstFree  = 0;
+  sb->freeFormat = FREEMAP;
+  if (sb->cowDir != 0) sb->cowSum = jnlSumSuper(sb);   // copy 0 now holds
+
+  __atomic_store_n(&vol->superLoaded, 0, __ATOMIC_RELEASE);   // reload it
+  return bioWrite(DBNSUPER, buf);
+}
+
+
 
-  for (int dbn = NUMMETA; dbn < BLOCKSPERDISK - 1; ++dbn) {
-    buf[0] = dbn + 1;
-    bioWrite(dbn, (i8*)buf);
+// ============================================================================
+// Add one chunk of OFTCHUNK free entries to the Open File Table, and push
+// them onto the free list, lowest slot first.  Existing chunks do not move;
+// the array of them is copied, published, and the old one retired, for
+// bfsFindOFTE.  The caller holds g_oftLock.  On success, return 0.  On
+// failure, abort with ENOMEM
+// ============================================================================
+i32 bfsGrowOFT() {
+  OFTE** chunks = malloc((g_oftChunks + 1) * sizeof(OFTE*));
+  if (chunks == NULL) FATAL(ENOMEM);
+  if (g_oftChunks > 0) memcpy(chunks, g_oft, g_oftChunks * sizeof(OFTE*));
+
+  OFTE* chunk = calloc(OFTCHUNK, sizeof(OFTE));
+  if (chunk == NULL) FATAL(ENOMEM);
+
+  i32 base = g_oftChunks * OFTCHUNK;
+  for (i32 i = OFTCHUNK - 1; i >= 0; --i) {
+    chunk[i].nextFree = g_oftFree;
+    g_oftFree = base + i;
   }
 
-  buf[0] = 0;
-  bioWrite(BLOCKSPERDISK - 1, (i8*)buf);      // end of Freelist
+  chunks[g_oftChunks] = chunk;
+  OFTE** old = g_oft;
+  __atomic_store_n(&g_oft, chunks, __ATOMIC_SEQ_CST);          // then count
+  __atomic_store_n(&g_oftChunks, g_oftChunks + 1, __ATOMIC_SEQ_CST);
+  return epochRetire(old);
+}
 
-  return ret;
+
+
+// ============================================================================
+// Hash filename 'fname' (FNV-1a) for the in-memory Directory index
+// ============================================================================
+u32 bfsHashName(str fname) {
+  u32 h = 2166136261u;
+  for (u8* p = (u8*)fname; *p != 0; ++p) {
+    h ^= *p;
+    h *= 16777619u;
+  }
+  return h;
 }
 
 
 
 // ============================================================================
-// Write the initial Dir block, of all zeroes, into DBN 2
+// Write the initial Dir block, of all zeroes, into DBN 2, and on a
+// copy-on-write disk where its SuperBlock says
 // ============================================================================
 i32 bfsInitDir(FILE* fp) {
   if (fp == NULL) FATAL(ENULLPTR);
   i8 buf[BYTESPERBLOCK] = {0};
+  bfsLockMeta();
+  bfsPublish((void**)&bfsVol()->dir, NULL);     // drop any stale index
+  bfsUnlockMeta();
+
+  i8 sb[BYTESPERBLOCK];
+  bioRead(DBNSUPER, sb);
+  i32 cow = ((Super*)sb)->cowDir;
+  if (cow != 0) bioWrite(cow, buf);
   return bioWrite(DBNDIR, buf);
 }
 
 
 
 // ============================================================================
-// Write the initial Inodes block, of all zeroes, into DBN 1
+// Write the initial Inodes block, of all zeroes, into DBN 1, and on a
+// copy-on-write disk where its SuperBlock says.  There, DBN 1 is DBNSUPER2,
+// and zeroes mark the second copy empty
 // ============================================================================
 i32 bfsInitInodes(FILE* fp) {
   if (fp == NULL) FATAL(ENULLPTR);
   i8 buf[BYTESPERBLOCK] = {0};
+  bfsLockMeta();
+  bfsPublish((void**)&bfsVol()->inodeSnap, NULL);   // drop stale Inodes
+  bfsUnlockMeta();
+
+  i8 sb[BYTESPERBLOCK];
+  bioRead(DBNSUPER, sb);
+  i32 cow = ((Super*)sb)->cowInodes;
+  if (cow != 0) bioWrite(cow, buf);
   return bioWrite(DBNINODES, buf);
 }
 
 
 
 // ============================================================================
-// Initialize the Open File Table to all zeroes
+// Set the Incore table of volume 'vol' to all zeroes, each entry pointing
+// back at 'vol', with its lock ready
+// ============================================================================
+static void bfsInitIncore(Volume* vol) {
+  memset(vol->incore, 0, sizeof(vol->incore));
+  for (i32 inum = 0; inum < NUMINODES; ++inum) {
+    pthread_rwlock_init(&vol->incore[inum].lock, NULL);
+    vol->incore[inum].vol = vol;
+  }
+}
+
+
+
+// ============================================================================
+// Initialize the Open File Table to empty, releasing its chunks, and the
+// Incore table of every mounted volume to all zeroes
 // ============================================================================
 i32 bfsInitOFT() {
-  for (i32 i = 0; i < NUMOFTENTRIES; ++i) {
-    g_oft[i].inum = 0;
-    g_oft[i].curs = 0;
-    g_oft[i].refs = 0;
+  pthread_mutex_lock(&g_oftLock);
+  for (i32 c = 0; c < g_oftChunks; ++c) free(g_oft[c]);
+  free(g_oft);
+  g_oft       = NULL;
+  g_oftChunks = 0;
+  g_oftFree   = -1;
+  pthread_mutex_unlock(&g_oftLock);
+
+  pthread_mutex_lock(&g_volsLock);
+  for (i32 v = 0; v < MAXVOLUMES; ++v) {
+    if (g_vols[v] != NULL && g_vols[v]->mounted) bfsInitIncore(g_vols[v]);
   }
+  pthread_mutex_unlock(&g_volsLock);
   return 0;
 }
 
 
 // ============================================================================
-// Write the initial Super block into DBN 0
+// Write the initial Super block into DBN 0, for a disk whose metadata is
+// updated as 'mode' says: JNLLOG or JNLCOW (jnl.h)
 // ============================================================================
-i32 bfsInitSuper(FILE* fp) {
+i32 bfsInitSuper(FILE* fp, i32 mode) {
 
   if (fp == NULL) FATAL(ENULLPTR);
 
   Super sb;
+  memset(&sb, 0, sizeof(Super));          // no blocks shared
   sb.numBlocks = BLOCKSPERDISK;           // eg: 100
   sb.numInodes = NUMINODES;               // eg: 8
-  sb.firstFree = NUMMETA;                 // eg: 3
+  sb.firstFree = 0;                       // see bfsInitFreeList
+  sb.dirFormat = DIRPACKED;               // new disks use DirEnt records
+  if (mode == JNLCOW) {                   // and metadata copied on write,
+    sb.cowInodes = MINDBN;                //   starting before the data
+    sb.cowDir    = MINDBN + 1;
+  } else {
+    sb.jnlStart  = MINDBN;                // or a journal, before the data
+  }
 
   i8 buf[BYTESPERBLOCK] = {0};
   memcpy(buf, &sb, sizeof(Super));
 
+  Volume* vol = bfsVol();
+  __atomic_store_n(&vol->superLoaded, 0, __ATOMIC_RELEASE);   // drop stale copy
   return bioWrite(DBNSUPER, buf);
 }
 
 
 
 // ============================================================================
-// Convert between inum (internal) and FileDescriptor (user-visible)
+// Return the DBN of the current volume's Inodes block: DBNINODES, or on a
+// copy-on-write disk, wherever its last store moved it
 // ============================================================================
-i32 bfsInumToFd(i32 inum) { return inum + INUMTOFD; }
+i32 bfsInodesDbn() {
+  i32 dbn = bfsLoadSuper()->cowInodes;
+  return (dbn != 0) ? dbn : DBNINODES;
+}
+
 
 
 // ============================================================================
-// Lookup 'fname' in the Directory.  If found, return its inum.  If not,
-// return EFNF
+// Take every DBN idling in a thread cache of volume 'vol' back into its free
+// bitmap, for a thread that found the map empty.  The caches find those DBNs
+// gone when they next pop them.  Return 1 if any came back, else 0
 // ============================================================================
-i32 bfsLookupFile(str fname) {
+static i32 bfsReclaimCached(Volume* vol) {
+  i32 any = 0;
+  for (i32 w = 0; w < FREEWORDS; ++w) {
+    u64 bits = __atomic_exchange_n(&vol->cachedWords[w], 0, __ATOMIC_ACQ_REL);
+    if (bits == 0) continue;
+    __atomic_fetch_or(&vol->freeWords[w], bits, __ATOMIC_RELEASE);
+    any = 1;
+  }
+  return any;
+}
 
-  if (fname == NULL) FATAL(ENULLPTR);
 
-  i8 buf[BYTESPERBLOCK] = {0};
 
-  bioRead(DBNDIR, buf);
+// ============================================================================
+// Make the DBNs of volume 'vol' whose free awaits a commit reusable, for a
+// thread that found the map empty: commit the running transaction.  Not
+// from inside an operation on 'vol', which the commit would wait for: those
+// reserve their blocks at jnlBegin instead.  Return 1 if any came back,
+// else 0
+// ============================================================================
+static i32 bfsReclaimPending(Volume* vol) {
+  i32 any = 0;
+  for (i32 w = 0; w < FREEWORDS; ++w) {
+    if (__atomic_load_n(&vol->pendingWords[w], __ATOMIC_ACQUIRE)) any = 1;
+  }
+  return any && jnlCommit(vol) == 0;
+}
+
 
-  Dir* dir = (Dir*)buf;
 
-  for (int inum = 0; inum < NUMINODES; ++inum) {
-    if (strcmp(fname, dir->fname[inum]) == 0) {
-      bfsRefOFT(inum);
-      return inum;
+// ============================================================================
+// Give this thread's cached DBNs back to the free bitmap of the volume they
+// came from, unless its map has been loaded again since.  Runs as the
+// destructor of g_cacheKey, when a thread that allocated exits, and when the
+// thread starts allocating on another volume
+// ============================================================================
+static void bfsReturnCache(void* unused) {
+  (void)unused;
+  Volume* vol = t_cacheVol;
+  if (vol == NULL) return;
+
+  __atomic_add_fetch(&vol->returning, 1, __ATOMIC_SEQ_CST);
+  if (t_cacheGen != __atomic_load_n(&vol->allocGen, __ATOMIC_SEQ_CST)) {
+    t_cacheLen = 0;                       // stale: the map counts them free
+  }
+  while (t_cacheLen > 0) {
+    i32 dbn = t_cache[--t_cacheLen];
+    u64 bit = (u64)1 << (dbn % 64);
+    u64 old = __atomic_fetch_and(&vol->cachedWords[dbn / 64], ~bit,
+                                 __ATOMIC_ACQ_REL);
+    if (old & bit) {                      // still ours: not reclaimed
+      __atomic_fetch_or(&vol->freeWords[dbn / 64], bit, __ATOMIC_RELEASE);
     }
   }
+  __atomic_sub_fetch(&vol->returning, 1, __ATOMIC_RELEASE);
+}
 
-  return EFNF;
 
+
+// ============================================================================
+// Make every thread's cache of DBNs from volume 'vol' stale, and wait out
+// any bfsReturnCache already handing DBNs back to it.  After this, no thread
+// touches its free bitmap words until the map is loaded anew
+// ============================================================================
+static void bfsStaleCaches(Volume* vol) {
+  __atomic_store_n(&vol->allocGen, 0, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&vol->returning, __ATOMIC_SEQ_CST) > 0) {
+    sched_yield();
+  }
 }
 
 
 
 // ============================================================================
-// Read FBN 'fbn' for the file whose inum is 'inum' into 'buf'
+// Claim up to 'max' free DBNs from the free bitmap of volume 'vol' into
+// 'out', lowest first.  Each word gives up its bits in one compare-and-swap,
+// so threads that claim at once never get the same DBN and never wait on a
+// lock.  Return the number claimed
 // ============================================================================
-i32 bfsRead(i32 inum, i32 fbn, i8* buf) {
+static i32 bfsClaimFree(Volume* vol, i16* out, i32 max) {
+  i32 n = 0;
+  for (i32 w = 0; w < FREEWORDS && n < max; ++w) {
+    u64 cur = __atomic_load_n(&vol->freeWords[w], __ATOMIC_ACQUIRE);
+    while (cur != 0 && n < max) {
+      u64 take = 0;                       // lowest free bits, up to 'max'
+      u64 rest = cur;
+      for (i32 k = n; rest != 0 && k < max; ++k) {
+        take |= rest & -rest;
+        rest &= rest - 1;
+      }
+      if (!__atomic_compare_exchange_n(&vol->freeWords[w], &cur, cur & ~take,
+                                        0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+        continue;                         // lost a race: 'cur' is reloaded
+      }
+      __atomic_fetch_or(&vol->cachedWords[w], take, __ATOMIC_RELEASE);
+      cur &= ~take;
+      for (; take != 0; take &= take - 1) {
+        out[n++] = w * 64 + __builtin_ctzll(take);
+      }
+    }
+  }
+  return n;
+}
 
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
-  if (fbn  < 0)       FATAL(EBADFBN);
-  if (fbn  > MAXFBN)  FATAL(EBADFBN);
 
-  i32 dbn = bfsFbnToDbn(inum, fbn);
 
-  bioRead(dbn, buf);
-  return 0;
+// ============================================================================
+// Create the key whose destructor hands a thread's cached DBNs back.  Run
+// once, by pthread_once, from the first bfsTakeBlock that fills a cache
+// ============================================================================
+static void bfsInitCacheKey() {
+  pthread_key_create(&g_cacheKey, bfsReturnCache);
 }
 
 
+
 // ============================================================================
-// Read the Inodes block.  Extract and return the Inode whose number is 'inum'.
-// On success, return 0.  On failure, abort
+// Read the Dir block into memory, decoding either Dir format, hash every
+// name into a new Directory index, and publish it.  Only the first call reads
+// the disk; later ones take no lock.  On success, return 0.  On failure,
+// abort
 // ============================================================================
-i32 bfsReadInode(i32 inum, Inode* inode) {
+i32 bfsLoadDir() {
+  Volume* vol = bfsVol();
+  if (__atomic_load_n(&vol->dir, __ATOMIC_ACQUIRE) != NULL) return 0;
 
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
-  if (inode == NULL)  FATAL(ENULLPTR);
+  bfsLockMeta();
+  if (vol->dir != NULL) { bfsUnlockMeta(); return 0; }
+
+  vol->dirFormat = bfsLoadSuper()->dirFormat;
 
   i8 buf[BYTESPERBLOCK] = {0};
+  bioRead(bfsDirDbn(), buf);
+  DirSnap* dir = calloc(1, sizeof(DirSnap));
+  if (dir == NULL) FATAL(ENOMEM);
+
+  if (vol->dirFormat == DIRPACKED) {
+    for (i32 off = 0; off + DIRENTHDR <= BYTESPERBLOCK; ) {
+      DirEnt* de = (DirEnt*)&buf[off];
+      if (de->reclen == 0) break;                       // end of entries
+      if (de->inum < 0)       FATAL(EBADINUM);
+      if (de->inum > MAXINUM) FATAL(EBADINUM);
+      if (off + DIRENTSIZE(de->namelen) > BYTESPERBLOCK) FATAL(EBADREAD);
+      memcpy(dir->name[de->inum], de->name, de->namelen);
+      dir->len[de->inum] = de->namelen;
+      off += de->reclen;
+    }
+  } else {
+    Dir* fixed = (Dir*)buf;
+    for (i32 inum = 0; inum < NUMINODES; ++inum) {
+      i32 len = strnlen(fixed->fname[inum], FNAMESIZE - 1);
+      memcpy(dir->name[inum], fixed->fname[inum], len);
+      dir->len[inum] = len;
+    }
+  }
 
-  bioRead(DBNINODES, buf);
+  for (i32 b = 0; b < NUMDIRBUCKETS; ++b) dir->head[b] = -1;
 
-  Inode* inodes = (Inode*)buf;
+  for (i32 inum = NUMINODES - 1; inum >= 0; --inum) {
+    dir->next[inum] = -1;
+    if (dir->len[inum] == 0) continue;                  // inum not in use
+    u32 b = bfsHashName(dir->name[inum]) % NUMDIRBUCKETS;
+    dir->next[inum] = dir->head[b];
+    dir->head[b] = inum;
+  }
 
-  memcpy(inode, &inodes[inum], sizeof(Inode));
+  bfsPublish((void**)&vol->dir, dir);
+  bfsUnlockMeta();
   return 0;
 }
 
 
 
 // ============================================================================
-// Reference file with Inode number 'inum' in the Open File Table
+// Return the cached SuperBlock, reading it on first use, from the DBN
+// jnlSuper gives.  Callers that read or change it must hold the metaLock
+// (bfsLockMeta), and after a change call bfsDirtySuper.  A disk still on the
+// linked Freelist is converted to the free bitmap here, once
 // ============================================================================
-i32 bfsRefOFT(i32 inum) {
-  i32 ofte = bfsFindOFTE(inum);
-  ++g_oft[ofte].refs;
-  return 0;
+Super* bfsLoadSuper() {
+  Volume* vol = bfsVol();
+  if (__atomic_load_n(&vol->superLoaded, __ATOMIC_ACQUIRE)) return &vol->super;
+
+  bfsLockMeta();
+  if (vol->superLoaded) { bfsUnlockMeta(); return &vol->super; }
+
+  i8 buf[BYTESPERBLOCK] = {0};
+  bioRead(jnlSuper(vol), buf);
+  memcpy(&vol->super, buf, sizeof(Super));
+
+  i32 convert = (vol->super.freeFormat == FREELIST);
+  if (convert) {                          // walk the Freelist into the map
+    memset(vol->super.freeMap, 0, FREEMAPBYTES);
+    i16 buf16[I16SPERBLOCK];
+    for (i32 dbn = vol->super.firstFree; dbn != 0; dbn = buf16[0]) {
+      if (dbn < MINDBN || dbn >= BLOCKSPERDISK) FATAL(EBADDBN);
+      vol->super.freeMap[dbn / 8] |= 1 << (dbn % 8);
+      bioRead(dbn, buf16);
+    }
+    vol->super.firstFree  = 0;
+    vol->super.freeFormat = FREEMAP;
+  }
+
+  bfsStaleCaches(vol);
+  memset(vol->freeWords,   0, sizeof(vol->freeWords));
+  memset(vol->cachedWords, 0, sizeof(vol->cachedWords));
+  memset(vol->pendingWords, 0, sizeof(vol->pendingWords));
+  for (i32 dbn = 0; dbn < BLOCKSPERDISK; ++dbn) {
+    if (vol->super.freeMap[dbn / 8] & (1 << (dbn % 8))) {
+      vol->freeWords[dbn / 64] |= (u64)1 << (dbn % 64);
+    }
+  }
+  i32 gen = __atomic_add_fetch(&g_allocGen, 1, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&vol->allocGen, gen, __ATOMIC_RELEASE);
+  __atomic_store_n(&vol->superDirty, 0, __ATOMIC_RELEASE);
+
+  __atomic_store_n(&vol->superLoaded, 1, __ATOMIC_RELEASE);
+  if (convert) bfsStoreSuper();
+  bfsUnlockMeta();
+  return &vol->super;
 }
 
 
 
 // ============================================================================
-// Set cursor position for the file open on File Descriptor 'fd' to 'newCurs'
+// Lock file 'ic' for its data and block mapping: shared if 'excl' is 0, for
+// reads; exclusive otherwise, for anything that writes or remaps
 // ============================================================================
-i32 bfsSetCursor(i32 inum, i32 newCurs) {
+i32 bfsLockInode(Incore* ic, i32 excl) {
+  if (ic == NULL) FATAL(ENULLPTR);
+  if (excl) pthread_rwlock_wrlock(&ic->lock);
+  else      pthread_rwlock_rdlock(&ic->lock);
+  return 0;
+}
 
-  if (inum < 0) FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
 
-  i32 ofte = bfsFindOFTE(inum);
-  g_oft[ofte].curs = newCurs;
+
+// ============================================================================
+// Lock file 'in' shared and file 'out' exclusive, as a copy from one to the
+// other needs.  The file on the lower volume handle, then with the lower
+// inum, is locked first; the same file is locked once, exclusive
+// ============================================================================
+i32 bfsLockInodePair(Incore* in, Incore* out) {
+  if (in == NULL || out == NULL) FATAL(ENULLPTR);
+  if (in == out) return bfsLockInode(out, 1);
+  i32 inFirst = (in->vol->id != out->vol->id) ? in->vol->id < out->vol->id
+                                              : in->inum < out->inum;
+  if (inFirst) {
+    bfsLockInode(in, 0);
+    bfsLockInode(out, 1);
+  } else {
+    bfsLockInode(out, 1);
+    bfsLockInode(in, 0);
+  }
   return 0;
 }
 
 
 
 // ============================================================================
-// Return the cursor position for the file open on File Descriptor 'fd'
+// Take the current volume's metaLock, which guards its SuperBlock and free
+// bitmap, the Inodes block, the Directory index, and the contents of every
+// Incore.  It is recursive: a thread may take it again while holding it
 // ============================================================================
-i32 bfsTell(i32 fd) {
-  i32 inum = bfsFdToInum(fd);
-  i32 ofte = bfsFindOFTE(inum);
-  return g_oft[ofte].curs;
+i32 bfsLockMeta() {
+  pthread_mutex_lock(&bfsVol()->metaLock);
+  return 0;
 }
 
 
 
 // ============================================================================
-// Return the size of the file whose Inode number is 'inum'
+// Lookup 'fname' in the Directory.  If found, return its inum.  If not,
+// return EFNF.  Reads the published index, without a lock
 // ============================================================================
-i32 bfsGetSize(i32 inum) {
+i32 bfsLookupFile(str fname) {
 
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (fname == NULL) FATAL(ENULLPTR);
 
-  Inode inode;
-  bfsReadInode(inum, &inode);
+  i32 len = strlen(fname);
+  if (len > FNAMEMAX) return EFNF;                      // cannot be stored
+
+  char key[FNAMEMAX + 1] = {0};                         // zero-padded key
+  memcpy(key, fname, len);
+
+  Volume* vol = bfsVol();
+  bfsLoadDir();
+
+  u32 b = bfsHashName(fname) % NUMDIRBUCKETS;
+
+  epochEnter();
+  DirSnap* dir = __atomic_load_n(&vol->dir, __ATOMIC_SEQ_CST);
+  i32 inum = -1;
+  if (dir != NULL) inum = dir->head[b];         // NULL: dropped by a format
+  for (; inum >= 0; inum = dir->next[inum]) {
+    if (dir->len[inum] != len) continue;
+    if (bfsNameEq(dir->name[inum], key, len)) break;
+  }
+  epochExit();
+
+  return (inum >= 0) ? inum : EFNF;
 
-  return inode.size;
 }
 
 
 
 // ============================================================================
-// Set size of file 'inum' to 'size
+// Point FBN 'fbn' of file 'inum' at DBN 'dbn', in the Inode or its indirect
+// block (allocating that, if need be).  Keeps the Incore map in step.  On
+// success, return 0.  On failure, abort
 // ============================================================================
-i32 bfsSetSize(i32 inum, i32 size) {
+i32 bfsMapBlock(i32 inum, i32 fbn, i32 dbn) {
 
   if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
+  if (fbn  < 0)       FATAL(EBADFBN);
+  if (fbn  > MAXFBN)  FATAL(EBADFBN);
+
+  bfsLockMeta();
 
   Inode inode;
   bfsReadInode(inum, &inode);
-  
-  inode.size = size;
-  bfsWriteInode(inum, &inode);
+
+  if (fbn < NUMDIRECT) {                  // in direct[] array?
+    inode.direct[fbn] = dbn;
+    bfsWriteInode(inum, &inode);
+    bfsUnlockMeta();
+    return 0;
+  }
+
+  i16 buf16[I16SPERBLOCK] = {0};          // in indirect block
+  i32 dbnIndirect = inode.indirect;       // DBN of indirect block
+  if (dbnIndirect != 0) bioRead(dbnIndirect, buf16);
+  buf16[fbn - NUMDIRECT] = dbn;
+
+  if (dbnIndirect == 0) {                 // not yet allocated: fill it first
+    inode.indirect = bfsFindFreeBlock();
+    jnlWrite(inode.indirect, buf16);
+  } else {
+    bfsStoreMeta(&inode.indirect, buf16); // copy-on-write may move it
+  }
+  if (inode.indirect != dbnIndirect) bfsWriteInode(inum, &inode);
+
+  Incore* ic = bfsFindIncore(inum);       // keep cached map in step
+  if (ic != NULL) {
+    memcpy(ic->map, buf16, sizeof(ic->map));
+    ic->mapped = 1;
+  }
+
+  bfsUnlockMeta();
   return 0;
 }
 
 
 
 // ============================================================================
-// Update the Inodes block on disk with the info in 'inode'
+// Mount 'path' in the volume table, with g_volsLock held: the volume that
+// already has it, else a free slot (VOLDEFAULT, for BFSDISK), with empty
+// caches and its journal opened.  Return its handle.  If every slot is in
+// use, abort with EVOLFULL
 // ============================================================================
-i32 bfsWriteInode(i32 inum, Inode* inode) {
+static i32 bfsMountLocked(str path) {
+  for (i32 v = 0; v < MAXVOLUMES; ++v) {
+    Volume* vol = g_vols[v];
+    if (vol != NULL && vol->mounted && strcmp(vol->path, path) == 0) return v;
+  }
 
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
-  if (inode == NULL)  FATAL(ENULLPTR);
+  i32 id = -1;
+  if (strcmp(path, BFSDISK) == 0) {
+    id = VOLDEFAULT;
+  } else {
+    for (i32 v = VOLDEFAULT + 1; v < MAXVOLUMES && id < 0; ++v) {
+      if (g_vols[v] == NULL || g_vols[v]->mounted == 0) id = v;
+    }
+    if (id < 0) FATAL(EVOLFULL);
+  }
 
-  i8 buf[BYTESPERBLOCK];
-  bioRead(DBNINODES, buf);
-  Inode* inodes = (Inode*)buf;
-  memcpy(&inodes[inum], inode, sizeof(Inode));
-  bioWrite(DBNINODES, buf);
+  Volume* vol = g_vols[id];
+  if (vol == NULL) {                      // first use of the slot
+    vol = calloc(1, sizeof(Volume));
+    if (vol == NULL) FATAL(ENOMEM);
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&vol->metaLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&vol->dirtyLock, NULL);
+    pthread_cond_init (&vol->flushDone, NULL);
+    vol->id = id;                         // the slot's, for good
+    __atomic_store_n(&g_vols[id], vol, __ATOMIC_RELEASE);
+  }
+
+  strcpy(vol->path, path);
+  vol->bioFd       = -1;
+  vol->superLoaded = 0;
+  vol->dirFormat   = DIRFIXED;
+  bfsPublish((void**)&vol->dir,       NULL);
+  bfsPublish((void**)&vol->inodeSnap, NULL);
+  vol->metaDepth   = 0;
+  vol->metaDirty   = 0;
+  bfsInitIncore(vol);
+  __atomic_store_n(&vol->mounted, 1, __ATOMIC_RELEASE);
+
+  jnlOpen(vol);                           // replay its journal, if any
+  return id;
+}
+
+
+
+// ============================================================================
+// Mount the BFS disk held in image file 'path', which must already exist, and
+// return its volume handle.  Nothing but its journal, which is replayed, is
+// read until first use.  A disk that is already mounted keeps its handle;
+// BFSDISK's is always VOLDEFAULT.  On failure, abort
+// ============================================================================
+i32 bfsMount(str path) {
+
+  if (path == NULL) FATAL(ENULLPTR);
+  if (strlen(path) >= VOLPATHMAX) FATAL(EBIGFNAME);
+
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) FATAL(ENODISK);         // no such disk
+  fclose(fp);
+
+  pthread_mutex_lock(&g_volsLock);
+  i32 id = bfsMountLocked(path);
+  pthread_mutex_unlock(&g_volsLock);
+  return id;
+}
+
+
+
+// ============================================================================
+// Compare names 'a' and 'b', each held zero-padded in FNAMEMAX + 1 bytes, over
+// bytes 0..len (the name plus its NUL).  Return 1 if equal, else 0.  With
+// SSE2, compares 16 bytes per step; else falls back to a scalar loop
+// ============================================================================
+i32 bfsNameEq(char* a, char* b, i32 len) {
+#if defined(__SSE2__)
+  for (i32 i = 0; i <= len; i += 16) {
+    __m128i va = _mm_loadu_si128((__m128i*)&a[i]);
+    __m128i vb = _mm_loadu_si128((__m128i*)&b[i]);
+    u32 eq   = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+    i32 n    = MIN(16, len + 1 - i);                    // bytes that count
+    u32 want = (n == 16) ? 0xFFFF : (1u << n) - 1;
+    if ((eq & want) != want) return 0;
+  }
+  return 1;
+#else
+  for (i32 i = 0; i <= len; ++i) {
+    if (a[i] != b[i]) return 0;
+  }
+  return 1;
+#endif
+}
+
+
+
+// ============================================================================
+// Map FBN 'fbn' of file 'inum', which must be unmapped, along with up to
+// NUMPREALLOC - 1 unmapped FBNs after it, so that a run of appends finds its
+// blocks already allocated.  Blocks past EOF are never read: writers treat
+// them as fresh, readers stop at EOF.  Return the DBN for 'fbn'
+// ============================================================================
+i32 bfsPrealloc(i32 inum, i32 fbn) {
+  i32 dbn = bfsAllocBlock(inum, fbn);
+
+  i32 f = fbn + 1;
+  for (; f < fbn + NUMPREALLOC && f < MAXFBN; ++f) {
+    if (bfsFbnToDbn(inum, f) != ENODBN) break;
+    i32 more = bfsTakeBlock();
+    if (more == 0) break;                 // disk full: leave the rest alone
+    bfsMapBlock(inum, f, more);
+  }
+
+  bfsLockMeta();
+  Incore* ic = bfsFindIncore(inum);
+  if (ic != NULL && f > ic->preEnd) ic->preEnd = f;
+  bfsUnlockMeta();
+  return dbn;
+}
+
+
+
+// ============================================================================
+// Publish snapshot 'snap' (or NULL, to drop it) at '*slot', for readers that
+// take no lock, and retire the one it replaces.  The caller holds the
+// metaLock, or the volume is not mounted.  On success, return 0
+// ============================================================================
+i32 bfsPublish(void** slot, void* snap) {
+  if (slot == NULL) FATAL(ENULLPTR);
+  void* old = *slot;
+  __atomic_store_n(slot, snap, __ATOMIC_SEQ_CST);
+  return epochRetire(old);
+}
+
+
+
+// ============================================================================
+// Read FBN 'fbn' for the file whose inum is 'inum' into 'buf'.  A block never
+// written (a hole before EOF) reads as zeroes
+// ============================================================================
+i32 bfsRead(i32 inum, i32 fbn, i8* buf) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (fbn  < 0)       FATAL(EBADFBN);
+  if (fbn  > MAXFBN)  FATAL(EBADFBN);
+
+  i32 dbn = bfsFbnToDbn(inum, fbn);
+  if (dbn == ENODBN) {
+    memset(buf, 0, BYTESPERBLOCK);
+    return 0;
+  }
+
+  bioRead(dbn, buf);
+  return 0;
+}
+
+
+
+// ============================================================================
+// List up to 'max' files into 'ents', in inum order, each with its name and
+// Inode attributes.  One pass over the Directory index, one read of the
+// Inodes block, and one read per indirect block not already cached.  Return
+// the number of entries filled
+// ============================================================================
+i32 bfsReadDirPlus(i32 max, DirPlus* ents) {
+
+  if (ents == NULL) FATAL(ENULLPTR);
+
+  Volume* vol = bfsVol();
+  bfsLockMeta();
+  bfsLoadDir();
+  DirSnap* dir = vol->dir;
+  Super* super = bfsLoadSuper();
+
+  i8 buf[BYTESPERBLOCK] = {0};
+  bfsReadInodes(buf);
+  Inode* inodes = (Inode*)buf;
+
+  i32 n = 0;
+  for (i32 inum = 0; inum < NUMINODES && n < max; ++inum) {
+    if (dir->len[inum] == 0) continue;            // inum not in use
+
+    DirPlus* e = &ents[n++];
+    e->inum = inum;
+    memcpy(e->name, dir->name[inum], FNAMEMAX + 1);
+
+    Incore* ic = bfsFindIncore(inum);             // newest copy, if open
+    e->inode = (ic != NULL) ? ic->inode : inodes[inum];
+    e->size  = e->inode.size;
+    e->numBlocks = 0;
+    e->numShared = 0;
+
+    i16 map[NUMINDIRECT] = {0};
+    if (e->inode.indirect != 0) {
+      if (ic != NULL && ic->mapped) memcpy(map, ic->map, sizeof(map));
+      else                          bioRead(e->inode.indirect, map);
+    }
+
+    for (i32 fbn = 0; fbn < NUMDIRECT + NUMINDIRECT; ++fbn) {
+      i32 dbn = (fbn < NUMDIRECT) ? e->inode.direct[fbn]
+                                  : map[fbn - NUMDIRECT];
+      if (dbn <= 0 || dbn >= BLOCKSPERDISK) continue;
+      ++e->numBlocks;
+      if (super->shared[dbn] > 0) ++e->numShared;
+    }
+  }
+  bfsUnlockMeta();
+  return n;
+}
+
+
+// ============================================================================
+// Copy the Inode whose number is 'inum' into 'inode', from the volume's
+// published InodeSnap, without a lock.  The first read loads the Inodes
+// block and publishes it.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 bfsReadInode(i32 inum, Inode* inode) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (inode == NULL)  FATAL(ENULLPTR);
+
+  Volume* vol = bfsVol();
+  epochEnter();
+  InodeSnap* snap = __atomic_load_n(&vol->inodeSnap, __ATOMIC_SEQ_CST);
+  if (snap == NULL) {                     // first read: load and publish
+    bfsLockMeta();
+    if (vol->inodeSnap == NULL) {
+      InodeSnap* s = malloc(sizeof(InodeSnap));
+      if (s == NULL) FATAL(ENOMEM);
+      i8 buf[BYTESPERBLOCK] = {0};
+      bfsReadInodes(buf);
+      memcpy(s->inode, buf, sizeof(s->inode));
+      bfsPublish((void**)&vol->inodeSnap, s);
+    }
+    snap = vol->inodeSnap;
+    bfsUnlockMeta();
+  }
+  memcpy(inode, &snap->inode[inum], sizeof(Inode));
+  epochExit();
+  return 0;
+}
+
+
+
+// ============================================================================
+// Read the whole Inodes block into 'buf': the deferred copy, inside
+// bfsBeginMeta, else from disk.  On success, return 0
+// ============================================================================
+i32 bfsReadInodes(i8* buf) {
+  if (buf == NULL) FATAL(ENULLPTR);
+  Volume* vol = bfsVol();
+  bfsLockMeta();
+  if (vol->metaDepth > 0) memcpy(buf, vol->inodes, BYTESPERBLOCK);
+  else                    bioRead(bfsInodesDbn(), buf);
+  bfsUnlockMeta();
+  return 0;
+}
+
+
+
+// ============================================================================
+// Take a reference on the in-memory Inode for 'inum', reading it in from
+// disk if no OFT entry has the file open yet.  Return it
+// ============================================================================
+Incore* bfsRefIncore(i32 inum) {
+  Volume* vol = bfsVol();
+  bfsLockMeta();
+  Incore* ic = bfsFindIncore(inum);
+  if (ic != NULL) {
+    ++ic->refs;
+    bfsUnlockMeta();
+    return ic;
+  }
+
+  ic = &vol->incore[inum];
+  bfsReadInode(inum, &ic->inode);         // before 'ic' becomes findable
+  ic->inum     = inum;
+  ic->mapped   = 0;
+  ic->reserved = ic->inode.size;
+  ic->preEnd   = 0;
+  ic->tailFbn  = -1;
+  ic->refs     = 1;
+  bfsUnlockMeta();
+  return ic;
+}
+
+
+
+// ============================================================================
+// Open file 'inum': give it a new Open File Table entry, with its own cursor,
+// sharing the file's in-memory Inode with any other opens.  Pops a slot from
+// the free list, growing the OFT if it is empty.  Return the File Descriptor
+// ============================================================================
+i32 bfsRefOFT(i32 inum) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+
+  pthread_mutex_lock(&g_oftLock);
+  if (g_oftFree < 0) bfsGrowOFT();
+
+  i32   slot = g_oftFree;
+  OFTE* ofte = &g_oft[slot / OFTCHUNK][slot % OFTCHUNK];
+  g_oftFree  = ofte->nextFree;
+
+  ofte->ic       = bfsRefIncore(inum);
+  ofte->curs     = 0;
+  ofte->flags    = 0;
+  ofte->nextFree = -1;
+  pthread_mutex_unlock(&g_oftLock);
+  return slot + FDBASE;
+}
+
+
+
+// ============================================================================
+// Claim the next 'numb' bytes at EOF of in-memory Inode 'ic' for one append,
+// and return the byte-offset where they start.  The claim is a single
+// compare-and-swap, so concurrent appenders each get their own range
+// without taking a lock
+// ============================================================================
+i32 bfsReserveAppend(Incore* ic, i32 numb) {
+  if (ic == NULL) FATAL(ENULLPTR);
+  if (numb < 0)   FATAL(ENEGNUMB);
+
+  i32 cur = __atomic_load_n(&ic->reserved, __ATOMIC_ACQUIRE);
+  i32 start;
+  do {                                    // size is stored atomically, too
+    i32 size = __atomic_load_n(&ic->inode.size, __ATOMIC_ACQUIRE);
+    start = MAX(cur, size);               // fsPwrite may have grown the file
+  } while (!__atomic_compare_exchange_n(&ic->reserved, &cur, start + numb, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  return start;
+}
+
+
+
+// ============================================================================
+// Set cursor position for the file open on File Descriptor 'fd' to 'newCurs'
+// ============================================================================
+i32 bfsSetCursor(i32 fd, i32 newCurs) {
+
+  if (newCurs < 0) FATAL(EBADCURS);
+
+  bfsFindOFTE(fd)->curs = newCurs;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Add an owner to block 'dbn', which a clone now maps too.  Return 0, or
+// EBIGNUMB if the share count is already at MAXSHARED
+// ============================================================================
+i32 bfsShareBlock(i32 dbn) {
+
+  if (dbn < MINDBN)         FATAL(EBADDBN);
+  if (dbn >= BLOCKSPERDISK) FATAL(EBADDBN);
+
+  bfsLockMeta();
+  Super* super = bfsLoadSuper();
+  i32 ret = EBIGNUMB;
+  if (super->shared[dbn] < MAXSHARED) {
+    ++super->shared[dbn];
+    ret = bfsDirtySuper();
+  }
+  bfsUnlockMeta();
+  return ret;
+}
+
+
+
+// ============================================================================
+// Write the Directory index back to the Dir block, in the disk's Dir format
+// (at bfsEndMeta, if deferred).  On success, return 0.  If the names do not
+// fit in one block, return EDIRFULL and leave the disk unchanged
+// ============================================================================
+i32 bfsStoreDir() {
+  bfsLockMeta();
+  i32 ret = bfsStoreDirLocked();
+  bfsUnlockMeta();
+  return ret;
+}
+
+
+
+// ============================================================================
+// bfsStoreDir, for a caller that holds the metaLock
+// ============================================================================
+i32 bfsStoreDirLocked() {
+  Volume* vol = bfsVol();
+  i8 buf[BYTESPERBLOCK];
+  if (bfsEncodeDir(vol->dir, buf) == EDIRFULL) return EDIRFULL;
+
+  if (vol->metaDepth > 0) {               // names fit: write at bfsEndMeta
+    vol->metaDirty |= METADIR;
+    return 0;
+  }
+  Super* super = bfsLoadSuper();
+  if (super->cowDir == 0) return jnlWrite(DBNDIR, buf);
+  return bfsStoreMeta(&super->cowDir, buf);
+}
+
+
+
+// ============================================================================
+// Store 'buf' as the current volume's Inodes block: at DBNINODES, or on a
+// copy-on-write disk, where bfsStoreMeta puts it.  The caller holds the
+// metaLock.  On success, return 0
+// ============================================================================
+i32 bfsStoreInodes(i8* buf) {
+  Super* super = bfsLoadSuper();
+  if (super->cowInodes == 0) return jnlWrite(DBNINODES, buf);
+  return bfsStoreMeta(&super->cowInodes, buf);
+}
+
+
+
+// ============================================================================
+// Store 'buf' as the metadata block at '*dbn' of the current volume.  On a
+// copy-on-write disk, a block the running transaction has not yet stored
+// moves: 'buf' goes to a free DBN, then '*dbn' names it, and the old one is
+// freed, reusable once the move commits.  So the last commit's copy is never
+// written over, and no commit names a block before holding it.  Elsewhere,
+// and once moved, the block stays put.  The caller holds the metaLock, and
+// stores a new '*dbn' where it came from.  On success, return 0
+// ============================================================================
+i32 bfsStoreMeta(i16* dbn, void* buf) {
+  if (dbn == NULL) FATAL(ENULLPTR);
+  if (bfsLoadSuper()->cowInodes == 0) return jnlWrite(*dbn, buf);
+  if (jnlRewrite(*dbn, buf)) return 0;    // the running transaction's own
+
+  i32 old = *dbn;
+  i32 to  = bfsFindFreeBlock();
+  jnlWrite(to, buf);
+  *dbn = to;
+  bfsFreeBlock(old);                      // dirties the SuperBlock
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write the cached SuperBlock back to DBNSUPER (at bfsEndMeta, if deferred),
+// with the free bitmap brought up to date, now.  Changes noted by
+// bfsDirtySuper need not call this: they are stored in bulk
+// ============================================================================
+i32 bfsStoreSuper() {
+  Volume* vol = bfsVol();
+  bfsLockMeta();
+
+  Super* super = bfsLoadSuper();
+  __atomic_store_n(&vol->superDirty, 0, __ATOMIC_RELEASE);  // then read map
+  i8 buf[BYTESPERBLOCK];
+  bfsEncodeSuper(vol, buf);
+  memcpy(super->freeMap, ((Super*)buf)->freeMap, FREEMAPBYTES);
+
+  if (vol->metaDepth > 0) {               // write it at bfsEndMeta
+    vol->metaDirty |= METASUPER;
+  } else {
+    jnlWrite(DBNSUPER, buf);
+  }
+  bfsUnlockMeta();
+  return 0;
+}
+
+
+
+// ============================================================================
+// Flush the disk of every mounted volume to stable storage.  Its journal
+// commits, and queued requests are issued, first.  g_volsLock is not held
+// meanwhile, as a commit waits for operations in progress.  On success,
+// return 0
+// ============================================================================
+i32 bfsSyncAll() {
+  Volume* prev = t_vol;
+  Volume* vols[MAXVOLUMES];
+  i32     n = 0;
+
+  pthread_mutex_lock(&g_volsLock);
+  for (i32 v = 0; v < MAXVOLUMES; ++v) {
+    if (g_vols[v] != NULL && g_vols[v]->mounted) vols[n++] = g_vols[v];
+  }
+  pthread_mutex_unlock(&g_volsLock);
+
+  for (i32 i = 0; i < n; ++i) {
+    jnlCommit(vols[i]);
+    if (!__atomic_load_n(&vols[i]->mounted, __ATOMIC_ACQUIRE)) continue;
+    t_vol = vols[i];
+    bioSync();
+  }
+  t_vol = prev;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Take a free block for this thread: pop its cache, refilling the cache from
+// the free bitmap when empty.  If the bitmap has run dry, the DBNs idling in
+// other threads' caches are taken back first, then those whose free awaits
+// a commit.  The SuperBlock is only marked dirty: its free bitmap is stored
+// once for all the blocks taken meanwhile, by the next commit, or without a
+// journal, at the end of the operation.  Return the DBN, or 0 if the disk
+// is full
+// ============================================================================
+i32 bfsTakeBlock() {
+  Volume* vol = bfsVol();
+  bfsLoadSuper();                         // free bitmap in memory
+
+  i32 gen = __atomic_load_n(&vol->allocGen, __ATOMIC_ACQUIRE);
+  if (t_cacheVol != vol || t_cacheGen != gen) {
+    bfsReturnCache(NULL);                 // another volume's, or stale
+  }
+
+  for (;;) {
+    while (t_cacheLen > 0) {
+      i32 dbn = t_cache[--t_cacheLen];
+      u64 bit = (u64)1 << (dbn % 64);
+      u64 old = __atomic_fetch_and(&vol->cachedWords[dbn / 64], ~bit,
+                                   __ATOMIC_ACQ_REL);
+      if ((old & bit) == 0) continue;     // reclaimed by another thread
+      bfsDirtySuper();
+      return dbn;
+    }
+
+    i16 got[ALLOCBATCH];
+    i32 n = bfsClaimFree(vol, got, ALLOCBATCH);
+    if (n == 0 && bfsReclaimCached(vol)) {  // free, but in others' caches
+      n = bfsClaimFree(vol, got, ALLOCBATCH);
+    }
+    if (n == 0 && bfsReclaimPending(vol)) { // freed, but not yet committed:
+      continue;                             //   commit, and look again
+    }
+    if (n == 0) return 0;
+    for (i32 i = 0; i < n; ++i) t_cache[i] = got[n - 1 - i];  // pop lowest
+    t_cacheLen = n;
+    t_cacheGen = gen;
+    t_cacheVol = vol;
+    pthread_once(&g_lockOnce, bfsInitCacheKey);
+    pthread_setspecific(g_cacheKey, &t_cacheLen);   // non-NULL: run at exit
+  }
+}
+
+
+
+// ============================================================================
+// Return the cursor position for the file open on File Descriptor 'fd'
+// ============================================================================
+i32 bfsTell(i32 fd) {
+  return bfsFindOFTE(fd)->curs;
+}
+
+
+
+// ============================================================================
+// Give back the blocks below FBN 'fbnEnd' that bfsPrealloc mapped past EOF
+// of in-memory Inode 'ic' and that no write has used.  Last close trims
+// them all.  A write that starts past EOF trims those it skips: they never
+// held data, so must not turn up inside the file.  On success, return 0
+// ============================================================================
+i32 bfsTrimPrealloc(Incore* ic, i32 fbnEnd) {
+  if (ic == NULL) FATAL(ENULLPTR);
+
+  bfsLockMeta();
+  i32 inum = ic->inum;
+  i32 fbn  = (ic->inode.size + BYTESPERBLOCK - 1) / BYTESPERBLOCK;
+  i32 end  = MIN(fbnEnd, ic->preEnd);
+  for (; fbn < end; ++fbn) {
+    i32 dbn = bfsFbnToDbn(inum, fbn);
+    if (dbn == ENODBN) continue;
+    bfsMapBlock(inum, fbn, 0);
+    bfsFreeBlock(dbn);
+  }
+  if (end == ic->preEnd) ic->preEnd = 0;
+  bfsUnlockMeta();
+  return 0;
+}
+
+
+
+// ============================================================================
+// Release the lock on file 'ic' taken by bfsLockInode
+// ============================================================================
+i32 bfsUnlockInode(Incore* ic) {
+  if (ic == NULL) FATAL(ENULLPTR);
+  pthread_rwlock_unlock(&ic->lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Release the locks taken by bfsLockInodePair
+// ============================================================================
+i32 bfsUnlockInodePair(Incore* in, Incore* out) {
+  bfsUnlockInode(out);
+  if (in != out) bfsUnlockInode(in);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Release the current volume's metaLock, once for each bfsLockMeta
+// ============================================================================
+i32 bfsUnlockMeta() {
+  pthread_mutex_unlock(&bfsVol()->metaLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Unmount volume 'vol': write back its SuperBlock, with the free bitmap,
+// close its journal, and close its disk.  Its handle may go to a later
+// bfsMount.  Return 0, or EVOLBUSY, leaving it mounted, while any file on it
+// is open or an fs call is at work on it
+// ============================================================================
+i32 bfsUnmount(i32 vol) {
+  Volume* prev = t_vol;
+  Volume* v    = bfsUseVol(vol);
+
+  pthread_mutex_lock(&g_volsLock);
+  pthread_mutex_lock(&v->metaLock);
+
+  i32 ret = 0;
+  for (i32 inum = 0; inum < NUMINODES; ++inum) {
+    if (v->incore[inum].refs > 0) ret = EVOLBUSY;
+  }
+  if (ret == 0 && v->metaDepth > 0) ret = EVOLBUSY;   // inside fsBatch
+
+  if (ret == 0 && v->superLoaded) bfsStoreSuper();  // cached DBNs: free
+  if (ret == 0) ret = jnlClose(v);
+
+  if (ret == 0) {
+    bfsStaleCaches(v);
+    bioClose();
+    v->superLoaded = 0;
+    bfsPublish((void**)&v->dir,       NULL);
+    bfsPublish((void**)&v->inodeSnap, NULL);
+    __atomic_store_n(&v->mounted, 0, __ATOMIC_RELEASE);
+  }
+
+  pthread_mutex_unlock(&v->metaLock);
+  pthread_mutex_unlock(&g_volsLock);
+  t_vol = (prev == v) ? NULL : prev;
+  return ret;
+}
+
+
+
+// ============================================================================
+// Make volume 'vol', a handle from bfsMount, the calling thread's current
+// volume, and return it.  VOLDEFAULT is mounted on first use; once
+// unmounted, it stays so until fsMountAt mounts BFSDISK again.  If 'vol' is
+// not mounted, abort with EBADVOL
+// ============================================================================
+Volume* bfsUseVol(i32 vol) {
+  if (vol < 0 || vol >= MAXVOLUMES) FATAL(EBADVOL);
+
+  Volume* v = __atomic_load_n(&g_vols[vol], __ATOMIC_ACQUIRE);
+  if (v == NULL || __atomic_load_n(&v->mounted, __ATOMIC_ACQUIRE) == 0) {
+    pthread_mutex_lock(&g_volsLock);      // settle a mount in progress
+    if (g_vols[vol] == NULL && vol == VOLDEFAULT) bfsMountLocked(BFSDISK);
+    v = g_vols[vol];
+    i32 mounted = (v != NULL && v->mounted);
+    pthread_mutex_unlock(&g_volsLock);
+    if (!mounted) FATAL(EBADVOL);
+  }
+
+  t_vol = v;
+  return v;
+}
+
+
+
+// ============================================================================
+// Make 'vol' the calling thread's current volume, as for a worker thread
+// acting on behalf of another.  On success, return 0
+// ============================================================================
+i32 bfsSetVolume(Volume* vol) {
+  if (vol == NULL) FATAL(ENULLPTR);
+  t_vol = vol;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return the calling thread's current volume: the one last picked by
+// bfsUseVol, or by bfsFindOFTE for an fd.  Until then, or once that volume
+// is unmounted, it is VOLDEFAULT
+// ============================================================================
+Volume* bfsVol() {
+  Volume* vol = t_vol;
+  if (vol != NULL && __atomic_load_n(&vol->mounted, __ATOMIC_ACQUIRE)) {
+    return vol;
+  }
+  return bfsUseVol(VOLDEFAULT);
+}
+
+
+
+// ============================================================================
+// Return the size of the file whose Inode number is 'inum'
+// ============================================================================
+i32 bfsGetSize(i32 inum) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+
+  Inode inode;
+  bfsReadInode(inum, &inode);
+
+  return inode.size;
+}
+
+
+
+// ============================================================================
+// Set size of file 'inum' to 'size
+// ============================================================================
+i32 bfsSetSize(i32 inum, i32 size) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+
+  bfsLockMeta();
+  Inode inode;
+  bfsReadInode(inum, &inode);
+  
+  inode.size = size;
+  bfsWriteInode(inum, &inode);
+  bfsUnlockMeta();
+  return 0;
+}
+
+
+
+// ============================================================================
+// Update the Inodes block on disk with the info in 'inode', the file's
+// Incore Inode, if it is open, and the published InodeSnap, by a new copy
+// ============================================================================
+i32 bfsWriteInode(i32 inum, Inode* inode) {
+
+  if (inum < 0)       FATAL(EBADINUM);
+  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (inode == NULL)  FATAL(ENULLPTR);
+
+  Volume* vol = bfsVol();
+  bfsLockMeta();
+
+  Incore* ic = bfsFindIncore(inum);
+  if (ic != NULL) {
+    if (ic->inode.indirect != inode->indirect) ic->mapped = 0;
+    memcpy(ic->inode.direct, inode->direct, sizeof(inode->direct));
+    ic->inode.indirect = inode->indirect;
+    __atomic_store_n(&ic->inode.size, inode->size, __ATOMIC_RELEASE);
+  }
+
+  if (vol->inodeSnap != NULL) {           // publish the change for readers
+    InodeSnap* snap = malloc(sizeof(InodeSnap));
+    if (snap == NULL) FATAL(ENOMEM);
+    memcpy(snap, vol->inodeSnap, sizeof(InodeSnap));
+    memcpy(&snap->inode[inum], inode, sizeof(Inode));
+    bfsPublish((void**)&vol->inodeSnap, snap);
+  }
+
+  if (vol->metaDepth > 0) {               // write it at bfsEndMeta
+    memcpy(&((Inode*)vol->inodes)[inum], inode, sizeof(Inode));
+    vol->metaDirty |= METAINODES;
+  } else {
+    i8 buf[BYTESPERBLOCK];
+    bioRead(bfsInodesDbn(), buf);
+    Inode* inodes = (Inode*)buf;
+    memcpy(&inodes[inum], inode, sizeof(Inode));
+    bfsStoreInodes(buf);
+  }
+
+  bfsUnlockMeta();
 
   return 0;
 }
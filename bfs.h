@@ -5,6 +5,7 @@
 // bfs.h - API to Bothell File System
 // ===================================================================
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,20 +27,52 @@
 #define NUMINDIRECT   BYTESPERBLOCK / sizeof(i16)
 #define MAXFBN        NUMDIRECT + NUMINDIRECT
 #define FNAMESIZE     16
+#define FNAMEMAX      255               // longest name in a packed Dir
+#define DIRENTHDR     5                 // bytes in DirEnt before 'name'
+#define DIRENTSIZE(n) ((DIRENTHDR + (n) + 1) & ~1)   // reclen, 2-aligned
+#define DIRFIXED      0                 // Super.dirFormat: Dir of fnames
+#define DIRPACKED     1                 // Super.dirFormat: DirEnt records
+#define NUMDIRBUCKETS 16                // hash buckets in the Dir index
+
+#define MAXSHARED     255               // most extra owners of one DBN
+#define FREELIST      0                 // Super.freeFormat: linked Freelist
+#define FREEMAP       1                 // Super.freeFormat: bitmap
+#define FREEMAPBYTES  ((BLOCKSPERDISK + 7) / 8)
+#define FREEWORDS     ((BLOCKSPERDISK + 63) / 64)   // u64s in memory
+#define ALLOCBATCH    8                 // DBNs a thread takes at once
+#define NUMPREALLOC   4                 // blocks an append maps ahead
+
+#define METAINODES    1                 // bfsBeginMeta: dirty block bits
+#define METADIR       2
+#define METASUPER     4
 
 #define DBNSUPER      0
 #define DBNINODES     1
 #define DBNDIR        2
+#define DBNSUPER2     1                 // copy-on-write disk: second Super
 
-#define INUMTOFD      5
+#define FDBASE        5                 // fd of OFT entry 0
 
-#define NUMOFTENTRIES 20
+#define OFTCHUNK      32                // OFT entries added per growth
+
+#define MAXVOLUMES    64                // volumes mounted at once
+#define VOLDEFAULT    0                 // handle of BFSDISK, mounted on use
+#define VOLPATHMAX    256               // longest disk image path, plus NUL
 
 
 typedef struct {          // SuperBlock
   i16 numBlocks;          // total # of blocks in BFSDISK = 1,000
   i16 numInodes;          // total # of inodes = 8
-  i16 firstFree;          // DBN of first free block
+  i16 firstFree;          // DBN of first free block.  0 with FREEMAP
+  i16 dirFormat;          // DIRFIXED or DIRPACKED
+  u8  shared[BLOCKSPERDISK]; // extra owners of each DBN.  0 => at most one
+  u8  freeMap[FREEMAPBYTES]; // bit 'dbn' set => DBN free, with FREEMAP
+  u8  freeFormat;         // FREELIST or FREEMAP
+  i16 jnlStart;           // DBN of the journal (jnl.h).  0 => none
+  i16 cowInodes;          // copy-on-write disk: DBN of the Inodes.  0 => not
+  i16 cowDir;             //   one.  DBN of the Dir
+  u32 cowGen;             //   commit that wrote this copy: DBN cowGen % 2
+  u32 cowSum;             //   checksum of the fields above (jnlSumSuper)
 } Super;
 
 
@@ -52,41 +85,243 @@ typedef struct {          // Inode
 
 
 
-typedef struct {          // Dir
+typedef struct {          // Dir, when Super.dirFormat == DIRFIXED
   char fname[NUMINODES][FNAMESIZE];
 } Dir;
 
 
-typedef struct {          // Open File Table Entry
-  i32 inum;               // inum of file. O => slot not used
-  i32 refs;               // # processes fsOpen'd this file
-  i32 curs;               // cursor into file
+
+typedef struct {          // DirEnt, when Super.dirFormat == DIRPACKED
+  i16  inum;              // inum of file
+  u16  reclen;            // bytes from this entry to the next. 0 => end
+  u8   namelen;           // bytes in 'name' (no NUL stored)
+  char name[];            // 1 .. FNAMEMAX bytes
+} DirEnt;
+
+
+typedef struct {          // DirPlus: a Directory entry with its Inode
+  i32   inum;             // inum of file
+  char  name[FNAMEMAX + 1];
+  i32   size;             // # bytes in file
+  i32   numBlocks;        // # data blocks mapped (holes not counted)
+  i32   numShared;        // # of those shared with a clone
+  Inode inode;            // direct[] and indirect DBNs
+} DirPlus;
+
+
+
+typedef struct {          // DirSnap: Directory index.  Never changed once
+                          //   published; a create publishes a new copy
+  char name[NUMINODES][FNAMEMAX + 1];   // "" => inum not in use
+  u8   len [NUMINODES];   // strlen(name[inum])
+  i8   head[NUMDIRBUCKETS];   // first inum in bucket.  -1 => empty
+  i8   next[NUMINODES];   // next inum in same bucket
+} DirSnap;
+
+
+
+typedef struct {          // InodeSnap: every Inode of a volume.  Never
+                          //   changed once published, as DirSnap
+  Inode inode[NUMINODES]; // indexed by inum
+} InodeSnap;
+
+
+
+typedef struct Volume Volume;
+typedef struct Journal Journal;
+
+typedef struct {          // Incore: in-memory Inode, shared by every open
+  pthread_rwlock_t lock;  // file data and block mapping: bfsLockInode
+  Volume* vol;            // volume holding the file
+  i32   inum;             // inum of file
+  i32   refs;             // # OFT entries using it.  0 => slot not used
+  Inode inode;            // copy of the on-disk Inode
+  i32   mapped;           // 1 => 'map' holds the indirect block
+  i16   map[NUMINDIRECT]; // copy of the indirect block
+  i32   reserved;         // appends have claimed bytes up to here
+  i32   preEnd;           // FBNs below this may be preallocated past EOF
+  i32   tailFbn;          // FBN held in 'tail'.  -1 => none
+  i8    tail[BYTESPERBLOCK]; // last partial block of appends
+} Incore;
+
+
+
+typedef struct {          // Open File Table Entry: one per fsOpen
+  Incore* ic;             // shared in-memory Inode.  NULL => slot not used
+  i32     curs;           // cursor into file, private to this open
+  i32     flags;          // fsOpenFlags 'flags', eg FSAPPEND
+  i32     nextFree;       // next free OFT slot, while unused.  -1 => none
 } OFTE;
 
-extern OFTE g_oft[NUMOFTENTRIES];
+struct Volume {            // Volume: one mounted BFS disk, and its caches
+  i32     id;             // handle: index in the volume table
+  i32     mounted;        // 0 => slot free for the next bfsMount
+  char    path[VOLPATHMAX];   // disk image file
+  int     bioFd;          // disk image, held open.  -1 => closed
+
+  pthread_mutex_t metaLock;   // see "Lock order".  Recursive
+  Super   super;          // cached copy of DBNSUPER
+  i32     superLoaded;    // 1 => 'super' mirrors DBNSUPER
+  Incore  incore[NUMINODES];  // indexed by inum
+
+  u64     freeWords[FREEWORDS];   // bit set => DBN free, not cached
+  u64     cachedWords[FREEWORDS]; // bit set => DBN in a thread cache
+  u64     pendingWords[FREEWORDS];    // bit set => DBN freed, reusable
+                                      //   once the free commits
+  i32     allocGen;       // generation of the map, set when loaded
+  i32     superDirty;     // 1 => map or share counts changed since the
+                          //   SuperBlock was last stored (bfsDirtySuper)
+  i32     returning;      // # threads in bfsReturnCache for this volume
+
+  DirSnap* dir;           // published Directory index.  NULL => not loaded
+  InodeSnap* inodeSnap;   // published Inodes.  NULL => not loaded
+  i32     dirFormat;      // Super.dirFormat of the disk
+
+  i32     metaDepth;      // # bfsBeginMeta not yet ended
+  i32     metaDirty;      // METAINODES | METADIR | METASUPER
+  i8      inodes[BYTESPERBLOCK];  // Inodes block, while deferred
+
+  pthread_mutex_t dirtyLock;  // write-back cache below.  See "Lock order"
+  pthread_cond_t  flushDone;  // a flusher finished this volume's batch
+  u8      dirty[BLOCKSPERDISK];   // FLUSHCLEAN, FLUSHDIRTY, ... (flush.h)
+  i8*     dirtyData;      // cached blocks, then a flusher's copy.  Or NULL
+  i32     numDirty;       // # blocks FLUSHDIRTY: the flush queue
+  i32     numCached;      // # blocks not FLUSHCLEAN
+  i32     flushing;       // 1 => a flusher is writing this volume's batch
+  u16     mapRefs[BLOCKSPERDISK]; // # direct fsMap views of each block:
+                                  //   writes to it skip the cache (map.h)
+
+  Journal* jnl;           // metadata journal (see jnl.h).  Never freed
+};
+
+// The OFT grows by chunks of OFTCHUNK entries.  Chunks never move, so an
+// OFTE* stays valid while its fd is open.  There is one OFT for every
+// volume: each entry's Incore names its volume, so fds never collide
+
+extern OFTE** g_oft;                    // g_oft[slot / OFTCHUNK] = chunk
+
+// Each thread acts on one volume at a time, its current volume (bfsVol).
+// The bfs functions that take an inum or a DBN work on it.  bfsFindOFTE
+// makes the fd's volume current, and bfsUseVol picks one by handle
+
+// Lookups read without locks.  Volume.dir and Volume.inodeSnap point at
+// snapshots that are never changed: a writer, under the metaLock, copies
+// the current one, changes the copy, publishes it with one atomic store, and
+// hands the old one to epochRetire (see epoch.h).  A reader loads the
+// pointer inside epochEnter/epochExit, so it never sees a snapshot freed.
+// g_oft's chunk array is published the same way, for bfsFindOFTE
+
+// Lock order.  bfs and fs functions may be called from many threads.  A
+// thread takes locks only in this order, never the other way round:
+//
+//  1. aio's and map's locks   their request and mapping lists
+//     jnlBegin                a journal handle: an fs call in progress.
+//                             Volumes in handle order
+//  2. Incore.lock             one file's data and block mapping.  Shared to
+//                             read; exclusive to write, remap or close.
+//                             Several files are locked lower volume handle,
+//                             then lower inum, first
+//  3. g_oftLock               Open File Table slots and free list
+//  4. g_volsLock              the volume table: mount and unmount
+//  5. Volume.metaLock         one volume's SuperBlock, Inodes, Dir, and
+//                             Incore contents.  Recursive
+//     Journal.commitLock      one volume's commits (see jnl.h)
+//     Journal.lock            its running transaction and handles
+//  6. Volume.dirtyLock        one volume's write-back cache (see flush.h)
+//     epoch's lock            retired snapshots.  Taken on its own, too
+//  7. bio's lock              the bio request queue
+//
+// pool's lock is taken on its own.  A large fsPreadv maps its blocks, then
+// waits on the pool while holding Incore.lock shared; the pool's workers
+// only read those DBNs, taking 6 and 7.
+// aio's worker runs each batch without aio's lock, as any fs caller would;
+// it holds every file of a run of reads shared until their blocks land.
+// flush's threads take only 6, and never hold it while writing the disk.
+// jnl's committer takes Journal's locks and 6, and waits for a volume's
+// handles to end without holding Journal.lock.
+//
+// Free blocks are claimed from the free bitmap with atomics, outside every
+// lock (see bfsTakeBlock).  So reads and writes of different files overlap,
+// save for short spells in a metaLock to map or look up blocks; files on
+// different volumes share no lock at all, below the OFT.  A cursor belongs
+// to its fd: threads sharing one fd must order their fsRead/fsWrite/fsSeek
+// calls
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 i32 bfsAllocBlock(i32 inum, i32 fbn);
+i32 bfsBeginMeta();
+i32 bfsCowBlock(i32 inum, i32 fbn, i32 dbn, i8* old);
 i32 bfsCreateFile(str fname);
-i32 bfsDerefOFT(i32 inum);
+i32 bfsDerefIncore(Incore* ic);
+i32 bfsDerefOFT(i32 fd);
+i32 bfsDirDbn();
+i32 bfsDirtySuper();
+i32 bfsEncodeDir(DirSnap* dir, i8* buf);
+i32 bfsEncodeSuper(Volume* vol, i8* buf);
+i32 bfsEndMeta();
 i32 bfsExtend(i32 inum, i32 fbn);
 i32 bfsFbnToDbn(i32 inum,   i32 fbn);
+i32 bfsFbnToDbnLocked(i32 inum, i32 fbn);
+i32 bfsFbnToDbnRun(i32 inum, i32 fbn, i32 count, i16* dbns);
 i32 bfsFdToInum(i32 fd);
 i32 bfsFindFreeBlock();
-i32 bfsFindOFTE(i32 inum);
+i32 bfsFreeBlock(i32 dbn);
+i32 bfsFindFreeSlot();
+Incore* bfsFindIncore(i32 inum);
+OFTE* bfsFindOFTE(i32 fd);
 i32 bfsGetSize(i32 inum);
+i32 bfsGrowOFT();
+u32 bfsHashName(str fname);
 i32 bfsInitDir();
 i32 bfsInitFreeList();
 i32 bfsInitInodes();
 i32 bfsInitOFT();
-i32 bfsInitSuper(FILE* fp);
-i32 bfsInumToFd(i32 inum);
+i32 bfsInitSuper(FILE* fp, i32 mode);
+i32 bfsInodesDbn();
+i32 bfsLoadDir();
+Super* bfsLoadSuper();
+i32 bfsLockInode(Incore* ic, i32 excl);
+i32 bfsLockInodePair(Incore* in, Incore* out);
+i32 bfsLockMeta();
 i32 bfsLookupFile(str fname);
+i32 bfsMapBlock(i32 inum, i32 fbn, i32 dbn);
+i32 bfsMount(str path);
+i32 bfsNameEq(char* slot, char* key, i32 len);
+i32 bfsPrealloc(i32 inum, i32 fbn);
+i32 bfsPublish(void** slot, void* snap);
 i32 bfsRead(i32 inum, i32 fbn, i8* buf);
+i32 bfsReadDirPlus(i32 max, DirPlus* ents);
 i32 bfsReadInode(i32 inum, Inode* inode);
+i32 bfsReadInodes(i8* buf);
+Incore* bfsRefIncore(i32 inum);
 i32 bfsRefOFT(i32 inum);
-i32 bfsSetCursor(i32 inum, i32 newCurs);
+i32 bfsReserveAppend(Incore* ic, i32 numb);
+i32 bfsSetCursor(i32 fd, i32 newCurs);
 i32 bfsSetSize(i32 inum, i32 size);
+i32 bfsSetVolume(Volume* vol);
+i32 bfsShareBlock(i32 dbn);
+i32 bfsStoreDir();
+i32 bfsStoreDirLocked();
+i32 bfsStoreInodes(i8* buf);
+i32 bfsStoreMeta(i16* dbn, void* buf);
+i32 bfsStoreSuper();
+i32 bfsSyncAll();
+i32 bfsTakeBlock();
 i32 bfsTell(i32 fd);
+i32 bfsTrimPrealloc(Incore* ic, i32 fbnEnd);
+i32 bfsUnlockInode(Incore* ic);
+i32 bfsUnlockInodePair(Incore* in, Incore* out);
+i32 bfsUnlockMeta();
+i32 bfsUnmount(i32 vol);
+Volume* bfsUseVol(i32 vol);
+Volume* bfsVol();
 i32 bfsWriteInode(i32 inum, Inode* inode);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
\ No newline at end of file
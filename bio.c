@@ -2,47 +2,215 @@
 // bio.c - low level Block IO functions
 // ============================================================================
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
 #include "bio.h"
+#include "flush.h"
+
+#define BIOMAXRUN 64                    // most blocks merged in one transfer
+
+static BioReq* g_bioQ    = NULL;        // queued requests, of every volume
+static i32     g_bioQLen = 0;           // # requests queued
+static i32     g_bioQCap = 0;           // # slots in g_bioQ
+
+static pthread_mutex_t g_bioLock = PTHREAD_MUTEX_INITIALIZER;  // the queue
+
+
+// ============================================================================
+// Close the current volume's BFS disk, if open.  Any queued requests, and
+// dirty cached blocks, are written first
+// ============================================================================
+i32 bioClose() {
+  flushVol(bfsVol());
+  bioDrain();
+  int fd = __atomic_exchange_n(&bfsVol()->bioFd, -1, __ATOMIC_ACQ_REL);
+  if (fd >= 0) close(fd);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Order two queued requests by disk, then by DBN, then by submission order
+// ============================================================================
+static int bioCompare(const void* a, const void* b) {
+  const BioReq* ra = a;
+  const BioReq* rb = b;
+  if (ra->fd  != rb->fd)  return ra->fd  - rb->fd;
+  if (ra->dbn != rb->dbn) return ra->dbn - rb->dbn;
+  return ra->seq - rb->seq;
+}
+
+
+
+// ============================================================================
+// Issue every queued request, on whichever volume it was queued.  The queue
+// is sorted by disk and DBN, and each run of same-direction requests for
+// consecutive blocks of one disk goes to it as one vectored transfer.  On
+// success, return 0.  On failure, abort
+// ============================================================================
+i32 bioDrain() {
+  pthread_mutex_lock(&g_bioLock);
+  if (g_bioQLen == 0) {
+    pthread_mutex_unlock(&g_bioLock);
+    return 0;
+  }
+
+  qsort(g_bioQ, g_bioQLen, sizeof(BioReq), bioCompare);
+
+  for (i32 i = 0; i < g_bioQLen; ) {
+    struct iovec iov[BIOMAXRUN];
+    i32 n = 0;
+    while (i + n < g_bioQLen && n < BIOMAXRUN
+           && g_bioQ[i + n].fd  == g_bioQ[i].fd
+           && g_bioQ[i + n].op  == g_bioQ[i].op
+           && g_bioQ[i + n].dbn == g_bioQ[i].dbn + n) {
+      iov[n].iov_base = g_bioQ[i + n].buf;
+      iov[n].iov_len  = BYTESPERBLOCK;
+      ++n;
+    }
+
+    off_t   boff  = (off_t)g_bioQ[i].dbn * BYTESPERBLOCK;
+    ssize_t want  = (ssize_t)n * BYTESPERBLOCK;
+    ssize_t numb  = (g_bioQ[i].op == BIOREAD)
+                  ? preadv (g_bioQ[i].fd, iov, n, boff)
+                  : pwritev(g_bioQ[i].fd, iov, n, boff);
+    if (numb != want) {
+      g_bioQLen = 0;
+      if (g_bioQ[i].op == BIOREAD) FATAL(EBADREAD);
+      FATAL(EBADWRITE);
+    }
+    i += n;
+  }
+
+  g_bioQLen = 0;
+  pthread_mutex_unlock(&g_bioLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return the OS file descriptor of the current volume's BFS disk, opening it
+// if need be.  For callers, such as fsMap, that map the disk image into
+// memory
+// ============================================================================
+i32 bioFd() {
+  bioOpen();
+  return __atomic_load_n(&bfsVol()->bioFd, __ATOMIC_ACQUIRE);
+}
+
+
+
+// ============================================================================
+// Open the current volume's BFS disk, unless it is already open.  It stays
+// open for every later transfer, until bioClose.  Threads racing to open it
+// agree on one descriptor.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 bioOpen() {
+  Volume* vol = bfsVol();
+  if (__atomic_load_n(&vol->bioFd, __ATOMIC_ACQUIRE) >= 0) return 0;
+
+  int fd = open(vol->path, O_RDWR);
+  if (fd < 0) FATAL(ENODISK);
+
+  int closed = -1;                        // another thread may beat us
+  if (!__atomic_compare_exchange_n(&vol->bioFd, &closed, fd, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    close(fd);
+  }
+  return 0;
+}
+
+
 
 // ============================================================================
-// Read 512 bytes from block number 'dbn' in the BFS disk into buffer 'buf'
+// Read 512 bytes from block number 'dbn' in the BFS disk into buffer 'buf'.
+// A block still dirty in the write-back cache is read from there
 // ============================================================================
 i32 bioRead(i32 dbn, void* buf) {
 
-  if (dbn < 0)             FATAL(EBADDBN);
-  if (dbn > BLOCKSPERDISK) FATAL(EBADDBN);
+  if (dbn < 0)              FATAL(EBADDBN);
+  if (dbn >= BLOCKSPERDISK) FATAL(EBADDBN);
+  if (flushRead(dbn, buf))  return 0;
+
+  off_t boff = (off_t)dbn * BYTESPERBLOCK;
+  ssize_t numb = pread(bioFd(), buf, BYTESPERBLOCK, boff);
+  if (numb != BYTESPERBLOCK) FATAL(EBADREAD);
 
-  FILE* fp = fopen(BFSDISK, "rb+");
-  if (fp == NULL) FATAL(ENODISK);
+  return 0;
+}
 
-  i32 boff = dbn * BYTESPERBLOCK;
-  i32 ret = fseek(fp, boff, SEEK_SET);
-  if (ret != 0) { fclose(fp); FATAL(ret); }
 
-  i32 numb = fread(buf, 1, BYTESPERBLOCK, fp);
-  if (numb != BYTESPERBLOCK) { fclose(fp); FATAL(EBADREAD); }
 
-  fclose(fp);
+// ============================================================================
+// Queue a transfer of block 'dbn' of the current volume to or from 'buf', for
+// the next bioDrain.  'buf' must stay valid until then.  A block in the
+// write-back cache is read or written there at once.  On success, return
+// 0.  On failure, abort
+// ============================================================================
+i32 bioSubmit(i32 op, i32 dbn, void* buf) {
+
+  if (dbn < 0)              FATAL(EBADDBN);
+  if (dbn >= BLOCKSPERDISK) FATAL(EBADDBN);
+  if (buf == NULL)          FATAL(ENULLPTR);
+
+  if (op == BIOREAD  && flushRead  (dbn, buf)) return 0;
+  if (op == BIOWRITE && flushUpdate(dbn, buf)) return 0;
+
+  int fd = bioFd();
+
+  pthread_mutex_lock(&g_bioLock);
+  if (g_bioQLen == g_bioQCap) {
+    i32 cap = (g_bioQCap == 0) ? 64 : 2 * g_bioQCap;
+    BioReq* q = realloc(g_bioQ, cap * sizeof(BioReq));
+    if (q == NULL) FATAL(ENOMEM);
+    g_bioQ    = q;
+    g_bioQCap = cap;
+  }
+
+  BioReq* r = &g_bioQ[g_bioQLen];
+  r->fd  = fd;
+  r->op  = op;
+  r->dbn = dbn;
+  r->buf = buf;
+  r->seq = g_bioQLen++;
+  pthread_mutex_unlock(&g_bioLock);
   return 0;
 }
 
 
+
 // ============================================================================
-// Write 512 bytes from 'buf' into block number 'dbn' of the BFS disk
+// Flush the current volume's BFS disk to stable storage.  Queued requests,
+// and dirty cached blocks, are written first
 // ============================================================================
-i32 bioWrite(i32 dbn, void* buf) {
+i32 bioSync() {
+  flushVol(bfsVol());
+  bioDrain();
+  if (fsync(bioFd()) != 0) FATAL(EBADWRITE);
+  return 0;
+}
+
 
-  FILE* fp = fopen(BFSDISK, "rb+");
-  if (fp == NULL) FATAL(ENODISK);
 
-  i32 boff = dbn * BYTESPERBLOCK;
-  i32 ret = fseek(fp, boff, SEEK_SET);
-  if (ret != 0) { fclose(fp); FATAL(ret); }
+// ============================================================================
+// Write 512 bytes from 'buf' into block number 'dbn' of the BFS disk, at
+// once.  If the block is in the write-back cache, the new bytes go there
+// instead, so an older cached copy cannot land on top of them
+// ============================================================================
+i32 bioWrite(i32 dbn, void* buf) {
 
-  i32 numb = fwrite(buf, 1, BYTESPERBLOCK, fp);
-  if (numb != BYTESPERBLOCK) { fclose(fp); FATAL(EBADWRITE); }
+  if (dbn < 0)               FATAL(EBADDBN);
+  if (dbn >= BLOCKSPERDISK)  FATAL(EBADDBN);
+  if (flushUpdate(dbn, buf)) return 0;
 
-  fclose(fp);
+  off_t boff = (off_t)dbn * BYTESPERBLOCK;
+  ssize_t numb = pwrite(bioFd(), buf, BYTESPERBLOCK, boff);
+  if (numb != BYTESPERBLOCK) FATAL(EBADWRITE);
 
   return 0;
 }
@@ -3,7 +3,7 @@
 
 // ===================================================================
 // bio.h - Block IO interface.  Simulates kernel-mode read and write
-// functions to the BFS disk
+// functions to the BFS disk of the calling thread's current volume
 // ===================================================================
 
 #include <stdio.h>
@@ -11,7 +11,24 @@
 #include "bfs.h"
 #include "alias.h"
 
-i32 bioRead (i32 dbn, void* buf);
-i32 bioWrite(i32 dbn, void* buf);
+#define BIOREAD  0                      // BioReq.op
+#define BIOWRITE 1
 
-#endif
\ No newline at end of file
+typedef struct {          // BioReq: one queued block transfer
+  int   fd;               // disk of the volume it was queued on
+  i32   op;               // BIOREAD or BIOWRITE
+  i32   dbn;              // block number in the BFS disk
+  void* buf;              // BYTESPERBLOCK bytes to fill, or to write
+  i32   seq;              // submission order, to keep same-DBN order
+} BioReq;
+
+i32 bioClose ();
+i32 bioDrain ();
+i32 bioFd    ();
+i32 bioOpen  ();
+i32 bioRead  (i32 dbn, void* buf);
+i32 bioSubmit(i32 op, i32 dbn, void* buf);
+i32 bioSync  ();
+i32 bioWrite (i32 dbn, void* buf);
+
+#endif
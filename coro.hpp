@@ -0,0 +1,92 @@
+#ifndef CORO_HPP
+#define CORO_HPP
+
+// ===================================================================
+// coro.hpp - C++20 coroutines over the async engine.  co_await on an
+// FsAwait submits its FsOp and suspends; the op's 'done' callback,
+// called by fsRun, resumes the coroutine, and co_await yields the
+// op's 'res'.  An FsTask is a coroutine that starts at once and
+// frees itself when it returns.  Header only: C callers and the C
+// build are unaffected.  See coroex.cpp
+// ===================================================================
+
+#include <coroutine>
+#include <exception>
+
+#include "fs.h"
+
+// ============================================================================
+// FsAwait: one FsOp, run by co_await.  The FsOp lives in the awaiter, and so
+// in the suspended coroutine's frame, until it completes.  The coroutine is
+// resumed by whichever thread runs fsRun
+// ============================================================================
+class FsAwait {
+public:
+  FsAwait(i32 op, i32 fd, i32 offset, i32 numb, void* buf)
+    : op_{op, fd, offset, numb, buf, nullptr, 0, nullptr} {}
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> h) {
+    op_.user = h.address();
+    op_.done = &FsAwait::resume;
+    fsSubmit(1, &op_);
+  }
+
+  i32 await_resume() const noexcept { return op_.res; }
+
+private:
+  static void resume(FsOp* op) {
+    std::coroutine_handle<>::from_address(op->user).resume();
+  }
+
+  FsOp op_;
+};
+
+
+
+// ============================================================================
+// Await a read of 'numb' bytes at byte-offset 'offset' of the file open on
+// 'fd' into 'buf', as fsPread does.  co_await yields the # bytes read
+// ============================================================================
+inline FsAwait fsAwaitRead(i32 fd, i32 numb, void* buf, i32 offset) {
+  return FsAwait(FSOPREAD, fd, offset, numb, buf);
+}
+
+
+
+// ============================================================================
+// Await a write of 'numb' bytes from 'buf' at byte-offset 'offset' of the
+// file open on 'fd', as fsPwrite does.  co_await yields 'numb'
+// ============================================================================
+inline FsAwait fsAwaitWrite(i32 fd, i32 numb, void* buf, i32 offset) {
+  return FsAwait(FSOPWRITE, fd, offset, numb, buf);
+}
+
+
+
+// ============================================================================
+// Await a sync of every mounted volume's disk.  co_await yields 0
+// ============================================================================
+inline FsAwait fsAwaitSync() {
+  return FsAwait(FSOPSYNC, 0, 0, 0, nullptr);
+}
+
+
+
+// ============================================================================
+// FsTask: the return type of a coroutine that awaits FsOps.  It runs at
+// once, up to its first co_await, and from then on inside fsRun.  Nothing
+// waits on it: the frame is freed when it returns.  On an exception, abort
+// ============================================================================
+struct FsTask {
+  struct promise_type {
+    FsTask get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+#endif
@@ -0,0 +1,87 @@
+// ============================================================================
+// coroex.cpp - example: copy files with coroutines on fsRun.  Two FsTasks
+// each copy file "A" block by block, awaiting every read and write, and
+// fsRun interleaves them.  Build it apart from main.c:
+//
+//   gcc -c -pthread $(ls *.c | grep -v main.c)
+//   g++ -std=c++20 -pthread coroex.cpp *.o -o coroex
+// ============================================================================
+
+#include <cstdio>
+#include <cstring>
+
+#include "coro.hpp"
+
+#define COROBLOCKS 8                      // blocks in "A"
+
+static char g_coroDisk[] = "BFSCORO";
+static char g_coroA[]    = "A";
+static char g_coroB[]    = "B";
+static char g_coroC[]    = "C";
+
+// ============================================================================
+// Copy 'numBlocks' blocks from the file open on 'fdIn' to the one open on
+// 'fdOut', then sync.  Set '*copied' to the # bytes copied
+// ============================================================================
+static FsTask coroCopy(i32 fdIn, i32 fdOut, i32 numBlocks, i32* copied) {
+  i8 buf[BYTESPERBLOCK];
+  i32 total = 0;
+
+  for (i32 b = 0; b < numBlocks; ++b) {
+    i32 n = co_await fsAwaitRead(fdIn, BYTESPERBLOCK, buf, b * BYTESPERBLOCK);
+    total += co_await fsAwaitWrite(fdOut, n, buf, b * BYTESPERBLOCK);
+  }
+  co_await fsAwaitSync();
+  *copied = total;
+}
+
+
+
+// ============================================================================
+// Return 1 if each block 'b' of the file open on 'fd' holds byte b + 1
+// ============================================================================
+static i32 coroVerify(i32 fd) {
+  i8 buf[BYTESPERBLOCK];
+  i8 want[BYTESPERBLOCK];
+  for (i32 b = 0; b < COROBLOCKS; ++b) {
+    fsPread(fd, BYTESPERBLOCK, buf, b * BYTESPERBLOCK);
+    memset(want, b + 1, BYTESPERBLOCK);
+    if (memcmp(buf, want, BYTESPERBLOCK) != 0) return 0;
+  }
+  return 1;
+}
+
+
+
+int main() {
+  bfsInitOFT();
+
+  i8  buf[BYTESPERBLOCK];
+  i32 vol = fsFormatAt(g_coroDisk);
+  i32 fa  = fsCreateAt(vol, g_coroA);
+  for (i32 b = 0; b < COROBLOCKS; ++b) {
+    memset(buf, b + 1, BYTESPERBLOCK);
+    fsWrite(fa, BYTESPERBLOCK, buf);
+  }
+  i32 fb = fsCreateAt(vol, g_coroB);
+  i32 fc = fsCreateAt(vol, g_coroC);
+
+  i32 copiedB = 0, copiedC = 0;
+  coroCopy(fa, fb, COROBLOCKS, &copiedB);   // each runs to its first read
+  coroCopy(fa, fc, COROBLOCKS, &copiedC);
+  i32 ops = fsRun();                        // ... and the rest, interleaved
+
+  i32 good = copiedB == COROBLOCKS * BYTESPERBLOCK
+          && copiedC == COROBLOCKS * BYTESPERBLOCK
+          && ops == 2 * (2 * COROBLOCKS + 1)
+          && coroVerify(fb) && coroVerify(fc);
+  printf("coroex : %s : %d ops, %d + %d bytes copied\n",
+         good ? "GOOD" : "BAD ", ops, copiedB, copiedC);
+
+  fsClose(fa);
+  fsClose(fb);
+  fsClose(fc);
+  fsUnmount(vol);
+  remove(g_coroDisk);
+  return good ? 0 : 1;
+}
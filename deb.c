@@ -3,6 +3,7 @@
 // ============================================================================
 
 #include "deb.h"
+#include "jnl.h"
 
 // ============================================================================
 // Dump block DBN
@@ -49,16 +50,29 @@ i32 debDumpDbn(i32 dbn, i32 size) {
 
 
 // ============================================================================
-// Dump the Dir
+// Dump the Dir, in whichever format Super.dirFormat says it is stored
 // ============================================================================
 i32 debDumpDir() {
   i8 buf[BYTESPERBLOCK] = {0};
-  bioRead(DBNDIR, buf);
-  Dir* dir = (Dir*)buf;
+  bioRead(jnlSuper(bfsVol()), buf);
+  i32 format = ((Super*)buf)->dirFormat;
+
+  bioRead(bfsDirDbn(), buf);
 
   printf("\n");
-  for (int inum = 0; inum < NUMINODES; ++inum) {
-    printf("[%02d]  %s \n", inum, dir->fname[inum]);
+  if (format == DIRPACKED) {
+    for (i32 off = 0; off + DIRENTHDR <= BYTESPERBLOCK; ) {
+      DirEnt* de = (DirEnt*)&buf[off];
+      if (de->reclen == 0) break;
+      printf("[%02d]  %.*s  (off = %d, reclen = %d) \n",
+        de->inum, de->namelen, de->name, off, de->reclen);
+      off += de->reclen;
+    }
+  } else {
+    Dir* dir = (Dir*)buf;
+    for (int inum = 0; inum < NUMINODES; ++inum) {
+      printf("[%02d]  %.*s \n", inum, FNAMESIZE, dir->fname[inum]);
+    }
   }
   printf("\n"); fflush(stdout);
 
@@ -72,7 +86,7 @@ i32 debDumpDir() {
 // ============================================================================
 i32 debDumpInodes() {
   i8 buf[BYTESPERBLOCK] = {0};
-  bioRead(DBNINODES, buf);
+  bioRead(bfsInodesDbn(), buf);
 
   Inode* inodes = (Inode*) buf;
 
@@ -97,7 +111,7 @@ i32 debDumpInodes() {
 i32 debDumpSuper() {
   i8 buf[BYTESPERBLOCK] = {0};
 
-  bioRead(DBNSUPER, buf);
+  bioRead(jnlSuper(bfsVol()), buf);
 
   Super* super = (Super*)buf;
 
@@ -105,6 +119,19 @@ i32 debDumpSuper() {
   printf("Super.numBlocks = %d \n", super->numBlocks);
   printf("Super.numInodes = %d \n", super->numInodes);
   printf("Super.firstFree = %d \n", super->firstFree);
+  printf("Super.dirFormat = %d \n", super->dirFormat);
+  for (i32 dbn = 0; dbn < BLOCKSPERDISK; ++dbn) {
+    if (super->shared[dbn] == 0) continue;
+    printf("Super.shared[%d] = %d \n", dbn, super->shared[dbn]);
+  }
+  printf("Super.freeFormat = %d \n", super->freeFormat);
+  if (super->freeFormat == FREEMAP) {
+    i32 numFree = 0;
+    for (i32 dbn = 0; dbn < BLOCKSPERDISK; ++dbn) {
+      if (super->freeMap[dbn / 8] & (1 << (dbn % 8))) ++numFree;
+    }
+    printf("Super.freeMap   = %d blocks free \n", numFree);
+  }
   printf("\n"); fflush(stdout);
 
   // Check that remainder of Superblock is all zeroes
@@ -0,0 +1,132 @@
+// ============================================================================
+// epoch.c - epoch-based reclamation of retired snapshots
+// ============================================================================
+
+#include "epoch.h"
+
+static pthread_mutex_t g_epochLock = PTHREAD_MUTEX_INITIALIZER;  // g_limbo
+static pthread_once_t  g_epochOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t   g_epochKey;          // frees a thread's slot at exit
+
+static u64        g_epoch = 0;              // global epoch.  Only grows
+static EpochSlot  g_slots[EPOCHSLOTS];      // one per reading thread
+static EpochNode* g_limbo = NULL;           // retired, not yet freed
+
+static __thread EpochSlot* t_slot  = NULL;  // this thread's slot
+static __thread i32        t_depth = 0;     // nested epochEnter calls
+
+// A reader announces the epoch it started in.  The epoch moves on only once
+// every active reader has seen the current one; so a snapshot retired in
+// epoch 'e' was unpublished before any reader of epoch e + 1 began, and is
+// unreachable once the epoch reaches e + 2.  Publishing a snapshot, loading
+// one, and the epoch records are all sequentially consistent atomics, so
+// they fall in one order that every thread agrees on
+
+
+// ============================================================================
+// Advance the epoch, if every active reader has seen it, and free what was
+// retired two epochs ago.  The caller holds g_epochLock
+// ============================================================================
+static void epochCollect() {
+  u64 now = __atomic_load_n(&g_epoch, __ATOMIC_SEQ_CST);
+  i32 all = 1;
+  for (i32 s = 0; s < EPOCHSLOTS && all; ++s) {
+    EpochSlot* slot = &g_slots[s];
+    if (!__atomic_load_n(&slot->active, __ATOMIC_SEQ_CST)) continue;
+    if (__atomic_load_n(&slot->epoch, __ATOMIC_SEQ_CST) != now) all = 0;
+  }
+  if (all) __atomic_store_n(&g_epoch, ++now, __ATOMIC_SEQ_CST);
+
+  EpochNode** link = &g_limbo;
+  while (*link != NULL) {
+    EpochNode* node = *link;
+    if (node->epoch + 2 > now) { link = &node->next; continue; }
+    *link = node->next;
+    free(node->ptr);
+    free(node);
+  }
+}
+
+
+
+// ============================================================================
+// Release slot 'arg' of a thread that is exiting.  Runs as the destructor of
+// g_epochKey
+// ============================================================================
+static void epochFreeSlot(void* arg) {
+  EpochSlot* slot = arg;
+  __atomic_store_n(&slot->active, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&slot->used,   0, __ATOMIC_RELEASE);
+}
+
+
+
+// ============================================================================
+// Create the key whose destructor frees a thread's slot.  Run once, by
+// pthread_once
+// ============================================================================
+static void epochInitKey() {
+  if (pthread_key_create(&g_epochKey, epochFreeSlot) != 0) FATAL(ENOMEM);
+}
+
+
+
+// ============================================================================
+// Enter a read: snapshots loaded from here until the matching epochExit stay
+// valid.  Calls nest.  Never blocks.  On success, return 0
+// ============================================================================
+i32 epochEnter() {
+  if (t_depth++ > 0) return 0;
+
+  if (t_slot == NULL) {                   // first read by this thread
+    pthread_once(&g_epochOnce, epochInitKey);
+    for (i32 s = 0; s < EPOCHSLOTS && t_slot == NULL; ++s) {
+      i32 unused = 0;
+      if (__atomic_compare_exchange_n(&g_slots[s].used, &unused, 1, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        t_slot = &g_slots[s];
+      }
+    }
+    if (t_slot == NULL) FATAL(ENOMEM);
+    pthread_setspecific(g_epochKey, t_slot);
+  }
+
+  u64 now = __atomic_load_n(&g_epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&t_slot->epoch, now, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&t_slot->active, 1, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Leave the read begun by the matching epochEnter.  On success, return 0
+// ============================================================================
+i32 epochExit() {
+  if (--t_depth > 0) return 0;
+  __atomic_store_n(&t_slot->active, 0, __ATOMIC_RELEASE);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Free 'ptr', a snapshot the caller has just unpublished, once every reader
+// that might still hold it has left.  Never waits for them.  On success,
+// return 0.  On failure, abort
+// ============================================================================
+i32 epochRetire(void* ptr) {
+  if (ptr == NULL) return 0;
+
+  EpochNode* node = malloc(sizeof(EpochNode));
+  if (node == NULL) FATAL(ENOMEM);
+
+  pthread_mutex_lock(&g_epochLock);
+  node->ptr   = ptr;
+  node->epoch = __atomic_load_n(&g_epoch, __ATOMIC_SEQ_CST);
+  node->next  = g_limbo;
+  g_limbo     = node;
+  epochCollect();
+  pthread_mutex_unlock(&g_epochLock);
+  return 0;
+}
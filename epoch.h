@@ -0,0 +1,34 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+// ===================================================================
+// epoch.h - epoch-based reclamation, for data read without locks.
+// Readers bracket their use of a published snapshot with epochEnter
+// and epochExit.  A writer publishes a new copy, then hands the old
+// one to epochRetire, which frees it once no reader can still hold it
+// ===================================================================
+
+#include "bfs.h"
+#include "alias.h"
+
+#define EPOCHSLOTS 256                  // threads inside a read at once
+
+typedef struct {          // EpochSlot: one reading thread's record
+  u64 epoch;              // global epoch seen at epochEnter
+  i32 active;             // 1 => between epochEnter and epochExit
+  i32 used;               // 1 => slot belongs to a live thread
+} __attribute__((aligned(64))) EpochSlot;   // one cache line each
+
+typedef struct EpochNode EpochNode;
+
+struct EpochNode {        // EpochNode: one retired snapshot
+  void*      ptr;         // block to free
+  u64        epoch;       // global epoch when retired
+  EpochNode* next;
+};
+
+i32 epochEnter ();
+i32 epochExit  ();
+i32 epochRetire(void* ptr);
+
+#endif
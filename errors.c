@@ -4,7 +4,20 @@
 
 #include "errors.h"
 
-void pause() {
+static i32 g_errDying = 0;                   // 1 => an error is ending the run
+
+// ============================================================================
+// Return 1 once an error has begun to end the run, else 0.  Exit handlers
+// check it: the thread that failed may hold locks they would wait on
+// ============================================================================
+i32 errDying() {
+  return __atomic_load_n(&g_errDying, __ATOMIC_ACQUIRE);
+}
+
+
+
+void errPause() {
+  __atomic_store_n(&g_errDying, 1, __ATOMIC_RELEASE);
   printf("\nHit any key to finish ");
   getchar();
   exit(0);
@@ -15,56 +28,70 @@ void pause() {
 void RepTest(int err, str file, int line) {
   RepError(err);
   printf(" in file %s at line %d \n", file, line);
-  pause();
+  errPause();
 }
 
 
 void RepError(i32 e) {
   switch(e) {
     case EBADDBN:
-      printf("\nERROR: Bad DBN: negative or too large \n");    pause(); break;
+      printf("\nERROR: Bad DBN: negative or too large \n");    errPause(); break;
     case EBADFBN:
-      printf("\nERROR: Bad FBN: negative or too large \n");    pause(); break;
+      printf("\nERROR: Bad FBN: negative or too large \n");    errPause(); break;
     case EBADINUM:
-      printf("\nERROR: Bad Inum: negative or too large \n");   pause(); break;
+      printf("\nERROR: Bad Inum: negative or too large \n");   errPause(); break;
     case EBADCURS:
-      printf("\nERROR: Bad cursor within file \n");           pause(); break;
+      printf("\nERROR: Bad cursor within file \n");           errPause(); break;
     case EBADREAD:
-      printf("\nERROR: Error writing to BFS disk \n");         pause(); break;
+      printf("\nERROR: Error writing to BFS disk \n");         errPause(); break;
     case EBADWRITE:
-      printf("\nERROR: Error writing to BFS disk \n");         pause(); break;
+      printf("\nERROR: Error writing to BFS disk \n");         errPause(); break;
     case EBIGFNAME:
-      printf("\nERROR: Filename too big \n");                  pause(); break;
+      printf("\nERROR: Filename too big \n");                  errPause(); break;
+    case EBADFNAME:
+      printf("\nERROR: Filename is empty \n");                 errPause(); break;
     case EBIGNUMB:
-      printf("\nERROR: Read or write is too big \n");          pause(); break;
+      printf("\nERROR: Read or write is too big \n");          errPause(); break;
     case EDIRFULL:
-      printf("\nERROR: Directory is already full \n");         pause(); break;
+      printf("\nERROR: Directory is already full \n");         errPause(); break;
     case EDISKCREATE:
-      printf("\nERROR: Failure creating BFS disk \n");         pause(); break;
+      printf("\nERROR: Failure creating BFS disk \n");         errPause(); break;
     case EDISKFULL:
-      printf("\nERROR: Disk is full \n");                      pause(); break;
+      printf("\nERROR: Disk is full \n");                      errPause(); break;
     case EEXISTS:
-      printf("\nERROR: Format would destroy current disk \n"); pause(); break;
+      printf("\nERROR: Format would destroy current disk \n"); errPause(); break;
     case EFNF:
-      printf("\nERROR: File Not Found \n");                    pause(); break;
+      printf("\nERROR: File Not Found \n");                    errPause(); break;
     case ENEGNUMB:
-      printf("\nERROR: Negative # bytes in read or write \n"); pause(); break;
+      printf("\nERROR: Negative # bytes in read or write \n"); errPause(); break;
     case ENODBN:
-      printf("\nERROR: No DBN yet allocated - non-fatal \n");  pause(); break;
+      printf("\nERROR: No DBN yet allocated - non-fatal \n");  errPause(); break;
     case ENODISK:
-      printf("\nERROR: Cannot open the BFS disk \n");          pause(); break;
+      printf("\nERROR: Cannot open the BFS disk \n");          errPause(); break;
     case ENOMEM:
-      printf("\nERROR: Failure to malloc memory \n");          pause(); break;
+      printf("\nERROR: Failure to malloc memory \n");          errPause(); break;
     case ENULLPTR:
-      printf("\nERROR: About to deref a null pointer \n");     pause(); break;
+      printf("\nERROR: About to deref a null pointer \n");     errPause(); break;
     case ENYI:
-      printf("\nERROR: Function Note Yet Implemented \n");     pause(); break;
+      printf("\nERROR: Function Note Yet Implemented \n");     errPause(); break;
     case EOFTFULL:
-      printf("\nERROR: OpenFileTable is full \n");             pause(); break;
+      printf("\nERROR: OpenFileTable is full \n");             errPause(); break;
+    case EBADFD:
+      printf("\nERROR: Bad file descriptor \n");               errPause(); break;
+    case EBADMETA:
+      printf("\nERROR: bfsEndMeta without bfsBeginMeta \n");   errPause(); break;
+    case EBADVOL:
+      printf("\nERROR: Volume is not mounted \n");             errPause(); break;
+    case EVOLFULL:
+      printf("\nERROR: Too many volumes mounted \n");          errPause(); break;
+    case EVOLBUSY:
+      printf("\nERROR: Volume has open files \n");             errPause(); break;
+    case EJNLFULL:
+      printf("\nERROR: Journal transaction is full \n");       errPause(); break;
     case EBADWHENCE:
-      printf("\nERROR: Invalid 'whence' in fsSeek \n");        pause(); break;
+      printf("\nERROR: Invalid 'whence' in fsSeek \n");        errPause(); break;
     default:
-      printf("\nERROR: Miscellaneous error \n");               pause(); break;
+      printf("\nERROR: Miscellaneous error \n");               errPause(); break;
   }
 }
 
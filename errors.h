@@ -32,8 +32,16 @@ void RepTest(int err, str file, int line);
 #define ENULLPTR    -19   // about to deref a NULL pointer
 #define ENYI        -20   // not yet implemented
 #define EOFTFULL    -21   // OpenFileTable is full
+#define EBADFNAME   -22   // filename is empty
+#define EBADFD      -23   // fd is not open
+#define EBADMETA    -24   // bfsEndMeta without bfsBeginMeta
+#define EBADVOL     -25   // volume handle is not mounted
+#define EVOLFULL    -26   // every volume slot is mounted
+#define EVOLBUSY    -27   // volume has open files - non fatal
+#define EJNLFULL    -28   // journal transaction overflowed
 
-void pause();
+i32  errDying();
+void errPause();
 void RepError(i32 ret);
 
 #endif
\ No newline at end of file
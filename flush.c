@@ -0,0 +1,390 @@
+// ============================================================================
+// flush.c - write-back cache of file data blocks, and its flusher threads
+// ============================================================================
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include "flush.h"
+
+static pthread_mutex_t g_flushLock = PTHREAD_MUTEX_INITIALIZER;  // g_flushKick
+static pthread_cond_t  g_flushWork = PTHREAD_COND_INITIALIZER;  // blocks dirty
+static pthread_once_t  g_flushOnce  = PTHREAD_ONCE_INIT;
+static u64             g_flushKick  = 0;    // bumped as volumes get dirty
+static i32             g_flushDirty = 0;    // # FLUSHDIRTY blocks, all volumes
+static pthread_rwlock_t g_flushPauseLock = PTHREAD_RWLOCK_INITIALIZER;
+static i32             g_flushPaused = 0;   // 1 => flushers stay idle
+
+static Volume* g_flushVols[MAXVOLUMES];     // volumes ever written back
+
+
+// ============================================================================
+// Write back every volume's dirty blocks.  Run at exit, so data written but
+// not yet flushed is not lost.  On success, return 0
+// ============================================================================
+i32 flushAll() {
+  for (i32 id = 0; id < MAXVOLUMES; ++id) {
+    Volume* vol = __atomic_load_n(&g_flushVols[id], __ATOMIC_ACQUIRE);
+    if (vol != NULL) flushVol(vol);
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Allocate volume 'vol's cache, and a flusher's copy area, unless it has them
+// already.  Threads racing to allocate agree on one
+// ============================================================================
+static void flushAlloc(Volume* vol) {
+  if (__atomic_load_n(&vol->dirtyData, __ATOMIC_ACQUIRE) != NULL) return;
+
+  i8* data = calloc(2 * BLOCKSPERDISK, BYTESPERBLOCK);      // cache, copy
+  if (data == NULL) FATAL(ENOMEM);
+  i8* none = NULL;
+  if (!__atomic_compare_exchange_n(&vol->dirtyData, &none, data, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(data);
+  }
+}
+
+
+
+// ============================================================================
+// Atexit handler: flushAll, unless an error is ending the run: the failing
+// thread may be a flusher, or hold a lock flushAll needs
+// ============================================================================
+static void flushAtExit() {
+  if (errDying()) return;
+  flushAll();
+}
+
+
+
+// ============================================================================
+// Drop volume 'vol's dirty blocks unwritten, as its disk is about to be
+// formatted afresh.  Waits for a flusher already writing it.  On success,
+// return 0
+// ============================================================================
+i32 flushDiscard(Volume* vol) {
+  if (vol == NULL) FATAL(ENULLPTR);
+
+  pthread_mutex_lock(&vol->dirtyLock);
+  while (vol->flushing) pthread_cond_wait(&vol->flushDone, &vol->dirtyLock);
+  __atomic_fetch_sub(&g_flushDirty, vol->numDirty, __ATOMIC_RELAXED);
+  memset(vol->dirty, FLUSHCLEAN, BLOCKSPERDISK);
+  __atomic_store_n(&vol->numDirty,  0, __ATOMIC_RELAXED);
+  __atomic_store_n(&vol->numCached, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&vol->dirtyLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Keep 'buf' as the new contents of metadata block 'dbn' of the current
+// volume, FLUSHHELD in its cache: reads see it, but no flusher writes it.
+// The journal writes it home once it is logged, then calls flushSettle.  On
+// success, return 0
+// ============================================================================
+i32 flushHold(i32 dbn, void* buf) {
+
+  if (dbn < 0)              FATAL(EBADDBN);
+  if (dbn >= BLOCKSPERDISK) FATAL(EBADDBN);
+  if (buf == NULL)          FATAL(ENULLPTR);
+
+  Volume* vol = bfsVol();
+  flushAlloc(vol);
+
+  pthread_mutex_lock(&vol->dirtyLock);
+  u8 state = vol->dirty[dbn];
+  memcpy(vol->dirtyData + dbn * BYTESPERBLOCK, buf, BYTESPERBLOCK);
+  if (state == FLUSHCLEAN) __atomic_fetch_add(&vol->numCached, 1,
+                                              __ATOMIC_RELEASE);
+  if (state == FLUSHDIRTY) {              // off the flush queue
+    __atomic_fetch_sub(&vol->numDirty, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&g_flushDirty,  1, __ATOMIC_RELAXED);
+  }
+  vol->dirty[dbn] = FLUSHHELD;            // a busy block: the flusher leaves it
+  pthread_mutex_unlock(&vol->dirtyLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Wake the flushers: some volume has new dirty blocks
+// ============================================================================
+static void flushKick() {
+  pthread_mutex_lock(&g_flushLock);
+  ++g_flushKick;
+  pthread_cond_broadcast(&g_flushWork);
+  pthread_mutex_unlock(&g_flushLock);
+}
+
+
+
+// ============================================================================
+// Keep the flusher threads idle, if 'pause', once the batches under way end;
+// else set them going again.  Writers still write back their own volume at
+// FLUSHMAXDIRTY, as do syncs.  For tests that must catch a block still in
+// the cache.  On success, return 0
+// ============================================================================
+i32 flushPause(i32 pause) {
+  pthread_rwlock_wrlock(&g_flushPauseLock);
+  g_flushPaused = (pause != 0);
+  pthread_rwlock_unlock(&g_flushPauseLock);
+  if (!pause) flushKick();                // catch up on what was skipped
+  return 0;
+}
+
+
+
+// ============================================================================
+// Pick a volume for flusher 'self' to write back: the first of its own (those
+// whose handle is 'self' modulo FLUSHTHREADS) with dirty blocks.  With none,
+// steal the volume with the most dirty blocks.  Volumes another flusher is
+// writing are skipped.  Return NULL if there is nothing to do
+// ============================================================================
+static Volume* flushPick(i32 self) {
+  Volume* best = NULL;
+  i32     most = 0;
+  for (i32 id = 0; id < MAXVOLUMES; ++id) {
+    Volume* vol = __atomic_load_n(&g_flushVols[id], __ATOMIC_ACQUIRE);
+    if (vol == NULL) continue;
+    i32 n = __atomic_load_n(&vol->numDirty, __ATOMIC_RELAXED);
+    if (n == 0 || __atomic_load_n(&vol->flushing, __ATOMIC_RELAXED)) continue;
+    if (id % FLUSHTHREADS == self) return vol;      // own queue first
+    if (n > most) { best = vol; most = n; }
+  }
+  return best;
+}
+
+
+
+// ============================================================================
+// Store 'buf' as the new contents of block 'dbn' of the current volume, in
+// its cache.  Unless 'always', only if that block is cached already.  Return
+// 1 if stored, else 0
+// ============================================================================
+static i32 flushPut(i32 dbn, void* buf, i32 always) {
+
+  if (dbn < 0)              FATAL(EBADDBN);
+  if (dbn >= BLOCKSPERDISK) FATAL(EBADDBN);
+  if (buf == NULL)          FATAL(ENULLPTR);
+
+  Volume* vol = bfsVol();
+  if (!always && __atomic_load_n(&vol->numCached, __ATOMIC_ACQUIRE) == 0) {
+    return 0;
+  }
+
+  flushAlloc(vol);
+  bioOpen();                              // flushers write to its fd
+
+  pthread_mutex_lock(&vol->dirtyLock);
+  u8  state = vol->dirty[dbn];
+  i32 kick  = 0;
+  if (always || state != FLUSHCLEAN) {
+    memcpy(vol->dirtyData + dbn * BYTESPERBLOCK, buf, BYTESPERBLOCK);
+    if (state == FLUSHCLEAN) __atomic_fetch_add(&vol->numCached, 1,
+                                                __ATOMIC_RELEASE);
+    if (state != FLUSHDIRTY) {            // a busy block is written again
+      vol->dirty[dbn] = FLUSHDIRTY;
+      kick = __atomic_add_fetch(&vol->numDirty, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&g_flushDirty, 1, __ATOMIC_RELAXED);
+    }
+    state = FLUSHDIRTY;
+  }
+  pthread_mutex_unlock(&vol->dirtyLock);
+  if (state == FLUSHCLEAN) return 0;
+
+  if (kick == 1) {                        // queue was empty: wake a flusher
+    __atomic_store_n(&g_flushVols[vol->id], vol, __ATOMIC_RELEASE);
+    flushKick();
+  }
+  if (__atomic_load_n(&g_flushDirty, __ATOMIC_RELAXED) >= FLUSHMAXDIRTY
+      || __atomic_load_n(&vol->mapRefs[dbn], __ATOMIC_ACQUIRE) > 0) {
+    flushVol(vol);                        // over the limit, or a direct
+  }                                       //   fsMap shows it: write our own
+  return 1;
+}
+
+
+
+// ============================================================================
+// If block 'dbn' of the current volume is cached, copy it into 'buf' and
+// return 1.  Else return 0, and the caller reads the disk
+// ============================================================================
+i32 flushRead(i32 dbn, void* buf) {
+  Volume* vol = bfsVol();
+  if (__atomic_load_n(&vol->numCached, __ATOMIC_ACQUIRE) == 0) return 0;
+
+  pthread_mutex_lock(&vol->dirtyLock);
+  i32 hit = (vol->dirty[dbn] != FLUSHCLEAN);
+  if (hit) memcpy(buf, vol->dirtyData + dbn * BYTESPERBLOCK, BYTESPERBLOCK);
+  pthread_mutex_unlock(&vol->dirtyLock);
+  return hit;
+}
+
+
+
+// ============================================================================
+// Write volume 'vol's dirty blocks to its disk, as one batch.  They are copied
+// out and marked FLUSHBUSY, under dirtyLock; then written, without it, in DBN
+// order, each run of consecutive blocks as one transfer.  A block written
+// again meanwhile stays queued.  If 'wait', first wait for a flusher already
+// writing 'vol'; else leave 'vol' to it.  On success, return 0
+// ============================================================================
+static i32 flushRun(Volume* vol, i32 wait) {
+  pthread_mutex_lock(&vol->dirtyLock);
+  while (wait && vol->flushing) {
+    pthread_cond_wait(&vol->flushDone, &vol->dirtyLock);
+  }
+  if (vol->flushing || vol->numDirty == 0) {
+    pthread_mutex_unlock(&vol->dirtyLock);
+    return 0;
+  }
+  __atomic_store_n(&vol->flushing, 1, __ATOMIC_RELAXED);
+
+  i8* copy = vol->dirtyData + BLOCKSPERDISK * BYTESPERBLOCK;
+  i16 dbns[BLOCKSPERDISK];
+  i32 n = 0;
+  for (i32 dbn = 0; dbn < BLOCKSPERDISK; ++dbn) {
+    if (vol->dirty[dbn] != FLUSHDIRTY) continue;
+    memcpy(copy + n * BYTESPERBLOCK, vol->dirtyData + dbn * BYTESPERBLOCK,
+           BYTESPERBLOCK);
+    vol->dirty[dbn] = FLUSHBUSY;
+    dbns[n++] = dbn;
+  }
+  __atomic_store_n(&vol->numDirty, 0, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&g_flushDirty, n, __ATOMIC_RELAXED);
+  int fd = __atomic_load_n(&vol->bioFd, __ATOMIC_ACQUIRE);
+  pthread_mutex_unlock(&vol->dirtyLock);
+
+  for (i32 i = 0; i < n; ) {
+    i32 run = 1;
+    while (i + run < n && dbns[i + run] == dbns[i] + run) ++run;
+    off_t   boff = (off_t)dbns[i] * BYTESPERBLOCK;
+    ssize_t want = (ssize_t)run * BYTESPERBLOCK;
+    if (pwrite(fd, copy + i * BYTESPERBLOCK, want, boff) != want) {
+      pthread_mutex_lock(&vol->dirtyLock);  // let no one wait on us
+      __atomic_store_n(&vol->flushing, 0, __ATOMIC_RELAXED);
+      pthread_cond_broadcast(&vol->flushDone);
+      pthread_mutex_unlock(&vol->dirtyLock);
+      FATAL(EBADWRITE);
+    }
+    i += run;
+  }
+
+  pthread_mutex_lock(&vol->dirtyLock);
+  i32 clean = 0;
+  for (i32 i = 0; i < n; ++i) {
+    if (vol->dirty[dbns[i]] != FLUSHBUSY) continue;   // written again
+    vol->dirty[dbns[i]] = FLUSHCLEAN;
+    ++clean;
+  }
+  __atomic_fetch_sub(&vol->numCached, clean, __ATOMIC_RELEASE);
+  __atomic_store_n(&vol->flushing, 0, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&vol->flushDone);
+  pthread_mutex_unlock(&vol->dirtyLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Drop block 'dbn' of volume 'vol' from its cache if it is FLUSHHELD: the
+// journal has written that copy home.  On success, return 0
+// ============================================================================
+i32 flushSettle(Volume* vol, i32 dbn) {
+  if (vol == NULL) FATAL(ENULLPTR);
+
+  pthread_mutex_lock(&vol->dirtyLock);
+  if (vol->dirty[dbn] == FLUSHHELD) {
+    vol->dirty[dbn] = FLUSHCLEAN;
+    __atomic_fetch_sub(&vol->numCached, 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&vol->dirtyLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// If block 'dbn' of the current volume is cached, replace it there with
+// 'buf' and return 1.  Else return 0, and the caller writes the disk.  Keeps
+// a direct write from being overtaken by an older cached copy
+// ============================================================================
+i32 flushUpdate(i32 dbn, void* buf) {
+  return flushPut(dbn, buf, 0);
+}
+
+
+
+// ============================================================================
+// Write volume 'vol's dirty blocks to its disk now, after any batch a flusher
+// is already writing.  Blocks written before the call are on disk when it
+// returns.  On success, return 0
+// ============================================================================
+i32 flushVol(Volume* vol) {
+  if (vol == NULL) FATAL(ENULLPTR);
+  return flushRun(vol, 1);
+}
+
+
+
+// ============================================================================
+// Flusher thread 'arg': write back dirty volumes, its own or stolen, and
+// sleep while there are none, for as long as the process lives
+// ============================================================================
+static void* flushWorker(void* arg) {
+  i32 self = (i32)(intptr_t)arg;
+  for (;;) {
+    pthread_mutex_lock(&g_flushLock);
+    u64 kick = g_flushKick;
+    pthread_mutex_unlock(&g_flushLock);
+
+    pthread_rwlock_rdlock(&g_flushPauseLock);   // flushers run side by side
+    Volume* vol = g_flushPaused ? NULL : flushPick(self);
+    if (vol != NULL) flushRun(vol, 0);
+    pthread_rwlock_unlock(&g_flushPauseLock);
+    if (vol != NULL) continue;
+
+    pthread_mutex_lock(&g_flushLock);
+    while (g_flushKick == kick) pthread_cond_wait(&g_flushWork, &g_flushLock);
+    pthread_mutex_unlock(&g_flushLock);
+  }
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Start the FLUSHTHREADS flushers, and the exit handler.  Run once, by
+// pthread_once
+// ============================================================================
+static void flushStart() {
+  for (i32 i = 0; i < FLUSHTHREADS; ++i) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, flushWorker, (void*)(intptr_t)i) != 0) {
+      FATAL(ENOMEM);
+    }
+    pthread_detach(t);
+  }
+  atexit(flushAtExit);
+}
+
+
+
+// ============================================================================
+// Write 512 bytes from 'buf' into block 'dbn' of the current volume, by way
+// of its cache.  Returns at once; a flusher writes the block to disk later.
+// Once FLUSHMAXDIRTY blocks are dirty, or if a direct fsMap view shows the
+// block, the caller writes back its volume itself.  On success, return 0.
+// On failure, abort
+// ============================================================================
+i32 flushWrite(i32 dbn, void* buf) {
+  pthread_once(&g_flushOnce, flushStart);
+  flushPut(dbn, buf, 1);
+  return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef FLUSH_H
+#define FLUSH_H
+
+// ===================================================================
+// flush.h - write-back cache of file data blocks.  A data write
+// lands in its volume's cache and returns; background flusher
+// threads write the dirty blocks to disk, sorted and merged, and
+// an idle flusher steals the queue of the busiest volume.  Writers
+// only wait on the disk once FLUSHMAXDIRTY blocks are dirty.  The
+// cache also holds logged metadata blocks for the journal (jnl.h)
+// ===================================================================
+
+#include "bfs.h"
+#include "alias.h"
+
+#define FLUSHTHREADS  2                 // background flusher threads
+#define FLUSHMAXDIRTY 64                // dirty blocks, all volumes, before
+                                        //   writers flush their own
+
+#define FLUSHCLEAN    0                 // Volume.dirty[dbn]: not cached
+#define FLUSHDIRTY    1                 // newer than the disk; queued
+#define FLUSHBUSY     2                 // being written; still cached
+#define FLUSHHELD     3                 // logged metadata: cached, but only
+                                        //   the journal writes it home
+
+i32 flushAll    ();
+i32 flushDiscard(Volume* vol);
+i32 flushHold   (i32 dbn, void* buf);
+i32 flushPause  (i32 pause);
+i32 flushRead   (i32 dbn, void* buf);
+i32 flushSettle (Volume* vol, i32 dbn);
+i32 flushUpdate (i32 dbn, void* buf);
+i32 flushVol    (Volume* vol);
+i32 flushWrite  (i32 dbn, void* buf);
+
+#endif
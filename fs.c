@@ -2,27 +2,281 @@
 // fs.c - user FileSytem API
 // ============================================================================
 
+#include <unistd.h>
+
 #include "fs.h"
+#include "flush.h"
+#include "jnl.h"
+#include "pool.h"
+
+// ============================================================================
+// Return the number of blocks that 'numb' bytes from byte-offset 'offset'
+// touch: what a write there may allocate, for jnlBegin
+// ============================================================================
+static i32 fsSpan(i32 offset, i32 numb) {
+  if (numb <= 0) return 0;
+  return (offset + numb - 1) / BYTESPERBLOCK - offset / BYTESPERBLOCK + 1;
+}
+
+
 
 // ============================================================================
 // Close the file currently open on file descriptor 'fd'.
 // ============================================================================
 i32 fsClose(i32 fd) {
-  i32 inum = bfsFdToInum(fd);
-  bfsDerefOFT(inum);
+  Incore* ic  = bfsFindOFTE(fd)->ic;
+  Volume* vol = ic->vol;
+  jnlBegin(vol, 0);
+  bfsLockInode(ic, 1);                    // last close trims the file
+  bfsDerefOFT(fd);
+  bfsUnlockInode(ic);
+  jnlEnd(vol);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Append 'numb' bytes from 'buf' at EOF of the file open on File Descriptor
+// 'fd', and return the byte-offset where they landed.  The range is claimed
+// atomically, so appenders sharing a file never overlap.  Whole blocks are
+// written straight from 'buf' into blocks that bfsPrealloc mapped ahead of
+// time; the last partial block is kept in memory, so a small append is one
+// write and no read.  The cursor does not move.  On failure, abort
+// ============================================================================
+i32 fsAppend(i32 fd, i32 numb, void* buf) {
+
+  if (buf == NULL) FATAL(ENULLPTR);
+  if (numb < 0)    FATAL(ENEGNUMB);
+
+  Incore* ic   = bfsFindOFTE(fd)->ic;
+  i32 inum     = ic->inum;
+  i32 offset   = bfsReserveAppend(ic, numb);
+
+  jnlBegin(ic->vol, fsSpan(offset, numb));
+  bfsLockInode(ic, 1);
+  i32 size     = bfsGetSize(inum);        // blocks from here on are fresh
+
+  i32 fbn  = offset / BYTESPERBLOCK;
+  i32 boff = offset % BYTESPERBLOCK;      // offset within block 'fbn'
+  i8* src  = buf;
+
+  for (i32 left = numb; left > 0; ) {
+    i32 n = MIN(BYTESPERBLOCK - boff, left);
+
+    // On first touch of a partial block, the tail is filled with its old
+    // bytes, unless the block is new or lies past EOF
+
+    i32 dbn   = bfsFbnToDbn(inum, fbn);
+    i32 fresh = (dbn == ENODBN || fbn * BYTESPERBLOCK >= size);
+    i32 fill  = (n < BYTESPERBLOCK && ic->tailFbn != fbn && !fresh);
+    if (dbn == ENODBN) {
+      dbn = bfsPrealloc(inum, fbn);
+    } else {                              // copy-on-write, as fsPwritev
+      dbn = bfsCowBlock(inum, fbn, dbn, fill ? ic->tail : NULL);
+    }
+
+    if (n == BYTESPERBLOCK) {             // whole block: no copy at all
+      if (ic->tailFbn == fbn) ic->tailFbn = -1;
+      flushWrite(dbn, src);
+    } else {
+      if (ic->tailFbn != fbn) {
+        if (fresh) memset(ic->tail, 0, BYTESPERBLOCK);
+        ic->tailFbn = fbn;
+      }
+      memcpy(&ic->tail[boff], src, n);
+      flushWrite(dbn, ic->tail);
+    }
+
+    src  += n;
+    left -= n;
+    boff  = 0;
+    ++fbn;
+  }
+
+  if (offset + numb > bfsGetSize(inum)) bfsSetSize(inum, offset + numb);
+  bfsUnlockInode(ic);
+  jnlEnd(ic->vol);
+
+  return offset;
+}
+
+
+
+// ============================================================================
+// Carry out the 'numops' steps in 'ops', in order: create files, write them
+// and close them.  A step with fd FSBLAST uses the file made by the latest
+// FSBCREATE, so "create, write, close" runs for many files in one call.
+// Files are created on the default volume, BFSDISK.  Name lookups use the
+// in-memory Directory index; the Inodes, Dir and Super blocks are updated in
+// memory and written once each, at the end, all in one journal transaction.
+// On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsBatch(i32 numops, FsBatchOp* ops) {
+
+  if (ops == NULL) FATAL(ENULLPTR);
+
+  i32 numBlocks = 0;                      // blocks the writes may take
+  for (i32 i = 0; i < numops; ++i) {
+    if (ops[i].op == FSBWRITE) numBlocks += fsSpan(0, ops[i].numb) + 1;
+  }
+
+  Volume* vol = bfsUseVol(VOLDEFAULT);
+  jnlBegin(vol, numBlocks);
+  bfsBeginMeta();
+
+  i32 last = FSBLAST;                     // fd of latest FSBCREATE
+  for (i32 i = 0; i < numops; ++i) {
+    FsBatchOp* op = &ops[i];
+    i32 fd = (op->fd == FSBLAST) ? last : op->fd;
+
+    switch (op->op) {
+    case FSBCREATE:
+      last = fsCreateAt(VOLDEFAULT, op->name);
+      op->res = last;
+      break;
+    case FSBWRITE:
+      op->res = fsWrite(fd, op->numb, op->buf);
+      break;
+    case FSBCLOSE:
+      op->res = fsClose(fd);
+      break;
+    default:
+      FATAL(ENYI);
+    }
+  }
+
+  bfsUseVol(VOLDEFAULT);                  // a write may have moved us off
+  bfsEndMeta();
+  jnlEnd(vol);
   return 0;
 }
 
 
 
 // ============================================================================
-// Create the file called 'fname'.  Overwrite, if it already exsists.
-// On success, return its file descriptor.  On failure, EFNF
+// Clone the whole file open on 'fdIn' into the file open on 'fdOut', which
+// should be empty.  Every block is shared, so this costs metadata only.  On
+// success, return the number of bytes cloned.  On failure, abort
+// ============================================================================
+i32 fsClone(i32 fdIn, i32 fdOut) {
+  return fsCopyFileRange(fdIn, 0, fdOut, 0, fsSize(fdIn), FSCLONE);
+}
+
+
+
+// ============================================================================
+// Copy 'len' bytes from byte-offset 'offIn' of the file open on 'fdIn' to
+// byte-offset 'offOut' of the file open on 'fdOut', without passing through
+// any caller buffer.  The copy stops at EOF of the input.  Neither cursor
+// moves.
+//
+// With FSCLONE in 'flags', each whole block at block-aligned offsets is not
+// copied but shared: 'fdOut' maps the same DBN, whose share count goes up,
+// and a later write to it by either file is copied-on-write.  Partial
+// blocks, holes, and blocks already at MAXSHARED are copied as usual.  The
+// files may be on different volumes; then every block is copied.
+//
+// On success, return the number of bytes copied.  On failure, abort
+// ============================================================================
+i32 fsCopyFileRange(i32 fdIn, i32 offIn, i32 fdOut, i32 offOut, i32 len,
+                    i32 flags) {
+
+  if (offIn  < 0) FATAL(EBADCURS);
+  if (offOut < 0) FATAL(EBADCURS);
+  if (len    < 0) FATAL(ENEGNUMB);
+
+  Incore* icOut = bfsFindOFTE(fdOut)->ic;
+  Incore* icIn  = bfsFindOFTE(fdIn)->ic;  // current volume: 'fdIn's
+  i32 inumIn    = icIn->inum;
+  i32 inumOut   = icOut->inum;
+
+  i32 sizeIn = bfsGetSize(inumIn);
+  if (offIn >= sizeIn) return 0;
+  len = MIN(len, sizeIn - offIn);
+
+  if (icIn == icOut && offIn < offOut + len && offOut < offIn + len) {
+    FATAL(EBADCURS);                      // overlapping ranges in one file
+  }
+
+  Volume* lo = icIn->vol;                 // journal handles: lower first
+  Volume* hi = icOut->vol;
+  if (lo->id > hi->id) { lo = icOut->vol; hi = icIn->vol; }
+  jnlBegin(lo, (lo == icOut->vol) ? fsSpan(offOut, len) : 0);
+  jnlBegin(hi, (hi == icOut->vol) ? fsSpan(offOut, len) : 0);
+
+  i32 clone = (flags & FSCLONE)
+           && icIn->vol == icOut->vol
+           && offIn  % BYTESPERBLOCK == 0
+           && offOut % BYTESPERBLOCK == 0;
+
+  for (i32 done = 0; done < len; ) {
+    i32 in  = offIn  + done;
+    i32 out = offOut + done;
+
+    if (clone && len - done >= BYTESPERBLOCK) {
+      bfsLockInodePair(icIn, icOut);
+      i32 shared = 0;
+      i32 dbn = bfsFbnToDbn(inumIn, in / BYTESPERBLOCK);
+      if (dbn != ENODBN && bfsShareBlock(dbn) == 0) {
+        i32 fbnOut = out / BYTESPERBLOCK;
+        bfsTrimPrealloc(icOut, fbnOut);   // as fsPwritev
+        i32 old    = bfsFbnToDbn(inumOut, fbnOut);
+        bfsMapBlock(inumOut, fbnOut, dbn);
+        if (old != ENODBN) bfsFreeBlock(old);
+        if (icOut->tailFbn == fbnOut) icOut->tailFbn = -1;
+        if (out + BYTESPERBLOCK > bfsGetSize(inumOut)) {
+          bfsSetSize(inumOut, out + BYTESPERBLOCK);   // covers the block now
+        }
+        shared = 1;
+      }
+      bfsUnlockInodePair(icIn, icOut);
+      if (shared) {
+        done += BYTESPERBLOCK;
+        continue;
+      }
+    }
+
+    i32 n = len - done;                   // copy up to a block boundary
+    n = MIN(n, BYTESPERBLOCK - in  % BYTESPERBLOCK);
+    n = MIN(n, BYTESPERBLOCK - out % BYTESPERBLOCK);
+
+    i8 blk[BYTESPERBLOCK];
+    fsPread (fdIn,  n, blk, in);
+    fsPwrite(fdOut, n, blk, out);         // grows the file, as a clone does
+    done += n;
+  }
+
+  jnlEnd(hi);
+  jnlEnd(lo);
+  return len;
+}
+
+
+
+// ============================================================================
+// Create the file called 'fname' on the default volume, BFSDISK.  Overwrite,
+// if it already exsists.  On success, return its file descriptor.  On
+// failure, EFNF
 // ============================================================================
 i32 fsCreate(str fname) {
+  return fsCreateAt(VOLDEFAULT, fname);
+}
+
+
+
+// ============================================================================
+// Create the file called 'fname' on volume 'vol', a handle from fsMountAt.
+// Overwrite, if it already exsists.  On success, return its file descriptor,
+// which every other fs function takes as for any file.  On failure, EFNF
+// ============================================================================
+i32 fsCreateAt(i32 vol, str fname) {
+  Volume* v = bfsUseVol(vol);
+  jnlBegin(v, 0);
   i32 inum = bfsCreateFile(fname);
-  if (inum == EFNF) return EFNF;
-  return bfsInumToFd(inum);
+  i32 fd   = (inum == EFNF) ? EFNF : bfsRefOFT(inum);
+  jnlEnd(v);
+  return fd;
 }
 
 
@@ -32,10 +286,33 @@ i32 fsCreate(str fname) {
 // Freelist.  On succes, return 0.  On failure, abort
 // ============================================================================
 i32 fsFormat() {
-  FILE* fp = fopen(BFSDISK, "w+b");
+  fsFormatAt(BFSDISK);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Format a BFS disk in image file 'path', creating the file if need be, and
+// mount it, with its metadata updated as 'mode' says: JNLLOG or JNLCOW.  On
+// success, return its volume handle.  On failure, abort
+// ============================================================================
+static i32 fsFormatWith(str path, i32 mode) {
+  if (path == NULL) FATAL(ENULLPTR);
+
+  FILE* fp = fopen(path, "w+b");
   if (fp == NULL) FATAL(EDISKCREATE);
+  if (ftruncate(fileno(fp), BLOCKSPERDISK * BYTESPERBLOCK) != 0) {
+    fclose(fp);                             // the Freelist is not written
+    FATAL(EDISKCREATE);                     //   out, so size the disk here
+  }
+
+  i32 vol = bfsMount(path);
+  Volume* v = bfsUseVol(vol);
+  jnlFormat(v, mode);                       // a new, empty journal
+  flushDiscard(v);                          // old data must not land later
 
-  i32 ret = bfsInitSuper(fp);               // initialize Super block
+  i32 ret = bfsInitSuper(fp, mode);         // initialize Super block
   if (ret != 0) { fclose(fp); FATAL(ret); }
 
   ret = bfsInitInodes(fp);                  // initialize Inodes block
@@ -48,105 +325,354 @@ i32 fsFormat() {
   if (ret != 0) { fclose(fp); FATAL(ret); }
 
   fclose(fp);
-  return 0;
+  return vol;
+}
+
+
+
+// ============================================================================
+// Format a BFS disk in image file 'path', creating the file if need be, and
+// mount it.  The disk gets a metadata journal (see jnl.h).  Any disk already
+// there is lost.  On success, return its volume handle.  On failure, abort
+// ============================================================================
+i32 fsFormatAt(str path) {
+  return fsFormatWith(path, JNLLOG);
 }
 
 
+
+// ============================================================================
+// Format a BFS disk in image file 'path', as fsFormatAt does, but with its
+// metadata updated copy-on-write instead of journaled (see jnl.h): no log is
+// written twice, and mount has nothing to replay.  On success, return its
+// volume handle.  On failure, abort
+// ============================================================================
+i32 fsFormatCowAt(str path) {
+  return fsFormatWith(path, JNLCOW);
+}
+
+
+
 // ============================================================================
 // Mount the BFS disk.  It must already exist
 // ============================================================================
 i32 fsMount() {
-  FILE* fp = fopen(BFSDISK, "rb");
-  if (fp == NULL) FATAL(ENODISK);           // BFSDISK not found
-  fclose(fp);
+  fsMountAt(BFSDISK);
   return 0;
 }
 
 
 
 // ============================================================================
-// Open the existing file called 'fname'.  On success, return its file 
-// descriptor.  On failure, return EFNF
+// Mount the BFS disk held in image file 'path', which must already exist,
+// alongside any others, and return its volume handle for fsCreateAt,
+// fsOpenAt and fsReadDirPlusAt.  Each volume has its own SuperBlock, caches
+// and Directory; fds from every volume share one numbering, so an fd names
+// its volume too.  Mounting a disk twice returns the same handle.  On
+// failure, abort
+// ============================================================================
+i32 fsMountAt(str path) {
+  return bfsMount(path);
+}
+
+
+
+// ============================================================================
+// Open the existing file called 'fname'.  On success, return a new file 
+// descriptor, with its own cursor.  On failure, return EFNF
 // ============================================================================
 i32 fsOpen(str fname) {
+  return fsOpenFlags(fname, 0);
+}
+
+
+
+// ============================================================================
+// Open the existing file called 'fname' on volume 'vol', a handle from
+// fsMountAt, with 'flags' as for fsOpenFlags.  On success, return a new file
+// descriptor.  On failure, return EFNF
+// ============================================================================
+i32 fsOpenAt(i32 vol, str fname, i32 flags) {
+  bfsUseVol(vol);
   i32 inum = bfsLookupFile(fname);        // lookup 'fname' in Directory
   if (inum == EFNF) return EFNF;
-  return bfsInumToFd(inum);
+  i32 fd = bfsRefOFT(inum);
+  bfsFindOFTE(fd)->flags = flags;
+  return fd;
 }
 
 
 
 // ============================================================================
-// Read 'numb' bytes of data from the cursor in the file currently fsOpen'd on
-// File Descriptor 'fd' into 'buf'.  On success, return actual number of bytes
-// read (may be less than 'numb' if we hit EOF).  On failure, abort
+// Open the existing file called 'fname', as fsOpen does, with 'flags':
+//
+//  FSAPPEND : every fsWrite or fsWritev lands at EOF, as with fsAppend
+//
+// On success, return a new file descriptor.  On failure, return EFNF
 // ============================================================================
-i32 fsRead(i32 fd, i32 numb, void* buf) {
+i32 fsOpenFlags(str fname, i32 flags) {
+  return fsOpenAt(VOLDEFAULT, fname, flags);
+}
 
-  // store incase of error
-  i8 tempBuf[numb];
-  u32 bufIdx = 0;
-  i32 totalBytes = numb;
 
-  i32 inum = bfsFdToInum(fd);
-  // fetch cursor
-  i32 cursor = bfsTell(fd);
-  i32 cursorIdx = cursor % BYTESPERBLOCK;
-  i32 fbn = cursor / BYTESPERBLOCK;
+
+// ============================================================================
+// Read 'numb' bytes of data, starting at byte-offset 'offset', from the file
+// currently fsOpen'd on File Descriptor 'fd' into 'buf'.  The cursor is
+// neither used nor moved, so callers sharing 'fd' do not race on it.  On
+// success, return actual number of bytes read (may be less than 'numb' if we
+// hit EOF).  On failure, abort
+// ============================================================================
+i32 fsPread(i32 fd, i32 numb, void* buf, i32 offset) {
+  IoVec iov = { buf, numb };
+  return fsPreadv(fd, 1, &iov, offset);
+}
+
+
+
+// ============================================================================
+// Scatter-read: fill the 'iovcnt' buffers described by 'iov', in order, from
+// the file currently fsOpen'd on File Descriptor 'fd', starting at byte-offset
+// 'offset'.  Each file block is read once, and its bytes are spread over
+// however many buffers it covers.  The cursor is neither used nor moved.  On
+// success, return actual number of bytes read (less than the total if the
+// Inode size says we hit EOF; 0 at or past EOF).  On failure, abort
+// ============================================================================
+i32 fsPreadv(i32 fd, i32 iovcnt, IoVec* iov, i32 offset) {
+
+  if (iov == NULL) FATAL(ENULLPTR);
+  if (offset < 0)  FATAL(EBADCURS);
+
+  i32 numb = 0;                           // total bytes asked for
+  for (i32 v = 0; v < iovcnt; ++v) {
+    if (iov[v].len < 0) FATAL(ENEGNUMB);
+    numb += iov[v].len;
+  }
+
+  Incore* ic = bfsFindOFTE(fd)->ic;
+  bfsLockInode(ic, 0);
+
+  // Clamp to EOF once, up front, from the Inode size
+
+  i32 inum = ic->inum;
+  i32 size = bfsGetSize(inum);
+  if (offset >= size) { bfsUnlockInode(ic); return 0; }
+  numb = MIN(numb, size - offset);
+
+  i32 fbn  = offset / BYTESPERBLOCK;
+  i32 boff = offset % BYTESPERBLOCK;      // offset within block 'fbn'
+
+  i32 totalBytes = numb;
+  i32 v = 0, voff = 0;                    // next byte goes to iov[v] + voff
+
+  // A large read into one buffer has its whole blocks [parLo, parHi)
+  // fetched up front by the worker pool, all at the same time
+
+  i32 parLo = 0, parHi = 0;
+  if (iovcnt == 1 && numb >= POOLMINBLOCKS * BYTESPERBLOCK) {
+    parLo = (offset + BYTESPERBLOCK - 1) / BYTESPERBLOCK;
+    parHi = (offset + numb) / BYTESPERBLOCK;
+    i8* dst = (i8*)iov[0].base + parLo * BYTESPERBLOCK - offset;
+    i16 dbns[MAXFBN + 1];                 // mapped here, under our lock
+    bfsFbnToDbnRun(inum, parLo, parHi - parLo, dbns);
+    poolReadBlocks(dbns, parHi - parLo, dst);
+  }
 
   while (numb > 0) {
-    // fetch block
+    i32 readCount = MIN(BYTESPERBLOCK - boff, numb);
+
+    // Fast path: a whole block that lands inside one buffer is read
+    // straight into it
+
+    while (voff == iov[v].len) { ++v; voff = 0; }
+    if (readCount == BYTESPERBLOCK && iov[v].len - voff >= BYTESPERBLOCK) {
+      if (fbn < parLo || fbn >= parHi) {
+        bfsRead(inum, fbn, (i8*)iov[v].base + voff);
+      }
+      voff += BYTESPERBLOCK;
+      numb -= BYTESPERBLOCK;
+      ++fbn;
+      continue;
+    }
+
     i8 readBuf[BYTESPERBLOCK];
     bfsRead(inum, fbn, readBuf);
-    i32 readCount = 0;
-
-    // case cursor != beginning of block
-    if (cursorIdx > 0) {
-      // read at most numb bytes or end of block
-      i32 bufCount = BYTESPERBLOCK - cursorIdx;
-      readCount = (numb > bufCount) ? bufCount : numb;
-      cursorIdx = 0;
-    }
-    // case cursor == beginning of block
-    else {
-      // read up to a full block
-      readCount = MIN(BYTESPERBLOCK, numb);
+
+    for (i32 done = 0; done < readCount; ) {      // scatter over buffers
+      if (voff == iov[v].len) { ++v; voff = 0; continue; }
+      i32 n = MIN(readCount - done, iov[v].len - voff);
+      memcpy((i8*)iov[v].base + voff, &readBuf[boff + done], n);
+      voff += n;
+      done += n;
     }
 
-    // move to output
-    memcpy(&tempBuf[bufIdx], &readBuf[cursorIdx], readCount);
-    bufIdx += readCount;
-    // move cursor
+    boff = 0;
     numb -= readCount;
+    ++fbn;
+  }
+  bfsUnlockInode(ic);
+  return totalBytes;
+}
 
-    // check for EoF
-    if (fbn * BYTESPERBLOCK > fsSize(fd)) {
-      // hit EoF, return total num bytes read
-      return EBADREAD;
-    }
 
-    // read next block
-    ++fbn;
+
+// ============================================================================
+// Write 'numb' bytes of data from 'buf' into the file currently fsOpen'd on
+// filedescriptor 'fd', starting at byte-offset 'offset'.  The cursor is
+// neither used nor moved.  If the write ends past EOF, the file's size grows
+// to match.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsPwrite(i32 fd, i32 numb, void* buf, i32 offset) {
+  IoVec iov = { buf, numb };
+  return fsPwritev(fd, 1, &iov, offset);
+}
+
+
+
+// ============================================================================
+// Gather-write: write the 'iovcnt' buffers described by 'iov', back to back,
+// into the file currently fsOpen'd on File Descriptor 'fd', starting at
+// byte-offset 'offset'.  Each file block is written once, however many
+// buffers land in it; so a header plus its payload costs one block update,
+// not two.  Blocks go to the write-back cache (see flush.h), so the call
+// does not wait on the disk.  The cursor is neither used nor moved.  On
+// success, return 0.  On failure, abort
+// ============================================================================
+i32 fsPwritev(i32 fd, i32 iovcnt, IoVec* iov, i32 offset) {
+
+  if (iov == NULL) FATAL(ENULLPTR);
+  if (offset < 0)  FATAL(EBADCURS);
+
+  i32 numb = 0;                           // total bytes to write
+  for (i32 v = 0; v < iovcnt; ++v) {
+    if (iov[v].len < 0) FATAL(ENEGNUMB);
+    numb += iov[v].len;
   }
-  /* 
-  * Unsure why this check is neccessary as test requests 100 bytes of \0 
-  * but test 6 has 524 (I think) trailing \0 that need to be removed
-  */
-  if(tempBuf[0] != 0) {
-    // subtract null bytes
-    i8 countBuffer[BYTESPERBLOCK];
-    bfsRead(inum, fbn - 1, countBuffer);
-    int emptyCount = 0;
-    for(int i = BYTESPERBLOCK - 1; i >= 0; --i) {
-      if(countBuffer[i] == 0) ++emptyCount;
-      else break;
+  i32 end = offset + numb;                // byte just past the write
+
+  Incore* ic = bfsFindOFTE(fd)->ic;
+  jnlBegin(ic->vol, fsSpan(offset, numb));
+  bfsLockInode(ic, 1);
+  ic->tailFbn = -1;                       // fsAppend's tail may go stale
+
+  i32 inum = ic->inum;
+  i32 size = bfsGetSize(inum);            // blocks from here on are fresh
+  i32 fbn  = offset / BYTESPERBLOCK;
+  i32 boff = offset % BYTESPERBLOCK;      // offset within block 'fbn'
+  bfsTrimPrealloc(ic, fbn);               // the gap past EOF reads as zeros
+
+  i32 v = 0, voff = 0;                    // next byte comes from iov[v] + voff
+
+  while (numb > 0) {
+    i32 writeCount = MIN(BYTESPERBLOCK - boff, numb);
+    i32 whole = (writeCount == BYTESPERBLOCK);
+
+    // fetch dbn, allocating the block if not yet mapped.  A new block, or
+    // one preallocated past EOF, has no old contents worth reading; its
+    // unwritten bytes just become zero.  Only a partial block over existing
+    // data needs the read half of read-modify-write.  A block shared with a
+    // clone is copied-on-write: this file gets a new block, filled from the
+    // old one
+
+    i8 writeBuf[BYTESPERBLOCK];
+    i32 dbn   = bfsFbnToDbn(inum, fbn);
+    i32 fresh = (dbn == ENODBN || fbn * BYTESPERBLOCK >= size);
+    if (dbn == ENODBN) {
+      dbn = bfsAllocBlock(inum, fbn);
+    } else {
+      dbn = bfsCowBlock(inum, fbn, dbn, (whole || fresh) ? NULL : writeBuf);
+    }
+
+    // Fast path: a whole block that comes from inside one buffer is
+    // cached straight from it
+
+    while (voff == iov[v].len) { ++v; voff = 0; }
+    if (whole && iov[v].len - voff >= BYTESPERBLOCK) {
+      flushWrite(dbn, (i8*)iov[v].base + voff);
+      voff += BYTESPERBLOCK;
+      numb -= BYTESPERBLOCK;
+      ++fbn;
+      continue;
+    }
+
+    // Otherwise assemble the block
+
+    if (!whole && fresh) memset(writeBuf, 0, BYTESPERBLOCK);
+
+    for (i32 done = 0; done < writeCount; ) {     // gather from buffers
+      if (voff == iov[v].len) { ++v; voff = 0; continue; }
+      i32 n = MIN(writeCount - done, iov[v].len - voff);
+      memcpy(&writeBuf[boff + done], (i8*)iov[v].base + voff, n);
+      voff += n;
+      done += n;
     }
-    totalBytes -= emptyCount;
+
+    // write to file
+    flushWrite(dbn, writeBuf);
+
+    boff = 0;
+    numb -= writeCount;
+    ++fbn;
   }
-  // move to return buffer
-  memcpy(buf, tempBuf, totalBytes);
-  fsSeek(fd, totalBytes, SEEK_CUR);
-  return totalBytes;
+
+  // Grow the file if the write ran past EOF
+
+  if (end > bfsGetSize(inum)) bfsSetSize(inum, end);
+  bfsUnlockInode(ic);
+  jnlEnd(ic->vol);
+
+  return 0;
+}
+
+
+
+// ============================================================================
+// Read 'numb' bytes of data from the cursor in the file currently fsOpen'd on
+// File Descriptor 'fd' into 'buf', and advance the cursor past them.  On
+// success, return actual number of bytes read (may be less than 'numb' if we
+// hit EOF).  On failure, abort
+// ============================================================================
+i32 fsRead(i32 fd, i32 numb, void* buf) {
+  i32 ret = fsPread(fd, numb, buf, bfsTell(fd));
+  if (ret < 0) return ret;
+  fsSeek(fd, ret, SEEK_CUR);
+  return ret;
+}
+
+
+
+// ============================================================================
+// List up to 'max' files of the BFS disk into 'ents', each with its name and
+// Inode attributes (size, blocks mapped, blocks shared, DBNs), in one pass
+// over the Directory and Inodes.  Return the number of entries filled
+// ============================================================================
+i32 fsReadDirPlus(i32 max, DirPlus* ents) {
+  return fsReadDirPlusAt(VOLDEFAULT, max, ents);
+}
+
+
+
+// ============================================================================
+// fsReadDirPlus, for the files of volume 'vol', a handle from fsMountAt
+// ============================================================================
+i32 fsReadDirPlusAt(i32 vol, i32 max, DirPlus* ents) {
+  bfsUseVol(vol);
+  return bfsReadDirPlus(max, ents);
+}
+
+
+
+// ============================================================================
+// Scatter-read from the cursor in the file currently fsOpen'd on File
+// Descriptor 'fd' into the 'iovcnt' buffers described by 'iov', and advance
+// the cursor past the bytes read.  On success, return actual number of bytes
+// read.  On failure, abort
+// ============================================================================
+i32 fsReadv(i32 fd, i32 iovcnt, IoVec* iov) {
+  i32 ret = fsPreadv(fd, iovcnt, iov, bfsTell(fd));
+  if (ret < 0) return ret;
+  fsSeek(fd, ret, SEEK_CUR);
+  return ret;
 }
 
 
@@ -164,19 +690,18 @@ i32 fsSeek(i32 fd, i32 offset, i32 whence) {
 
   if (offset < 0) FATAL(EBADCURS);
 
-  i32 inum = bfsFdToInum(fd);
-  i32 ofte = bfsFindOFTE(inum);
+  OFTE* ofte = bfsFindOFTE(fd);
 
   switch (whence) {
   case SEEK_SET:
-    g_oft[ofte].curs = offset;
+    ofte->curs = offset;
     break;
   case SEEK_CUR:
-    g_oft[ofte].curs += offset;
+    ofte->curs += offset;
     break;
   case SEEK_END: {
     i32 end = fsSize(fd);
-    g_oft[ofte].curs = end + offset;
+    ofte->curs = end + offset;
     break;
   }
   default:
@@ -208,76 +733,53 @@ i32 fsSize(i32 fd) {
 
 
 
+// ============================================================================
+// Unmount volume 'vol', a handle from fsMountAt or fsFormatAt, writing back
+// its SuperBlock and closing its disk.  The handle may be reused by a later
+// mount.  On success, return 0.  If a file on it is still open, return
+// EVOLBUSY and leave it mounted
+// ============================================================================
+i32 fsUnmount(i32 vol) {
+  return bfsUnmount(vol);
+}
+
+
+
 // ============================================================================
 // Write 'numb' bytes of data from 'buf' into the file currently fsOpen'd on
 // filedescriptor 'fd'.  The write starts at the current file offset for the
-// destination file.  On success, return 0.  On failure, abort
+// destination file (at EOF, if opened with FSAPPEND), and the cursor moves
+// past it.  On success, return 0.  On failure, abort
 // ============================================================================
 i32 fsWrite(i32 fd, i32 numb, void* buf) {
+  OFTE* ofte = bfsFindOFTE(fd);
+  if (ofte->flags & FSAPPEND) {
+    ofte->curs = fsAppend(fd, numb, buf) + numb;
+    return 0;
+  }
+  fsPwrite(fd, numb, buf, ofte->curs);
+  fsSeek(fd, numb, SEEK_CUR);
+  return 0;
+}
 
-  // store incase of error
-  i8 tempBuf[numb];
-  memcpy(tempBuf, buf, numb);
-  u32 bufIdx = 0;
-
-  i32 inum = bfsFdToInum(fd);
-  // fetch cursor
-  i32 cursor = bfsTell(fd);
-  i32 cursorIdx = cursor % BYTESPERBLOCK;
-  i32 fbn = cursor / BYTESPERBLOCK;
-
-  // fetch dbn
-  i32 dbn = bfsFbnToDbn(inum, fbn);
-  if (dbn == ENODBN) {
-    // alloc if not mapped
-    bfsAllocBlock(inum, fbn);
-    i8 allocBuf[BYTESPERBLOCK];
-    memset(allocBuf, 0, BYTESPERBLOCK);
-    dbn = bfsFbnToDbn(inum, fbn);
-    bioWrite(dbn, allocBuf);
-  } 
-
-  while (numb > 0) {
-    // fetch block
-    i8 writeBuf[BYTESPERBLOCK];
-    bfsRead(inum, fbn, writeBuf);
-    i32 writeCount = 0;
-
-    // case cursor != beginning of block
-    if (cursorIdx > 0) {
-      // read at most numb bytes or end of block
-      i32 bufCount = BYTESPERBLOCK - cursorIdx;
-      writeCount = (numb > bufCount) ? bufCount : numb;
-    }
-    // case cursor == beginning of block
-    else {
-      // read up to a full block
-      writeCount = MIN(BYTESPERBLOCK, numb);
-    }
 
-    // write to buffer
-    memcpy(&writeBuf[cursorIdx], &tempBuf[bufIdx], writeCount);
-    // move cursor
-    cursorIdx = 0;
-    bufIdx += writeCount;
-    numb -= writeCount;
 
-    // write to file
-    bioWrite(dbn, writeBuf);
-    fsSeek(fd, writeCount, SEEK_CUR);
+// ============================================================================
+// Gather-write the 'iovcnt' buffers described by 'iov' into the file
+// currently fsOpen'd on File Descriptor 'fd', at its cursor (at EOF, if
+// opened with FSAPPEND), and advance the cursor past them.  On success,
+// return 0.  On failure, abort
+// ============================================================================
+i32 fsWritev(i32 fd, i32 iovcnt, IoVec* iov) {
+  if (iov == NULL) FATAL(ENULLPTR);
 
-    // next block
-    dbn = bfsFbnToDbn(inum, ++fbn);
+  i32 numb = 0;
+  for (i32 v = 0; v < iovcnt; ++v) numb += iov[v].len;
 
-    // check for EoF
-    if (dbn == ENODBN) {
-      // hit EoF, expand file
-      bfsAllocBlock(inum, fbn);
-      i8 allocBuf[BYTESPERBLOCK];
-      memset(allocBuf, 0, BYTESPERBLOCK);
-      dbn = bfsFbnToDbn(inum, fbn);
-      bioWrite(dbn, allocBuf);
-    }
-  }
+  OFTE* ofte = bfsFindOFTE(fd);
+  i32 offset = (ofte->flags & FSAPPEND) ? bfsReserveAppend(ofte->ic, numb)
+                                        : ofte->curs;
+  fsPwritev(fd, iovcnt, iov, offset);
+  ofte->curs = offset + numb;
   return 0;
 }
@@ -11,15 +11,92 @@
 #include "alias.h"
 #include "errors.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {          // IoVec: one buffer of a scatter/gather transfer
+  void* base;             // start of buffer
+  i32   len;              // # bytes in buffer
+} IoVec;
+
+#define FSCLONE   1                     // fsCopyFileRange: share blocks
+
+#define FSAPPEND  1                     // fsOpenFlags: writes land at EOF
+
+#define FSMAPREAD  1                    // fsMap 'prot' bits
+#define FSMAPWRITE 2
+
+#define FSBCREATE 0                     // FsBatchOp.op
+#define FSBWRITE  1
+#define FSBCLOSE  2
+#define FSBLAST   -1                    // FsBatchOp.fd: last FSBCREATE's fd
+
+typedef struct {          // FsBatchOp: one step of an fsBatch
+  i32   op;               // FSBCREATE, FSBWRITE or FSBCLOSE
+  str   name;             // FSBCREATE: name of the file to create
+  i32   fd;               // FSBWRITE, FSBCLOSE: file descriptor, or FSBLAST
+  i32   numb;             // FSBWRITE: # bytes to write at the cursor
+  void* buf;              // FSBWRITE: data to write
+  i32   res;              // once done: FSBCREATE's fd, else 0
+} FsBatchOp;
+
+#define FSOPREAD  0                     // FsOp.op
+#define FSOPWRITE 1
+#define FSOPSYNC  2
+
+typedef struct FsOp FsOp;
+
+struct FsOp {             // FsOp: one asynchronous file operation
+  i32   op;               // FSOPREAD, FSOPWRITE or FSOPSYNC
+  i32   fd;               // file descriptor (unused by FSOPSYNC)
+  i32   offset;           // byte-offset into file; the cursor is not used
+  i32   numb;             // # bytes to transfer
+  void* buf;              // data to write, or room for data read
+  void* user;             // caller's tag, passed back untouched
+  i32   res;              // once reaped: # bytes transferred (0 for sync)
+  void (*done)(FsOp* op); // called by fsRun on completion.  May be NULL
+};
+
+i32 fsAppend(i32 fd, i32 numb,   void* buf);
+i32 fsBatch (i32 numops, FsBatchOp* ops);
+i32 fsClone (i32 fdIn, i32 fdOut);
 i32 fsClose (i32 fd);
+i32 fsCopyFileRange(i32 fdIn, i32 offIn, i32 fdOut, i32 offOut, i32 len,
+                    i32 flags);
 i32 fsCreate(str name);
+i32 fsCreateAt(i32 vol, str name);
 i32 fsFormat();
+i32 fsFormatAt(str path);
+i32 fsFormatCowAt(str path);
+void* fsMap(i32 fd, i32 offset, i32 len, i32 prot);
 i32 fsMount();
+i32 fsMountAt(str path);
+i32 fsMsync (void* addr);
 i32 fsOpen  (str fname);
+i32 fsOpenAt(i32 vol, str fname, i32 flags);
+i32 fsOpenFlags(str fname, i32 flags);
+i32 fsPread (i32 fd, i32 numb,   void* buf, i32 offset);
+i32 fsPreadv(i32 fd, i32 iovcnt, IoVec* iov, i32 offset);
+i32 fsPwrite(i32 fd, i32 numb,   void* buf, i32 offset);
+i32 fsPwritev(i32 fd, i32 iovcnt, IoVec* iov, i32 offset);
 i32 fsRead  (i32 fd, i32 numb,   void* buf);
+i32 fsRun   ();
+i32 fsReap  (i32 max,    FsOp** done);
+i32 fsReadDirPlus(i32 max, DirPlus* ents);
+i32 fsReadDirPlusAt(i32 vol, i32 max, DirPlus* ents);
+i32 fsReadv (i32 fd, i32 iovcnt, IoVec* iov);
 i32 fsSeek  (i32 fd, i32 offset, i32   whence);
 i32 fsSize  (i32 fd);
+i32 fsSubmit(i32 numops, FsOp*  ops);
 i32 fsTell  (i32 fd);
+i32 fsUnmap (void* addr);
+i32 fsUnmount(i32 vol);
 i32 fsWrite (i32 fd, i32 numb,   void* buf);
+i32 fsWritev(i32 fd, i32 iovcnt, IoVec* iov);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
\ No newline at end of file
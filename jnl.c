@@ -0,0 +1,783 @@
+// ============================================================================
+// jnl.c - write-ahead journal of metadata blocks, and its committer thread
+// ============================================================================
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include "flush.h"
+#include "jnl.h"
+
+static pthread_mutex_t g_jnlLock = PTHREAD_MUTEX_INITIALIZER;   // g_jnlKick
+static pthread_cond_t  g_jnlWork = PTHREAD_COND_INITIALIZER;   // a group began
+static pthread_once_t  g_jnlOnce = PTHREAD_ONCE_INIT;
+static u64             g_jnlKick = 0;       // bumped as transactions begin
+static pthread_mutex_t g_jnlPauseLock = PTHREAD_MUTEX_INITIALIZER;
+static i32             g_jnlPaused = 0;     // 1 => committer skips rounds
+
+static Volume* g_jnlVols[MAXVOLUMES];       // volumes ever journaled
+static __thread i32 t_jnlDepth[MAXVOLUMES]; // nested jnlBegin, by volume
+
+// Transaction 'seq' is logged in area seq % 2, a JnlDesc and the blocks.  A
+// commit first writes home the transaction before it, whose area it leaves
+// alone; the fsync that makes the new log durable makes those home writes
+// durable too.  So once transaction 'seq' is logged, every one before
+// 'seq - 1' is home, and replaying both areas, older first, rebuilds the
+// metadata as of the last commit.  A torn log fails its checksum, and the
+// disk is as of the commit before.
+//
+// Operations bracket their metadata stores with jnlBegin and jnlEnd, so a
+// commit takes whole operations only: it waits for every handle to end, and
+// nothing closes a transaction sooner.  Blocks freed in a transaction are
+// reusable once it commits (Volume.pendingWords): data written into one
+// before then could land on a block the last commit still maps.  Logged
+// blocks are never freed, so a home write never lands on reused data.  An
+// operation that may run the free bitmap dry says so at jnlBegin, which
+// commits first, with no handle held, if frees await a commit.
+//
+// A transaction never outgrows JNLSLOTS.  It holds each block it stores
+// once: the SuperBlock, the Inodes, the Dir, and an indirect block per
+// inode.  An Inode's indirect block, once allocated, is never freed; and a
+// block freed inside a transaction is not reused before it commits, so no
+// second DBN can take a first one's place
+//
+// A JNLCOW disk keeps no log.  Its SuperBlock names the DBNs of the Inodes
+// and Dir, and the Inodes name the indirect blocks; the first store of one
+// in a transaction moves it to a free DBN (bfsStoreMeta), and frees the old.
+// So the last commit's blocks are never written over.  A commit writes the
+// transaction's blocks where they now live, fsyncs, then writes its
+// SuperBlock to DBN seq % 2, the copy the commit before did not use, and
+// fsyncs again.  A torn SuperBlock fails its checksum, and mount takes the
+// other copy, which names only blocks still intact
+
+
+// ============================================================================
+// Return 1 if volume 'vol' has fewer than 'numBlocks' blocks free to take,
+// and some whose free awaits a commit, else 0
+// ============================================================================
+static i32 jnlShort(Volume* vol, i32 numBlocks) {
+  i32 free    = 0;
+  i32 pending = 0;
+  for (i32 w = 0; w < FREEWORDS; ++w) {
+    free += __builtin_popcountll(
+              __atomic_load_n(&vol->freeWords[w],   __ATOMIC_ACQUIRE)
+            | __atomic_load_n(&vol->cachedWords[w], __ATOMIC_ACQUIRE));
+    if (__atomic_load_n(&vol->pendingWords[w], __ATOMIC_ACQUIRE)) pending = 1;
+  }
+  return pending && free < numBlocks;
+}
+
+
+
+// ============================================================================
+// Begin an operation on volume 'vol' that may store metadata, and take up to
+// 'numBlocks' data blocks.  Its stores all land in one transaction: a commit
+// waits for its jnlEnd.  Calls nest; the outermost reserves for all.  If the
+// blocks, with JNLMOVES for metadata, are not free, but frees await a
+// commit, commit first: the operation cannot, once inside.  Waits while a
+// commit is closing the running transaction.  On success, return 0
+// ============================================================================
+i32 jnlBegin(Volume* vol, i32 numBlocks) {
+  if (vol == NULL)   FATAL(ENULLPTR);
+  if (numBlocks < 0) FATAL(ENEGNUMB);
+  if (t_jnlDepth[vol->id] > 0) { ++t_jnlDepth[vol->id]; return 0; }
+
+  if (jnlShort(vol, numBlocks + JNLMOVES)) jnlCommit(vol);
+  t_jnlDepth[vol->id] = 1;
+
+  Journal* jnl = vol->jnl;
+  pthread_mutex_lock(&jnl->lock);
+  while (jnl->closing || jnl->frozen) {
+    pthread_cond_wait(&jnl->cond, &jnl->lock);
+  }
+  ++jnl->handles;
+  pthread_mutex_unlock(&jnl->lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Wake the committer: a transaction has begun
+// ============================================================================
+static void jnlKick() {
+  pthread_mutex_lock(&g_jnlLock);
+  ++g_jnlKick;
+  pthread_cond_broadcast(&g_jnlWork);
+  pthread_mutex_unlock(&g_jnlLock);
+}
+
+
+
+// ============================================================================
+// Put 'buf' in volume 'vol's running transaction as block 'dbn', in place of
+// any copy already there, and hold it in the write-back cache.  The caller
+// holds Journal.lock, with 'vol' current.  Return 1 if stored, else 0: the
+// transaction has no room for a new block
+// ============================================================================
+static i32 jnlPut(Volume* vol, i32 dbn, void* buf) {
+  Journal* jnl = vol->jnl;
+  i32 slot = 0;
+  while (slot < jnl->count && jnl->dbn[slot] != dbn) ++slot;
+  if (slot == JNLSLOTS) return 0;
+
+  if (slot == jnl->count) {               // new to this transaction
+    jnl->dbn[jnl->count++] = dbn;
+    if (jnl->count == 1) jnlKick();
+  }
+  memcpy(jnl->data[slot], buf, BYTESPERBLOCK);
+  jnl->heldSeq[dbn] = jnl->seq;
+  if (jnl->mode == JNLLOG || dbn != DBNSUPER) flushHold(dbn, buf);
+  return 1;
+}
+
+
+
+// ============================================================================
+// Store volume 'vol's SuperBlock, if bfsDirtySuper has marked it, for a disk
+// without a journal, which writes it through.  On success, return 0
+// ============================================================================
+static i32 jnlStoreSuper(Volume* vol) {
+  if (!__atomic_load_n(&vol->superDirty, __ATOMIC_ACQUIRE)) return 0;
+  Volume* prev = bfsVol();
+  bfsSetVolume(vol);
+  bfsStoreSuper();
+  bfsSetVolume(prev);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Abort a commit the disk refused to write.  commitLock is released first,
+// so threads still running do not hang on it while the run ends
+// ============================================================================
+static void jnlFail(Journal* jnl) {
+  pthread_mutex_unlock(&jnl->commitLock);
+  FATAL(EBADWRITE);
+}
+
+
+
+// ============================================================================
+// Write home the blocks of volume 'vol's last commit, from the copy logged,
+// and drop from the cache each one no later transaction has stored.  The
+// caller holds commitLock, with 'vol' current
+// ============================================================================
+static void jnlCheckpoint(Volume* vol) {
+  Journal* jnl  = vol->jnl;
+  JnlDesc* desc = (JnlDesc*)jnl->area[0];
+  if (jnl->doneCount == 0) return;
+
+  int fd = bioFd();
+  for (i32 i = 0; i < jnl->doneCount; ++i) {
+    off_t boff = (off_t)desc->dbn[i] * BYTESPERBLOCK;
+    if (pwrite(fd, jnl->area[1 + i], BYTESPERBLOCK, boff) != BYTESPERBLOCK) {
+      jnlFail(jnl);
+    }
+  }
+
+  pthread_mutex_lock(&jnl->lock);
+  for (i32 i = 0; i < jnl->doneCount; ++i) {
+    i32 dbn = desc->dbn[i];
+    if (jnl->heldSeq[dbn] == jnl->doneSeq) flushSettle(vol, dbn);
+  }
+  pthread_mutex_unlock(&jnl->lock);
+  jnl->doneCount = 0;
+}
+
+
+
+// ============================================================================
+// Checksum (FNV-1a) descriptor 'desc', up to its 'sum', and the 'count'
+// blocks logged after it, in 'blocks'
+// ============================================================================
+static u32 jnlSum(JnlDesc* desc, i8* blocks) {
+  u32 h = 2166136261u;
+  u8* p = (u8*)desc;
+  for (size_t i = 0; i < offsetof(JnlDesc, sum); ++i) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  p = (u8*)blocks;
+  for (i32 i = 0; i < desc->count * BYTESPERBLOCK; ++i) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+
+// ============================================================================
+// Checksum (FNV-1a) SuperBlock 'sb', up to its 'cowSum'
+// ============================================================================
+u32 jnlSumSuper(Super* sb) {
+  if (sb == NULL) FATAL(ENULLPTR);
+  u32 h = 2166136261u;
+  u8* p = (u8*)sb;
+  for (size_t i = 0; i < offsetof(Super, cowSum); ++i) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+
+// ============================================================================
+// Commit the transaction 'desc' describes, staged in its area, to volume
+// 'vol's JNLCOW disk: write its blocks where they live, in DBN order, and
+// fsync; then, if it stored the SuperBlock, seal that and write it over the
+// older copy, and fsync again.  The caller holds commitLock, with 'vol'
+// current.  Return 1 if the SuperBlock switched, else 0
+// ============================================================================
+static i32 jnlSwitch(Volume* vol, JnlDesc* desc) {
+  Journal* jnl = vol->jnl;
+  i32 order[JNLSLOTS];                    // slots to write, by DBN
+  i32 n     = 0;
+  i32 super = -1;                         // slot of the SuperBlock
+  for (i32 i = 0; i < desc->count; ++i) {
+    if (desc->dbn[i] == DBNSUPER) { super = i; continue; }
+    i32 k = n++;
+    for (; k > 0 && desc->dbn[order[k - 1]] > desc->dbn[i]; --k) {
+      order[k] = order[k - 1];
+    }
+    order[k] = i;
+  }
+
+  int fd = bioFd();
+  for (i32 k = 0; k < n; ++k) {
+    off_t boff = (off_t)desc->dbn[order[k]] * BYTESPERBLOCK;
+    if (pwrite(fd, jnl->area[1 + order[k]], BYTESPERBLOCK, boff)
+        != BYTESPERBLOCK) jnlFail(jnl);
+  }
+  if (fsync(fd) != 0) jnlFail(jnl);       // the blocks before the root
+
+  i32 at = (desc->seq % 2) ? DBNSUPER2 : DBNSUPER;
+  if (super >= 0) {
+    Super* sb  = (Super*)jnl->area[1 + super];
+    sb->cowGen = desc->seq;
+    sb->cowSum = jnlSumSuper(sb);
+    off_t boff = (off_t)at * BYTESPERBLOCK;
+    if (pwrite(fd, sb, BYTESPERBLOCK, boff) != BYTESPERBLOCK) jnlFail(jnl);
+    if (fsync(fd) != 0) jnlFail(jnl);
+  }
+
+  pthread_mutex_lock(&jnl->lock);
+  if (super >= 0) jnl->superDbn = at;
+  for (i32 k = 0; k < n; ++k) {
+    i32 dbn = desc->dbn[order[k]];
+    if (jnl->heldSeq[dbn] == desc->seq) flushSettle(vol, dbn);
+  }
+  pthread_mutex_unlock(&jnl->lock);
+  return super >= 0;
+}
+
+
+
+// ============================================================================
+// Commit volume 'vol's running transaction: write home the last commit, log
+// this one in the area its number picks, and fsync once for the whole group.
+// On a JNLCOW disk, jnlSwitch commits it instead.  The transaction closes
+// once every operation in it has called jnlEnd, and the calling thread may
+// not be inside one on 'vol': it would wait for itself.  Dirty data blocks
+// are written first, so no logged Inode maps a block not yet on disk.  The
+// SuperBlock joins it here, if blocks were taken or freed since it was last
+// stored, with the free bitmap as the operations left it: allocation stores
+// nothing itself (bfsDirtySuper).  The blocks it freed then become reusable
+// (on a JNLCOW disk, once its SuperBlock is written).  With nothing to log
+// or free, just write home the last commit.  A disk without a journal just
+// writes its SuperBlock through, if dirty.  Return 0, or EVOLBUSY, doing
+// nothing, if the caller holds a handle on 'vol'.  On failure, abort
+// ============================================================================
+i32 jnlCommit(Volume* vol) {
+  if (vol == NULL) FATAL(ENULLPTR);
+  Journal* jnl = vol->jnl;
+  if (jnl == NULL) return 0;
+  if (t_jnlDepth[vol->id] > 0) return EVOLBUSY;   // never wait for ourselves
+
+  pthread_mutex_lock(&jnl->lock);
+  i32 through = (jnl->mode == 0);
+  pthread_mutex_unlock(&jnl->lock);
+  if (through) return jnlStoreSuper(vol); // no journal: just the SuperBlock
+
+  pthread_mutex_lock(&jnl->commitLock);
+  bfsSetVolume(vol);
+
+  pthread_mutex_lock(&jnl->lock);
+  i32 mode = jnl->mode;
+  pthread_mutex_unlock(&jnl->lock);
+  if (mode == JNLLOG) jnlCheckpoint(vol);
+
+  i32 freeing = 0;                        // frees to release, logged or not
+  for (i32 w = 0; w < FREEWORDS; ++w) {
+    if (__atomic_load_n(&vol->pendingWords[w], __ATOMIC_ACQUIRE)) freeing = 1;
+  }
+  i32 dirty = __atomic_load_n(&vol->superDirty, __ATOMIC_ACQUIRE);
+
+  pthread_mutex_lock(&jnl->lock);
+  if (mode == 0 || (jnl->count == 0 && !freeing && !dirty)) {
+    pthread_mutex_unlock(&jnl->lock);
+    pthread_mutex_unlock(&jnl->commitLock);
+    return 0;
+  }
+
+  jnl->closing = 1;
+  while (jnl->handles > 0) pthread_cond_wait(&jnl->cond, &jnl->lock);
+
+  if (__atomic_exchange_n(&vol->superDirty, 0, __ATOMIC_ACQ_REL)) {
+    i8 buf[BYTESPERBLOCK];                // the map the operations left
+    bfsEncodeSuper(vol, buf);
+    jnlPut(vol, DBNSUPER, buf);
+  }
+
+  JnlDesc* desc = (JnlDesc*)jnl->area[0];
+  memset(desc, 0, BYTESPERBLOCK);
+  desc->magic = JNLMAGIC;
+  desc->seq   = jnl->seq++;
+  desc->count = jnl->count;
+  memcpy(desc->dbn, jnl->dbn, jnl->count * sizeof(i16));
+  memcpy(jnl->area[1], jnl->data, jnl->count * BYTESPERBLOCK);
+
+  u64 freed[FREEWORDS];                   // frees this transaction holds
+  for (i32 w = 0; w < FREEWORDS; ++w) {
+    freed[w] = __atomic_load_n(&vol->pendingWords[w], __ATOMIC_ACQUIRE);
+  }
+
+  jnl->count   = 0;
+  jnl->closing = 0;
+  i32 start    = jnl->start;
+  pthread_cond_broadcast(&jnl->cond);     // the next transaction is open
+  pthread_mutex_unlock(&jnl->lock);
+
+  flushVol(vol);                          // data before the Inodes mapping it
+
+  i32 freeNow = 1;                        // the frees are committed
+  if (mode == JNLCOW) {
+    freeNow = jnlSwitch(vol, desc);
+  } else {
+    desc->sum = jnlSum(desc, jnl->area[1]);
+    off_t   boff = (off_t)(start + (desc->seq % 2) * JNLAREA) * BYTESPERBLOCK;
+    ssize_t want = (ssize_t)(1 + desc->count) * BYTESPERBLOCK;
+    int fd = bioFd();
+    if (pwrite(fd, jnl->area, want, boff) != want) jnlFail(jnl);
+    if (fsync(fd) != 0) jnlFail(jnl);     // the group's one flush
+    jnl->doneSeq   = desc->seq;
+    jnl->doneCount = desc->count;
+  }
+
+  for (i32 w = 0; w < FREEWORDS && freeNow; ++w) {
+    if (freed[w] == 0) continue;
+    __atomic_fetch_or (&vol->freeWords[w],     freed[w], __ATOMIC_RELEASE);
+    __atomic_fetch_and(&vol->pendingWords[w], ~freed[w], __ATOMIC_RELEASE);
+  }
+
+  pthread_mutex_unlock(&jnl->commitLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Atexit handler: commit every journaled volume, and write it home, so
+// metadata stored but not yet logged is not lost
+// ============================================================================
+static void jnlAtExit() {
+  if (errDying()) return;                 // a FATAL may hold commitLock
+  for (i32 id = 0; id < MAXVOLUMES; ++id) {
+    Volume* vol = __atomic_load_n(&g_jnlVols[id], __ATOMIC_ACQUIRE);
+    if (vol == NULL) continue;
+    jnlCommit(vol);                       // log what is left
+    jnlCommit(vol);                       // and write it home
+  }
+}
+
+
+
+// ============================================================================
+// Close volume 'vol's journal, to unmount it: commit what is left, and
+// write it home.  Until the next jnlOpen, metadata stores write through.
+// The caller holds its metaLock.  Return 0, or EVOLBUSY, leaving it open,
+// while an operation is under way on it
+// ============================================================================
+i32 jnlClose(Volume* vol) {
+  if (vol == NULL) FATAL(ENULLPTR);
+  Journal* jnl = vol->jnl;
+
+  pthread_mutex_lock(&jnl->lock);
+  if (jnl->handles > 0) {
+    pthread_mutex_unlock(&jnl->lock);
+    return EVOLBUSY;
+  }
+  jnl->frozen = 1;                        // no operation starts meanwhile
+  pthread_mutex_unlock(&jnl->lock);
+
+  jnlCommit(vol);
+  jnlCommit(vol);
+
+  pthread_mutex_lock(&jnl->commitLock);
+  pthread_mutex_lock(&jnl->lock);
+  jnl->mode   = 0;
+  jnl->frozen = 0;
+  pthread_cond_broadcast(&jnl->cond);
+  pthread_mutex_unlock(&jnl->lock);
+  pthread_mutex_unlock(&jnl->commitLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// End the operation begun by the matching jnlBegin on volume 'vol'.  A disk
+// without a journal stores its SuperBlock now, if the operation took or
+// freed blocks.  On success, return 0
+// ============================================================================
+i32 jnlEnd(Volume* vol) {
+  if (vol == NULL) FATAL(ENULLPTR);
+  if (--t_jnlDepth[vol->id] > 0) return 0;
+
+  Journal* jnl = vol->jnl;
+  pthread_mutex_lock(&jnl->lock);
+  i32 through = (jnl->mode == 0);
+  if (--jnl->handles == 0) pthread_cond_broadcast(&jnl->cond);
+  pthread_mutex_unlock(&jnl->lock);
+  if (through) jnlStoreSuper(vol);        // once per operation, not block
+  return 0;
+}
+
+
+
+// ============================================================================
+// Committer thread: once a transaction begins on some volume, let the group
+// gather for JNLCOMMITMS, then commit every volume; one round later, write
+// the group home.  Sleep while there is nothing new, for as long as the
+// process lives
+// ============================================================================
+static void* jnlWorker(void* arg) {
+  (void)arg;
+  u64 seen = 0;
+  for (;;) {
+    pthread_mutex_lock(&g_jnlLock);
+    while (g_jnlKick == seen) pthread_cond_wait(&g_jnlWork, &g_jnlLock);
+    seen = g_jnlKick;
+    pthread_mutex_unlock(&g_jnlLock);
+
+    for (i32 round = 0; round < 2; ++round) {
+      usleep(JNLCOMMITMS * 1000);
+      pthread_mutex_lock(&g_jnlPauseLock);
+      for (i32 id = 0; id < MAXVOLUMES && !g_jnlPaused; ++id) {
+        Volume* vol = __atomic_load_n(&g_jnlVols[id], __ATOMIC_ACQUIRE);
+        if (vol != NULL) jnlCommit(vol);
+      }
+      pthread_mutex_unlock(&g_jnlPauseLock);
+    }
+  }
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Start the committer thread, and the exit handler.  Run once, by
+// pthread_once
+// ============================================================================
+static void jnlStart() {
+  pthread_t t;
+  if (pthread_create(&t, NULL, jnlWorker, NULL) != 0) FATAL(ENOMEM);
+  pthread_detach(t);
+  atexit(jnlAtExit);
+}
+
+
+
+// ============================================================================
+// Open the journal of volume 'vol' in 'mode' (0 => none), with 'seq' the
+// number of its next transaction, and nothing logged.  'at' is the DBN of
+// its log, for JNLLOG, or of its newest SuperBlock copy, for JNLCOW.  Start
+// the committer, if need be
+// ============================================================================
+static void jnlReset(Volume* vol, i32 mode, i32 at, u32 seq) {
+  Journal* jnl = vol->jnl;
+  pthread_mutex_lock(&jnl->commitLock);
+  pthread_mutex_lock(&jnl->lock);
+  jnl->mode      = mode;
+  jnl->start     = (mode == JNLLOG) ? at : 0;
+  jnl->superDbn  = (mode == JNLCOW) ? at : DBNSUPER;
+  jnl->seq       = seq;
+  jnl->count     = 0;
+  jnl->closing   = 0;
+  jnl->frozen    = 0;
+  jnl->doneCount = 0;
+  memset(jnl->heldSeq, 0, sizeof(jnl->heldSeq));
+  pthread_mutex_unlock(&jnl->lock);
+  pthread_mutex_unlock(&jnl->commitLock);
+
+  if (mode == 0) return;
+  __atomic_store_n(&g_jnlVols[vol->id], vol, __ATOMIC_RELEASE);
+  pthread_once(&g_jnlOnce, jnlStart);
+}
+
+
+
+// ============================================================================
+// Give the disk of volume 'vol', being formatted, an empty journal at
+// MINDBN, or for 'mode' JNLCOW, no log and generation 0 of its SuperBlock at
+// DBNSUPER, dropping any transaction left from the disk it replaces.  'vol'
+// is current.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 jnlFormat(Volume* vol, i32 mode) {
+  if (vol == NULL) FATAL(ENULLPTR);
+  jnlReset(vol, 0, 0, 1);                 // nothing left to commit
+  if (mode == JNLCOW) {
+    jnlReset(vol, JNLCOW, DBNSUPER, 1);
+    return 0;
+  }
+
+  i8  zero[BYTESPERBLOCK] = {0};
+  int fd = bioFd();
+  for (i32 a = 0; a < 2; ++a) {
+    off_t boff = (off_t)(MINDBN + a * JNLAREA) * BYTESPERBLOCK;
+    if (pwrite(fd, zero, BYTESPERBLOCK, boff) != BYTESPERBLOCK) {
+      FATAL(EBADWRITE);
+    }
+  }
+
+  jnlReset(vol, JNLLOG, MINDBN, 1);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Hold back DBN 'dbn' of volume 'vol', just freed, until a commit makes it
+// reusable (Volume.pendingWords).  A commit closes only between operations,
+// so it never releases a free whose operation is still at work.  On
+// success, return 0
+// ============================================================================
+i32 jnlFree(Volume* vol, i32 dbn) {
+  if (vol == NULL)          FATAL(ENULLPTR);
+  if (dbn < 0)              FATAL(EBADDBN);
+  if (dbn >= BLOCKSPERDISK) FATAL(EBADDBN);
+
+  u64 bit = (u64)1 << (dbn % 64);
+  __atomic_fetch_or(&vol->pendingWords[dbn / 64], bit, __ATOMIC_RELEASE);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Replay the journal at 'start' of the disk open on 'fd': copy home the
+// blocks of each area whose descriptor and checksum hold, older transaction
+// first, then flush the disk.  Return the highest transaction number found
+// ============================================================================
+static u32 jnlReplay(int fd, i32 start) {
+  i8 (*areas)[JNLAREA][BYTESPERBLOCK] = calloc(2, JNLAREA * BYTESPERBLOCK);
+  if (areas == NULL) FATAL(ENOMEM);
+
+  u32 top = 0;
+  i32 ok[2] = {0, 0};
+  for (i32 a = 0; a < 2; ++a) {
+    off_t   boff = (off_t)(start + a * JNLAREA) * BYTESPERBLOCK;
+    ssize_t got  = pread(fd, areas[a], JNLAREA * BYTESPERBLOCK, boff);
+    JnlDesc* desc = (JnlDesc*)areas[a][0];
+    if (got < BYTESPERBLOCK || desc->magic != JNLMAGIC) continue;
+    top = MAX(top, desc->seq);
+    if (desc->count < 0 || desc->count > JNLSLOTS) continue;
+    if (got < (ssize_t)(1 + desc->count) * BYTESPERBLOCK) continue;   // torn
+    if (desc->sum != jnlSum(desc, areas[a][1])) continue;
+    ok[a] = 1;
+    for (i32 i = 0; i < desc->count; ++i) {
+      if (desc->dbn[i] < 0 || desc->dbn[i] >= BLOCKSPERDISK) ok[a] = 0;
+    }
+  }
+
+  u32 seq0  = ((JnlDesc*)areas[0][0])->seq;
+  u32 seq1  = ((JnlDesc*)areas[1][0])->seq;
+  i32 first = (ok[0] && ok[1] && seq1 < seq0) ? 1 : 0;
+  for (i32 n = 0; n < 2; ++n) {
+    i32 a = (first + n) % 2;
+    if (!ok[a]) continue;
+    JnlDesc* desc = (JnlDesc*)areas[a][0];
+    for (i32 i = 0; i < desc->count; ++i) {
+      off_t boff = (off_t)desc->dbn[i] * BYTESPERBLOCK;
+      if (pwrite(fd, areas[a][1 + i], BYTESPERBLOCK, boff) != BYTESPERBLOCK) {
+        FATAL(EBADWRITE);
+      }
+    }
+  }
+  if ((ok[0] || ok[1]) && fsync(fd) != 0) FATAL(EBADWRITE);
+
+  free(areas);
+  return top;
+}
+
+
+
+// ============================================================================
+// Pick the SuperBlock copy to mount a JNLCOW disk from, given 'copies', the
+// blocks at DBNSUPER and DBNSUPER2.  A copy holds if its checksum does, it
+// sits where its generation puts it, and it names its Inodes and Dir in
+// range.  Return the DBN of the newer copy that holds, setting '*gen' to its
+// generation.  Return -1 if neither does: the disk is not copy-on-write
+// ============================================================================
+static i32 jnlPickSuper(i8 copies[2][BYTESPERBLOCK], u32* gen) {
+  i32 best = -1;
+  for (i32 c = 0; c < 2; ++c) {
+    Super* sb  = (Super*)copies[c];
+    i32    dbn = (c == 0) ? DBNSUPER : DBNSUPER2;
+    if (sb->cowInodes < MINDBN || sb->cowInodes >= BLOCKSPERDISK) continue;
+    if (sb->cowDir    < MINDBN || sb->cowDir    >= BLOCKSPERDISK) continue;
+    if ((i32)(sb->cowGen % 2) != dbn)     continue;
+    if (sb->cowSum != jnlSumSuper(sb))    continue;
+    if (best >= 0 && sb->cowGen <= *gen)  continue;
+    best = dbn;
+    *gen = sb->cowGen;
+  }
+  return best;
+}
+
+
+
+// ============================================================================
+// Open the journal of volume 'vol', as it is mounted: find it from the
+// SuperBlock on disk, and replay it.  A JNLCOW disk has nothing to replay:
+// it mounts from its newer SuperBlock copy.  A disk without either (or an
+// image not yet formatted, or missing) writes its metadata through.  On
+// success, return 0.  On failure, abort
+// ============================================================================
+i32 jnlOpen(Volume* vol) {
+  if (vol == NULL) FATAL(ENULLPTR);
+
+  if (vol->jnl == NULL) {                 // first use of the volume slot
+    Journal* jnl = calloc(1, sizeof(Journal));
+    if (jnl == NULL) FATAL(ENOMEM);
+    pthread_mutex_init(&jnl->commitLock, NULL);
+    pthread_mutex_init(&jnl->lock, NULL);
+    pthread_cond_init (&jnl->cond, NULL);
+    vol->jnl = jnl;
+  }
+
+  i8    buf[2][BYTESPERBLOCK] = {{0}};   // DBNSUPER, then DBNSUPER2
+  i32   start = 0;
+  u32   seq   = 0;
+  off_t boff  = (off_t)DBNSUPER * BYTESPERBLOCK;
+  int   fd    = open(vol->path, O_RDWR);
+  if (fd >= 0 && pread(fd, buf, 2 * BYTESPERBLOCK, boff) >= BYTESPERBLOCK) {
+    i32 at = jnlPickSuper(buf, &seq);
+    if (at >= 0) {                        // copy-on-write: nothing to replay
+      close(fd);
+      jnlReset(vol, JNLCOW, at, seq + 1);
+      return 0;
+    }
+    start = ((Super*)buf[0])->jnlStart;
+  }
+  if (start < 0 || (start > 0 && start < MINDBN)) FATAL(EBADDBN);
+  if (start + JNLBLOCKS > BLOCKSPERDISK)          FATAL(EBADDBN);
+
+  if (start > 0) seq = jnlReplay(fd, start);
+  if (fd >= 0) close(fd);
+  jnlReset(vol, start > 0 ? JNLLOG : 0, start, seq + 1);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Stop the committer thread's rounds, if 'pause', once the one under way
+// ends; else start them again.  Commits that callers ask for, as bfsSyncAll
+// and unmount do, still run.  For tests that must catch a transaction
+// logged, but not yet written home.  On success, return 0
+// ============================================================================
+i32 jnlPause(i32 pause) {
+  pthread_mutex_lock(&g_jnlPauseLock);
+  g_jnlPaused = (pause != 0);
+  pthread_mutex_unlock(&g_jnlPauseLock);
+  if (!pause) jnlKick();                  // catch up on what was skipped
+  return 0;
+}
+
+
+
+// ============================================================================
+// Store 'buf' as metadata block 'dbn' of the current volume, in place, if
+// the disk is JNLCOW and the running transaction has already stored it: no
+// commit names that copy yet.  The check and the store are one step, so no
+// commit falls between.  Return 1 if stored, else 0, and the caller moves
+// the block (bfsStoreMeta)
+// ============================================================================
+i32 jnlRewrite(i32 dbn, void* buf) {
+
+  if (dbn < 0)              FATAL(EBADDBN);
+  if (dbn >= BLOCKSPERDISK) FATAL(EBADDBN);
+  if (buf == NULL)          FATAL(ENULLPTR);
+
+  Journal* jnl = bfsVol()->jnl;
+  pthread_mutex_lock(&jnl->lock);
+  if (jnl->mode != JNLCOW || jnl->heldSeq[dbn] != jnl->seq) {
+    pthread_mutex_unlock(&jnl->lock);
+    return 0;
+  }
+
+  i32 slot = 0;
+  while (slot < jnl->count && jnl->dbn[slot] != dbn) ++slot;
+  if (slot == jnl->count) {               // held, but not in it
+    pthread_mutex_unlock(&jnl->lock);
+    FATAL(EBADDBN);
+  }
+  memcpy(jnl->data[slot], buf, BYTESPERBLOCK);
+  flushHold(dbn, buf);
+  pthread_mutex_unlock(&jnl->lock);
+  return 1;
+}
+
+
+
+// ============================================================================
+// Return the DBN of the SuperBlock copy volume 'vol' mounts from: the newest
+// on a JNLCOW disk, else DBNSUPER
+// ============================================================================
+i32 jnlSuper(Volume* vol) {
+  if (vol == NULL) FATAL(ENULLPTR);
+  Journal* jnl = vol->jnl;
+  if (jnl == NULL) return DBNSUPER;
+  pthread_mutex_lock(&jnl->lock);
+  i32 dbn = (jnl->mode == JNLCOW) ? jnl->superDbn : DBNSUPER;
+  pthread_mutex_unlock(&jnl->lock);
+  return dbn;
+}
+
+
+
+// ============================================================================
+// Store 'buf' as metadata block 'dbn' of the current volume.  With a
+// journal, it joins the running transaction, in place of any copy already
+// there, and reaches the disk with that transaction's commit; reads see it
+// at once, from the write-back cache.  It cannot be full (see the bound at
+// the top of this file).  On a JNLCOW disk, the SuperBlock is not cached: its
+// copy lands at commit (jnlSwitch).  Without a journal, it is written
+// through.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 jnlWrite(i32 dbn, void* buf) {
+
+  if (dbn < 0)              FATAL(EBADDBN);
+  if (dbn >= BLOCKSPERDISK) FATAL(EBADDBN);
+  if (buf == NULL)          FATAL(ENULLPTR);
+
+  Volume*  vol = bfsVol();
+  Journal* jnl = vol->jnl;
+
+  pthread_mutex_lock(&jnl->lock);
+  if (jnl->mode != 0 && !jnlPut(vol, dbn, buf)) {
+    pthread_mutex_unlock(&jnl->lock);
+    FATAL(EJNLFULL);                      // more blocks than metadata has
+  }
+  if (jnl->mode == 0) {
+    pthread_mutex_unlock(&jnl->lock);
+    return bioWrite(dbn, buf);
+  }
+  pthread_mutex_unlock(&jnl->lock);
+  return 0;
+}
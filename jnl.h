@@ -0,0 +1,75 @@
+#ifndef JNL_H
+#define JNL_H
+
+// ===================================================================
+// jnl.h - write-ahead journal of metadata blocks.  Stores of the
+// SuperBlock, Inodes, Dir and indirect blocks join the volume's
+// running transaction, in memory, and are read back from the
+// write-back cache.  Every JNLCOMMITMS a committer thread logs the
+// transaction, many operations' worth, with one fsync, and writes it
+// home at the next commit.  Mount replays what was logged.  Disks
+// formatted before the journal have none, and write metadata through.
+// A disk formatted JNLCOW keeps no log: its metadata moves to fresh
+// DBNs, each block written once, and a commit switches between two
+// SuperBlock copies.  Mount takes the newer, with nothing to replay
+// ===================================================================
+
+#include "bfs.h"
+#include "alias.h"
+
+#define JNLSLOTS    (NUMMETA + NUMINODES)   // blocks one transaction logs
+#define JNLMOVES    3                       // blocks an operation's metadata
+                                            //   may take: Inodes, Dir, and
+                                            //   an indirect block
+#define JNLAREA     (1 + JNLSLOTS)          // a JnlDesc, then those blocks
+#define JNLBLOCKS   (2 * JNLAREA)           // two areas, used in turn
+#define JNLMAGIC    0x314C4E4Au             // "JNL1"
+#define JNLCOMMITMS 5                       // group commit interval
+
+#define JNLLOG      1                       // Journal.mode: write-ahead log
+#define JNLCOW      2                       // Journal.mode: copy-on-write
+
+typedef struct {          // JnlDesc: first block of a journal area
+  u32 magic;              // JNLMAGIC.  Else the area holds nothing
+  u32 seq;                // transaction number.  Lives in area seq % 2
+  i32 count;              // # blocks logged after this one
+  i16 dbn[JNLSLOTS];      // home DBN of each
+  u32 sum;                // checksum of the fields above, and the blocks
+} JnlDesc;
+
+struct Journal {          // Journal: one volume's log.  Volume.jnl
+  pthread_mutex_t commitLock; // one commit at a time; 'area', 'done*'
+  pthread_mutex_t lock;   // the fields from 'mode' to 'heldSeq'
+  pthread_cond_t  cond;   // handles drained, or a transaction closed
+
+  i32 mode;               // JNLLOG or JNLCOW.  0 => none, or closed
+  i32 start;              // JNLLOG: DBN of area 0
+  i32 superDbn;           // JNLCOW: DBN of the newest SuperBlock copy
+  u32 seq;                // number of the running transaction
+  i32 handles;            // # operations between jnlBegin and jnlEnd
+  i32 closing;            // 1 => a commit waits for handles to drain
+  i32 frozen;             // 1 => unmounting: jnlBegin waits
+  i32 count;              // # blocks in the running transaction
+  i16 dbn [JNLSLOTS];     // their home DBNs
+  i8  data[JNLSLOTS][BYTESPERBLOCK];
+  u32 heldSeq[BLOCKSPERDISK];   // transaction that last logged each DBN
+
+  u32 doneSeq;            // last transaction committed, not yet home
+  i32 doneCount;          // # blocks in it.  0 => all home
+  i8  area[JNLAREA][BYTESPERBLOCK];   // its JnlDesc and blocks, as logged
+};
+
+i32 jnlBegin (Volume* vol, i32 numBlocks);
+i32 jnlClose (Volume* vol);
+i32 jnlCommit(Volume* vol);
+i32 jnlEnd   (Volume* vol);
+i32 jnlFormat(Volume* vol, i32 mode);
+i32 jnlFree  (Volume* vol, i32 dbn);
+i32 jnlOpen  (Volume* vol);
+i32 jnlPause (i32 pause);
+i32 jnlRewrite(i32 dbn, void* buf);
+i32 jnlSuper (Volume* vol);
+u32 jnlSumSuper(Super* sb);
+i32 jnlWrite (i32 dbn, void* buf);
+
+#endif
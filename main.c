@@ -1,11 +1,17 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "bfs.h"
 #include "errors.h"
+#include "p5bench.h"
 #include "p5test.h"
 
-int main() {
+int main(int argc, char* argv[]) {
   bfsInitOFT();
-  p5test();
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    p5bench();                    // timings, not tests
+  } else {
+    p5test();
+  }
   return 0;
 }
\ No newline at end of file
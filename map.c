@@ -0,0 +1,216 @@
+// ============================================================================
+// map.c - memory-mapped views of file ranges
+// ============================================================================
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "flush.h"
+#include "map.h"
+
+static FsMapping* g_maps    = NULL;     // live mappings
+static i32        g_mapsLen = 0;
+static i32        g_mapsCap = 0;
+static pthread_mutex_t g_mapsLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// ============================================================================
+// Add 'delta' to the count of direct views of each of the 'numBlocks' blocks
+// of volume 'vol' from DBN 'dbn'.  flushPut writes a block with a view
+// straight to disk
+// ============================================================================
+static void mapRef(Volume* vol, i32 dbn, i32 numBlocks, i32 delta) {
+  for (i32 i = 0; i < numBlocks; ++i) {
+    __atomic_fetch_add(&vol->mapRefs[dbn + i], delta, __ATOMIC_ACQ_REL);
+  }
+}
+
+
+
+// ============================================================================
+// Map 'len' bytes of the file open on 'fd', from byte-offset 'offset', into
+// one contiguous range of memory, and return its address.  'prot' is
+// FSMAPREAD, optionally with FSMAPWRITE.  The range is clamped to EOF.
+//
+// If the range's blocks sit in consecutive DBNs (and, for FSMAPWRITE, none
+// is shared with a clone), the disk image itself is mapped: loads and stores
+// go straight to the file's blocks, and fsPwrite to them shows at once.
+// Otherwise the range is read into a private copy, which fsMsync and
+// fsUnmap write back.  Do not clone a file, or grow it with fsWrite or
+// fsAppend, under a writable mapping.
+//
+// Return NULL if nothing lies between 'offset' and EOF.  On failure, abort
+// ============================================================================
+void* fsMap(i32 fd, i32 offset, i32 len, i32 prot) {
+
+  if (offset < 0)                 FATAL(EBADCURS);
+  if (len    < 0)                 FATAL(ENEGNUMB);
+  if ((prot & FSMAPREAD) == 0)    FATAL(ENYI);
+
+  i32 inum = bfsFdToInum(fd);
+  i32 size = bfsGetSize(inum);
+  if (offset >= size) return NULL;
+  len = MIN(len, size - offset);
+  if (len == 0) return NULL;
+
+  FsMapping m;
+  m.fd     = fd;
+  m.offset = offset;
+  m.len    = len;
+  m.prot   = prot;
+  m.direct = 0;
+
+  i32 dbn = mapContig(inum, offset, len, prot);
+  if (dbn > 0) {
+    i64 page  = sysconf(_SC_PAGESIZE);
+    i64 start = (i64)dbn * BYTESPERBLOCK + offset % BYTESPERBLOCK;
+    i64 pgoff = start & ~(page - 1);      // mmap needs a page boundary
+    int mprot = PROT_READ | ((prot & FSMAPWRITE) ? PROT_WRITE : 0);
+    Volume* vol       = bfsVol();
+    i32     numBlocks = (offset + len - 1) / BYTESPERBLOCK
+                      - offset / BYTESPERBLOCK + 1;
+
+    mapRef(vol, dbn, numBlocks, 1);       // later writes skip the cache
+    flushVol(vol);                        // no cached or queued I/O in the
+    bioDrain();                           //   range
+    void* base = mmap(NULL, len + (start - pgoff), mprot, MAP_SHARED,
+                      bioFd(), pgoff);
+    if (base != MAP_FAILED) {
+      m.base      = base;
+      m.baselen   = len + (start - pgoff);
+      m.addr      = (i8*)base + (start - pgoff);
+      m.direct    = 1;
+      m.vol       = vol;
+      m.dbn       = dbn;
+      m.numBlocks = numBlocks;
+    } else {
+      mapRef(vol, dbn, numBlocks, -1);
+    }
+  }
+
+  if (m.direct == 0) {                    // fall back to a private copy
+    m.base = malloc(len);
+    if (m.base == NULL) FATAL(ENOMEM);
+    m.baselen = len;
+    m.addr    = m.base;
+    fsPread(fd, len, m.addr, offset);
+  }
+
+  pthread_mutex_lock(&g_mapsLock);
+  if (g_mapsLen == g_mapsCap) {
+    i32 cap = (g_mapsCap == 0) ? 16 : 2 * g_mapsCap;
+    FsMapping* a = realloc(g_maps, cap * sizeof(FsMapping));
+    if (a == NULL) FATAL(ENOMEM);
+    g_maps    = a;
+    g_mapsCap = cap;
+  }
+  g_maps[g_mapsLen++] = m;
+  pthread_mutex_unlock(&g_mapsLock);
+
+  return m.addr;
+}
+
+
+
+// ============================================================================
+// Make stores through the mapping at 'addr' durable in the file.  A direct
+// mapping is flushed with msync; a copy is written back with fsPwrite.  On
+// success, return 0.  On failure, abort
+// ============================================================================
+i32 fsMsync(void* addr) {
+  pthread_mutex_lock(&g_mapsLock);
+  FsMapping m = *mapFind(addr);
+  pthread_mutex_unlock(&g_mapsLock);
+
+  return mapSync(&m);
+}
+
+
+
+// ============================================================================
+// Remove the mapping at 'addr', first writing back any stores through it.
+// On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsUnmap(void* addr) {
+  pthread_mutex_lock(&g_mapsLock);
+  FsMapping* found = mapFind(addr);
+  FsMapping  m     = *found;
+  *found = g_maps[--g_mapsLen];           // fill the hole with the last
+  pthread_mutex_unlock(&g_mapsLock);
+
+  mapSync(&m);
+
+  if (m.direct) {
+    munmap(m.base, m.baselen);
+    mapRef(m.vol, m.dbn, m.numBlocks, -1);
+  } else {
+    free(m.base);
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Decide whether bytes 'offset' .. 'offset + len' of file 'inum' lie in
+// consecutive DBNs, with no holes, and (for FSMAPWRITE in 'prot') no block
+// shared with a clone.  If so, return the DBN holding 'offset'; else 0
+// ============================================================================
+i32 mapContig(i32 inum, i32 offset, i32 len, i32 prot) {
+  i32 fbnLo = offset / BYTESPERBLOCK;
+  i32 fbnHi = (offset + len - 1) / BYTESPERBLOCK;
+
+  i32 dbnLo = bfsFbnToDbn(inum, fbnLo);
+  if (dbnLo == ENODBN) return 0;
+
+  bfsLockMeta();
+  Super* super = bfsLoadSuper();
+
+  for (i32 fbn = fbnLo; fbn <= fbnHi; ++fbn) {
+    i32 dbn = bfsFbnToDbn(inum, fbn);
+    if (dbn != dbnLo + (fbn - fbnLo)
+        || ((prot & FSMAPWRITE) && super->shared[dbn] > 0)) {
+      dbnLo = 0;
+      break;
+    }
+  }
+  bfsUnlockMeta();
+  return dbnLo;
+}
+
+
+
+// ============================================================================
+// Find the live mapping whose address is 'addr'.  If none, abort.  The caller
+// holds g_mapsLock
+// ============================================================================
+FsMapping* mapFind(void* addr) {
+  if (addr == NULL) FATAL(ENULLPTR);
+  for (i32 i = 0; i < g_mapsLen; ++i) {
+    if (g_maps[i].addr == addr) return &g_maps[i];
+  }
+  FATAL(EBADCURS);                        // not a live mapping
+  return NULL;                            // pacify compiler
+}
+
+
+
+// ============================================================================
+// Write back the stores through mapping 'm', for fsMsync and fsUnmap.  On
+// success, return 0.  On failure, abort
+// ============================================================================
+i32 mapSync(FsMapping* m) {
+  if ((m->prot & FSMAPWRITE) == 0) return 0;
+
+  if (m->direct) {
+    Incore* ic = bfsFindOFTE(m->fd)->ic;
+    bfsLockInode(ic, 1);
+    ic->tailFbn = -1;                     // fsAppend's tail may be stale
+    bfsUnlockInode(ic);
+    if (msync(m->base, m->baselen, MS_SYNC) != 0) FATAL(EBADWRITE);
+  } else {
+    fsPwrite(m->fd, m->len, m->addr, m->offset);
+  }
+  return 0;
+}
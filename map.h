@@ -0,0 +1,34 @@
+#ifndef MAP_H
+#define MAP_H
+
+// ===================================================================
+// map.h - memory-mapped views of file ranges.  fsMap maps the disk
+// image directly when the range's blocks are contiguous; otherwise
+// it hands out a private copy that fsMsync writes back.  While a
+// direct view is live, writes to its blocks bypass the write-back
+// cache (flush.h), so the view sees them at once
+// ===================================================================
+
+#include "fs.h"
+#include "bio.h"
+#include "alias.h"
+
+typedef struct {          // FsMapping: one live fsMap view
+  i8*   addr;             // address returned to the caller
+  i32   fd;               // file descriptor mapped
+  i32   offset;           // byte-offset into file
+  i32   len;              // # bytes mapped
+  i32   prot;             // FSMAPREAD | FSMAPWRITE
+  void* base;             // start of the mmap, or of the copy
+  i64   baselen;          // # bytes at 'base'
+  i32   direct;           // 1 => mmap of the disk image; 0 => copy
+  Volume* vol;            // direct: volume whose blocks are mapped
+  i32   dbn;              // direct: first DBN mapped
+  i32   numBlocks;        // direct: # blocks mapped, counted in mapRefs
+} FsMapping;
+
+FsMapping* mapFind(void* addr);
+i32        mapContig(i32 inum, i32 offset, i32 len, i32 prot);
+i32        mapSync(FsMapping* m);
+
+#endif
@@ -0,0 +1,421 @@
+// ============================================================================
+// p5bench.c : time the BFS filesystem, on a scratch disk, and print each
+// result.  Run as 'a.out bench'
+// ============================================================================
+
+#include "p5bench.h"
+
+static pthread_barrier_t g_benchGo;     // a round starts
+static pthread_barrier_t g_benchDone;   // a round is over
+
+
+
+// ============================================================================
+// Return the time now, in seconds, from a clock that never steps back
+// ============================================================================
+double benchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+// ============================================================================
+// Worker thread for benchAlloc: each round, take blocks on volume 'arg->vol'
+// until the disk is full, counting them
+// ============================================================================
+void* benchAllocWorker(void* arg) {
+  BenchArg* ba = (BenchArg*)arg;
+  for (i32 r = 0; r < ba->rounds; ++r) {
+    pthread_barrier_wait(&g_benchGo);
+    bfsUseVol(ba->vol);
+    while (bfsTakeBlock() != 0) ++ba->count;
+    pthread_barrier_wait(&g_benchDone);
+  }
+  return NULL;
+}
+
+
+
+// ============================================================================
+// BENCH alloc : 1, 2 and 4 threads take every free block of a freshly
+// formatted disk at once, ALLOCROUNDS times.  Print the time per block
+// taken.  Formatting between rounds is not timed
+// ============================================================================
+void benchAlloc() {
+  for (i32 threads = 1; threads <= BENCHTHREADS; threads *= 2) {
+    pthread_barrier_init(&g_benchGo,   NULL, threads + 1);
+    pthread_barrier_init(&g_benchDone, NULL, threads + 1);
+
+    i32 vol = fsFormatAt(BENCHDISK);
+    BenchArg  args[BENCHTHREADS];
+    pthread_t tids[BENCHTHREADS];
+    for (i32 t = 0; t < threads; ++t) {
+      args[t] = (BenchArg){ vol, 0, ALLOCROUNDS, 0 };
+      pthread_create(&tids[t], NULL, benchAllocWorker, &args[t]);
+    }
+
+    double secs = 0;
+    for (i32 r = 0; r < ALLOCROUNDS; ++r) {
+      if (r > 0) fsFormatAt(BENCHDISK);   // every block free again
+      bfsLoadSuper();                     // the map, read before timing
+      pthread_barrier_wait(&g_benchGo);
+      double t0 = benchNow();
+      pthread_barrier_wait(&g_benchDone);
+      secs += benchNow() - t0;
+    }
+
+    i64 taken = 0;
+    for (i32 t = 0; t < threads; ++t) {
+      pthread_join(tids[t], NULL);
+      taken += args[t].count;
+    }
+    printf("BENCH alloc  : %d thread(s) : %7.1f ns/block \n",
+      threads, secs * 1e9 / taken);
+
+    pthread_barrier_destroy(&g_benchGo);
+    pthread_barrier_destroy(&g_benchDone);
+    fsUnmount(vol);
+  }
+  remove(BENCHDISK);
+}
+
+
+
+// ============================================================================
+// Worker thread for benchLookup: look up "L" by name, and read its size,
+// 'arg->rounds' times
+// ============================================================================
+void* benchLookupWorker(void* arg) {
+  BenchArg* ba = (BenchArg*)arg;
+  pthread_barrier_wait(&g_benchGo);
+  bfsUseVol(ba->vol);
+  for (i32 r = 0; r < ba->rounds; ++r) {
+    i32 inum = bfsLookupFile("L");
+    ba->count += (bfsGetSize(inum) > 0);
+  }
+  pthread_barrier_wait(&g_benchDone);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// BENCH lookup : 1, 2 and 4 threads each resolve the name "L", and read its
+// size, LOOKUPROUNDS times, as fsOpen and fsSize do.  Print the time per
+// lookup, all threads together
+// ============================================================================
+void benchLookup() {
+  i8  buf[BYTESPERBLOCK] = {0};
+  i32 vol = fsFormatAt(BENCHDISK);
+  i32 fd  = fsCreateAt(vol, "L");
+  fsWrite(fd, sizeof(buf), buf);
+  fsClose(fd);
+
+  for (i32 threads = 1; threads <= BENCHTHREADS; threads *= 2) {
+    pthread_barrier_init(&g_benchGo,   NULL, threads + 1);
+    pthread_barrier_init(&g_benchDone, NULL, threads + 1);
+
+    BenchArg  args[BENCHTHREADS];
+    pthread_t tids[BENCHTHREADS];
+    for (i32 t = 0; t < threads; ++t) {
+      args[t] = (BenchArg){ vol, 0, LOOKUPROUNDS, 0 };
+      pthread_create(&tids[t], NULL, benchLookupWorker, &args[t]);
+    }
+
+    pthread_barrier_wait(&g_benchGo);
+    double t0 = benchNow();
+    pthread_barrier_wait(&g_benchDone);
+    double secs = benchNow() - t0;
+
+    for (i32 t = 0; t < threads; ++t) pthread_join(tids[t], NULL);
+    printf("BENCH lookup : %d thread(s) : %7.1f ns/lookup \n",
+      threads, secs * 1e9 / (threads * LOOKUPROUNDS));
+
+    pthread_barrier_destroy(&g_benchGo);
+    pthread_barrier_destroy(&g_benchDone);
+  }
+  fsUnmount(vol);
+  remove(BENCHDISK);
+}
+
+
+
+// ============================================================================
+// BENCH mdtest : as mdtest does, create files in one directory, then look
+// each up by name and read its size.  BFS holds NUMINODES files, so each of
+// MDROUNDS rounds formats a fresh disk, untimed, and fills its Directory.
+// Print the time per create, and per lookup
+// ============================================================================
+void benchMdtest() {
+  char names[NUMINODES][FNAMESIZE];
+  for (i32 i = 0; i < NUMINODES; ++i) {
+    snprintf(names[i], FNAMESIZE, "mdtest.0.%d", i);
+  }
+
+  double create = 0, lookup = 0;
+  i64    found  = 0;
+  for (i32 r = 0; r < MDROUNDS; ++r) {
+    i32 vol = fsFormatAt(BENCHDISK);
+
+    double t0 = benchNow();
+    for (i32 i = 0; i < NUMINODES; ++i) fsClose(fsCreateAt(vol, names[i]));
+    create += benchNow() - t0;
+
+    bfsUseVol(vol);
+    t0 = benchNow();
+    for (i32 i = 0; i < NUMINODES; ++i) {
+      i32 inum = bfsLookupFile(names[i]);
+      found += (inum >= 0 && bfsGetSize(inum) == 0);
+    }
+    lookup += benchNow() - t0;
+    fsUnmount(vol);
+  }
+
+  i64 files = (i64)MDROUNDS * NUMINODES;
+  printf("BENCH mdtest : create : %7.1f us/file ; lookup : %7.1f ns/file \n",
+    create * 1e6 / files, lookup * 1e9 / files);
+  if (found != files) printf("BENCH mdtest : BAD  : a file was not found \n");
+  remove(BENCHDISK);
+}
+
+
+
+// ============================================================================
+// BENCH meta : on a disk formatted with a journal, then on a copy-on-write
+// one, clone a METABLOCKS-block file over another METAROUNDS times, and sync
+// once at the end.  Each clone remaps every block of the target, through
+// its indirect block, and frees the blocks it replaces: metadata only.
+// Print the time per clone, the final sync included
+// ============================================================================
+void benchMeta() {
+  static i8 buf[METABLOCKS * BYTESPERBLOCK];
+  FsOp sync = { FSOPSYNC, 0, 0, 0, NULL, NULL, 0, NULL };
+
+  for (i32 cow = 0; cow < 2; ++cow) {
+    i32 vol = cow ? fsFormatCowAt(BENCHDISK) : fsFormatAt(BENCHDISK);
+    i32 fa  = fsCreateAt(vol, "A");
+    i32 fb  = fsCreateAt(vol, "B");
+    fsWrite(fa, sizeof(buf), buf);
+    fsSubmit(1, &sync);
+    fsRun();
+
+    double t0 = benchNow();
+    for (i32 r = 0; r < METAROUNDS; ++r) fsClone(fa, fb);
+    fsSubmit(1, &sync);
+    fsRun();
+    double secs = benchNow() - t0;
+
+    printf("BENCH meta   : %s : %7.1f us/clone \n",
+      cow ? "copy-on-write" : "journal      ", secs * 1e6 / METAROUNDS);
+    fsClose(fa);
+    fsClose(fb);
+    fsUnmount(vol);
+  }
+  remove(BENCHDISK);
+}
+
+
+
+// ============================================================================
+// Scalar twin of bfsNameEq: compare names 'a' and 'b' over bytes 0..len, one
+// byte at a time.  Return 1 if equal, else 0
+// ============================================================================
+i32 benchNameEqScalar(char* a, char* b, i32 len) {
+  for (i32 i = 0; i <= len; ++i) {
+    if (a[i] != b[i]) return 0;
+  }
+  return 1;
+}
+
+
+
+// ============================================================================
+// Scalar twin of bfsFindFreeSlot: return the first inum of Directory index
+// 'dir' not in use, or -1
+// ============================================================================
+i32 benchNameSlotScalar(DirSnap* dir) {
+  for (i32 inum = 0; inum < NUMINODES; ++inum) {
+    if (dir->len[inum] == 0) return inum;
+  }
+  return -1;
+}
+
+
+
+// ============================================================================
+// BENCH name : compare a key with a Directory name NAMEROUNDS times, by
+// bfsNameEq and by its scalar twin, for a name of 15 bytes and one of
+// FNAMEMAX: both match to the last byte, the worst case.  Then, on a disk
+// whose Directory is full but for its last slot, find that slot NAMEROUNDS
+// times, by bfsFindFreeSlot and by its twin.  Print the time per call
+// ============================================================================
+void benchName() {
+  static char name[FNAMEMAX + 1], key[FNAMEMAX + 1];
+  i32 lens[] = { FNAMESIZE - 1, FNAMEMAX };
+  i64 hits   = 0;
+
+  for (i32 k = 0; k < 2; ++k) {
+    i32 len = lens[k];
+    memset(name, 0, sizeof(name));
+    memset(name, 'n', len);
+    memcpy(key, name, sizeof(key));
+
+    double t0 = benchNow();
+    for (i32 r = 0; r < NAMEROUNDS; ++r) hits += bfsNameEq(name, key, len);
+    double kernel = benchNow() - t0;
+
+    t0 = benchNow();
+    for (i32 r = 0; r < NAMEROUNDS; ++r) {
+      hits += benchNameEqScalar(name, key, len);
+    }
+    double scalar = benchNow() - t0;
+
+    printf("BENCH name   : equal, %3d bytes : %7.1f ns kernel, %7.1f ns "
+      "scalar \n", len, kernel * 1e9 / NAMEROUNDS, scalar * 1e9 / NAMEROUNDS);
+  }
+
+  i32 vol = fsFormatAt(BENCHDISK);
+  for (i32 i = 0; i < NUMINODES - 1; ++i) {
+    char fname[] = { 'F', (char)('0' + i), 0 };
+    fsClose(fsCreateAt(vol, fname));
+  }
+  bfsUseVol(vol);
+  bfsLoadDir();
+  bfsLockMeta();
+  DirSnap* dir = bfsVol()->dir;
+
+  double t0 = benchNow();
+  for (i32 r = 0; r < NAMEROUNDS; ++r) hits += bfsFindFreeSlot();
+  double kernel = benchNow() - t0;
+
+  t0 = benchNow();
+  for (i32 r = 0; r < NAMEROUNDS; ++r) hits += benchNameSlotScalar(dir);
+  double scalar = benchNow() - t0;
+
+  bfsUnlockMeta();
+  printf("BENCH name   : free slot       : %7.1f ns kernel, %7.1f ns "
+    "scalar \n", kernel * 1e9 / NAMEROUNDS, scalar * 1e9 / NAMEROUNDS);
+
+  i64 want = 4LL * NAMEROUNDS + 2LL * NAMEROUNDS * (NUMINODES - 1);
+  if (hits != want) printf("BENCH name   : BAD  : kernel and twin differ \n");
+  fsUnmount(vol);
+  remove(BENCHDISK);
+}
+
+
+
+// ============================================================================
+// Worker thread for benchRead: each round, read file 'arg->fd' whole
+// ============================================================================
+void* benchReadWorker(void* arg) {
+  BenchArg* ba = (BenchArg*)arg;
+  static __thread i8 buf[READBLOCKS * BYTESPERBLOCK];
+  pthread_barrier_wait(&g_benchGo);
+  for (i32 r = 0; r < ba->rounds; ++r) {
+    ba->count += fsPread(ba->fd, sizeof(buf), buf, 0);
+  }
+  pthread_barrier_wait(&g_benchDone);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// BENCH read : 1, 2 and 4 threads each read one READBLOCKS-block file whole,
+// READROUNDS times, through its own fd.  Each read is large enough to be
+// split over the worker pool.  Print the time per read, and the throughput
+// of all threads together
+// ============================================================================
+void benchRead() {
+  static i8 buf[READBLOCKS * BYTESPERBLOCK];
+  i32 vol = fsFormatAt(BENCHDISK);
+  i32 fd  = fsCreateAt(vol, "R");
+  for (i32 b = 0; b < READBLOCKS; ++b) {
+    memset(buf + b * BYTESPERBLOCK, b, BYTESPERBLOCK);
+  }
+  fsWrite(fd, sizeof(buf), buf);
+  fsClose(fd);
+  FsOp sync = { FSOPSYNC, 0, 0, 0, NULL, NULL, 0, NULL };
+  fsSubmit(1, &sync);
+  fsRun();                                // on disk, not in the cache
+
+  for (i32 threads = 1; threads <= BENCHTHREADS; threads *= 2) {
+    pthread_barrier_init(&g_benchGo,   NULL, threads + 1);
+    pthread_barrier_init(&g_benchDone, NULL, threads + 1);
+
+    BenchArg  args[BENCHTHREADS];
+    pthread_t tids[BENCHTHREADS];
+    for (i32 t = 0; t < threads; ++t) {
+      args[t] = (BenchArg){ vol, fsOpenAt(vol, "R", 0), READROUNDS, 0 };
+      pthread_create(&tids[t], NULL, benchReadWorker, &args[t]);
+    }
+
+    pthread_barrier_wait(&g_benchGo);
+    double t0 = benchNow();
+    pthread_barrier_wait(&g_benchDone);
+    double secs = benchNow() - t0;
+
+    i64 bytes = 0;
+    for (i32 t = 0; t < threads; ++t) {
+      pthread_join(tids[t], NULL);
+      bytes += args[t].count;
+      fsClose(args[t].fd);
+    }
+    printf("BENCH read   : %d thread(s) : %7.1f us/read  %7.1f MB/s \n",
+      threads, secs * 1e6 / (threads * READROUNDS), bytes / secs / 1e6);
+
+    pthread_barrier_destroy(&g_benchGo);
+    pthread_barrier_destroy(&g_benchDone);
+  }
+  fsUnmount(vol);
+  remove(BENCHDISK);
+}
+
+
+
+// ============================================================================
+// BENCH write : fsPwrite WRITEROUNDS single blocks over a WRITEBLOCKS-block
+// file, first with nothing mapped, then under a direct fsMap of the whole
+// file, where each write goes through the cache to disk at once.  Print the
+// time per write of each
+// ============================================================================
+void benchWrite() {
+  static i8 buf[WRITEBLOCKS * BYTESPERBLOCK];
+  i32 vol = fsFormatAt(BENCHDISK);
+  i32 fd  = fsCreateAt(vol, "W");
+  fsWrite(fd, sizeof(buf), buf);
+
+  for (i32 mapped = 0; mapped < 2; ++mapped) {
+    void* p = mapped ? fsMap(fd, 0, sizeof(buf), FSMAPREAD) : NULL;
+    double t0 = benchNow();
+    for (i32 r = 0; r < WRITEROUNDS; ++r) {
+      i32 fbn = (r * 7) % WRITEBLOCKS;    // wander over the file
+      memset(buf, r, BYTESPERBLOCK);
+      fsPwrite(fd, BYTESPERBLOCK, buf, fbn * BYTESPERBLOCK);
+    }
+    double secs = benchNow() - t0;
+    if (p != NULL) fsUnmap(p);
+    printf("BENCH write  : %s : %7.2f us/write \n",
+      mapped ? "under fsMap " : "not mapped  ", secs * 1e6 / WRITEROUNDS);
+  }
+
+  fsClose(fd);
+  fsUnmount(vol);
+  remove(BENCHDISK);
+}
+
+
+
+void p5bench() {
+
+  benchAlloc();
+  benchLookup();
+  benchMdtest();
+  benchMeta();
+  benchName();
+  benchRead();
+  benchWrite();
+
+}
\ No newline at end of file
@@ -0,0 +1,47 @@
+#ifndef P5BENCH_H
+#define P5BENCH_H
+
+#include <pthread.h>      // pthread_create, pthread_barrier_wait
+#include <stdio.h>        // printf, remove
+#include <string.h>       // memset
+#include <time.h>         // clock_gettime
+
+#include "alias.h"        // i32, etc
+#include "fs.h"           // fsFormatAt, etc
+
+#define BENCHDISK    "BFSBENCH"   // scratch disk image
+#define BENCHTHREADS 4            // most threads a benchmark runs
+#define ALLOCROUNDS  2000         // benchAlloc: disks filled per thread count
+#define LOOKUPROUNDS 200000       // benchLookup: lookups per thread
+#define MDROUNDS     2000         // benchMdtest: Directories filled
+#define METABLOCKS   20           // benchMeta: blocks in the file cloned
+#define METAROUNDS   2000         // benchMeta: clones per mode
+#define NAMEROUNDS   1000000      // benchName: calls per case
+#define READBLOCKS   60           // benchRead: blocks in the file read
+#define READROUNDS   2000         // benchRead: whole-file reads per thread
+#define WRITEBLOCKS  16           // benchWrite: blocks in the file written
+#define WRITEROUNDS  20000        // benchWrite: block writes per case
+
+typedef struct {          // BenchArg: one benchmark thread's job
+  i32 vol;                // volume handle to work on
+  i32 fd;                 // file to work on, if any
+  i32 rounds;             // # rounds to run
+  i64 count;              // once done: # blocks (or ops) it got through
+} BenchArg;
+
+void   benchAlloc();
+void*  benchAllocWorker(void* arg);
+void   benchLookup();
+void*  benchLookupWorker(void* arg);
+void   benchMdtest();
+void   benchMeta();
+void   benchName();
+i32    benchNameEqScalar(char* a, char* b, i32 len);
+i32    benchNameSlotScalar(DirSnap* dir);
+double benchNow();
+void   benchRead();
+void*  benchReadWorker(void* arg);
+void   benchWrite();
+void   p5bench();
+
+#endif
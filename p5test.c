@@ -23,7 +23,7 @@ void check(int testnum, i8* buf, int start, int size, int val) {
 
 
 // ============================================================================
-// Check that 'actual' == 'expected' for test 'testnum'
+// Check that cursor 'actual' == 'expected' for test 'testnum'
 // ============================================================================
 void checkCursor(int testnum, int expected, int actual) {
   if (actual == expected) {
@@ -36,6 +36,21 @@ void checkCursor(int testnum, int expected, int actual) {
 
 
 
+// ============================================================================
+// Check that 'actual' == 'expected' for test 'testnum': a size, a count, or
+// a return code, anything but a cursor
+// ============================================================================
+void checkValue(int testnum, int expected, int actual) {
+  if (actual == expected) {
+    printf("TEST %d : GOOD \n", testnum);
+  } else {
+    printf("TEST %d : BAD  : value = %d but should be %d \n", 
+        testnum, actual, expected);
+  }
+}
+
+
+
 // ============================================================================
 // Create file "P5", holding 50 blocks, inside of BFSDISK, and populate
 // ============================================================================
@@ -236,6 +251,966 @@ void test6(i32 fd) {
 
 
 
+// ============================================================================
+// TEST 7 : on a fresh volume, create a file whose name is FNAMEMAX bytes,
+//           the longest a packed DirEnt holds, and write 1 block, all 26.
+//           After a remount, it opens by that name and reads back whole;
+//           fsReadDirPlusAt returns the name in full; and the same name
+//           with one more byte is not found
+// ============================================================================
+void test7() {
+  i8   buf[BYTESPERBLOCK];
+  char name[FNAMEMAX + 2];
+
+  memset(name, 'N', FNAMEMAX + 1);
+  name[FNAMEMAX] = 0;
+
+  i32 vol = fsFormatAt("BFSDISK2");
+  i32 f2  = fsCreateAt(vol, name);
+  memset(buf, 26, BYTESPERBLOCK);
+  fsWrite(f2, BYTESPERBLOCK, buf);
+  fsClose(f2);
+  checkValue(7, 0, fsUnmount(vol));
+
+  vol = fsMountAt("BFSDISK2");
+  f2  = fsOpenAt(vol, name, 0);
+  memset(buf, 0, BYTESPERBLOCK);
+  fsPread(f2, BYTESPERBLOCK, buf, 0);
+  check(7, buf, 0, BYTESPERBLOCK, 26);
+
+  DirPlus ent;
+  checkValue(7, 1, fsReadDirPlusAt(vol, 1, &ent));
+  checkValue(7, 0, strcmp(ent.name, name));
+
+  name[FNAMEMAX] = 'N';
+  name[FNAMEMAX + 1] = 0;
+  checkValue(7, EFNF, fsOpenAt(vol, name, 0));
+
+  fsClose(f2);
+  checkValue(7, 0, fsUnmount(vol));
+  remove("BFSDISK2");
+}
+
+
+
+// ============================================================================
+// TEST 8 : Second fsOpen of P5 gets its own descriptor and cursor
+//          fd2 reads 100*0 from the start, while fd stays at 30 into block 3
+// ============================================================================
+void test8(i32 fd) {
+  i8 buf[BUFSIZE];                  // buffer for reads and writes
+
+  fsSeek(fd, 3 * BYTESPERBLOCK + 30, SEEK_SET);
+
+  i32 fd2 = fsOpen("P5");
+  assert(fd2 != fd);
+
+  checkCursor(8, 0, fsTell(fd2));
+
+  memset(buf, 1, BUFSIZE);
+  i32 ret = fsRead(fd2, 100, buf);
+  assert(ret == 100);
+
+  checkCursor(8, 100, fsTell(fd2));
+  checkCursor(8, 3 * 512 + 30, fsTell(fd));
+
+  fsClose(fd2);
+
+  ret = fsRead(fd, 100, buf);
+  assert(ret == 100);
+
+  check(8, buf, 0, 100, 3);
+}
+
+
+
+// ============================================================================
+// TEST 9 : fsPwrite (50 bytes) at 100 bytes into block 15, then fsPread of
+//          block 15; the cursor, left at block 2, never moves
+//          100*15, 50*55, 362*15
+// ============================================================================
+void test9(i32 fd) {
+  i8 buf[BUFSIZE];                  // buffer for reads and writes
+
+  fsSeek(fd, 2 * BYTESPERBLOCK, SEEK_SET);
+
+  memset(buf, 55, 50);
+  fsPwrite(fd, 50, buf, 15 * BYTESPERBLOCK + 100);
+
+  checkCursor(9, 2 * 512, fsTell(fd));
+
+  memset(buf, 0, BUFSIZE);
+  i32 ret = fsPread(fd, BYTESPERBLOCK, buf, 15 * BYTESPERBLOCK);
+  assert(ret == BYTESPERBLOCK);
+
+  checkCursor(9, 2 * 512, fsTell(fd));
+
+  check(9, buf, 0,   100, 15);
+  check(9, buf, 100,  50, 55);
+  check(9, buf, 150, 362, 15);
+}
+
+
+
+// ============================================================================
+// TEST 10 : fsWritev of a 10-byte header and 20-byte payload, straddling the
+//          end of block 16, then fsReadv back into two buffers
+//          10*66, 20*67
+// ============================================================================
+void test10(i32 fd) {
+  i8 hdr[10];
+  i8 body[20];
+  memset(hdr,  66, sizeof(hdr));
+  memset(body, 67, sizeof(body));
+
+  IoVec out[2] = { { hdr, sizeof(hdr) }, { body, sizeof(body) } };
+
+  fsSeek(fd, 17 * BYTESPERBLOCK - 15, SEEK_SET);
+  fsWritev(fd, 2, out);
+
+  checkCursor(10, 17 * 512 + 15, fsTell(fd));
+
+  memset(hdr,  0, sizeof(hdr));
+  memset(body, 0, sizeof(body));
+
+  fsSeek(fd, 17 * BYTESPERBLOCK - 15, SEEK_SET);
+  i32 ret = fsReadv(fd, 2, out);
+  assert(ret == 30);
+
+  check(10, hdr,  0, 10, 66);
+  check(10, body, 0, 20, 67);
+}
+
+
+
+// ============================================================================
+// TEST 11 : Append 20 bytes whose last 10 are zero, then read 100 bytes from
+//           the old EOF.  EOF comes from the Inode size, so the trailing
+//           zeroes count as data
+//           10*5, 10*0
+// ============================================================================
+void test11(i32 fd) {
+  i8 buf[BUFSIZE];                  // buffer for reads and writes
+
+  i32 end = fsSize(fd);
+  fsSeek(fd, 0, SEEK_END);
+
+  memset(buf, 0, BUFSIZE);
+  memset(buf, 5, 10);
+  fsWrite(fd, 20, buf);
+
+  checkValue(11, end + 20, fsSize(fd));
+
+  memset(buf, 1, BUFSIZE);
+  i32 ret = fsPread(fd, 100, buf, end);
+  assert(ret == 20);
+
+  check(11, buf, 0,  10, 5);
+  check(11, buf, 10, 10, 0);
+}
+
+
+
+// ============================================================================
+// TEST 12 : Submit a write (60 bytes at 40 into block 22) and, behind it,
+//           reads of all of block 22 and of 30 bytes spanning blocks 23/24;
+//           then reap all three
+//           40*22, 60*44, 412*22 ; 15*23, 15*24
+// ============================================================================
+void test12(i32 fd) {
+  i8 wbuf[60];
+  i8 buf[BUFSIZE];                  // buffer for reads and writes
+  i8 span[30];
+
+  memset(wbuf, 44, sizeof(wbuf));
+  memset(buf,   0, BUFSIZE);
+  memset(span,  0, sizeof(span));
+
+  FsOp ops[3] = {
+    { FSOPWRITE, fd, 22 * BYTESPERBLOCK + 40, 60, wbuf, NULL, 0, NULL },
+    { FSOPREAD,  fd, 22 * BYTESPERBLOCK, BYTESPERBLOCK, buf, NULL, 0, NULL },
+    { FSOPREAD,  fd, 24 * BYTESPERBLOCK - 15, 30, span, NULL, 0, NULL },
+  };
+
+  fsSubmit(3, ops);
+
+  FsOp* done[3];
+  i32 n = fsReap(3, done);
+  assert(n == 3);
+  assert(ops[1].res == BYTESPERBLOCK);
+  assert(ops[2].res == 30);
+
+  check(12, buf, 0,    40, 22);
+  check(12, buf, 40,   60, 44);
+  check(12, buf, 100, 412, 22);
+  check(12, span, 0,   15, 23);
+  check(12, span, 15,  15, 24);
+}
+
+
+
+// ============================================================================
+// TEST 13 : with "P5" locked exclusive, fsSubmit a read of block 33 and
+//           return at once: the aio worker waits for the file.  Once it is
+//           unlocked, the read runs without an fsReap to drive it, and
+//           fsReap just hands it back, whole
+//           512*33
+// ============================================================================
+void test13(i32 fd) {
+  i8 buf[BYTESPERBLOCK];
+  memset(buf, 0, BYTESPERBLOCK);
+
+  Incore* ic = bfsFindOFTE(fd)->ic;
+  bfsLockInode(ic, 1);
+  FsOp rd = { FSOPREAD, fd, 33 * BYTESPERBLOCK, BYTESPERBLOCK, buf,
+              NULL, 0, NULL };
+  fsSubmit(1, &rd);
+  usleep(20000);
+  assert(rd.res == 0);              // not yet run
+  bfsUnlockInode(ic);
+
+  i32 waited = 0;
+  while (__atomic_load_n(&rd.res, __ATOMIC_ACQUIRE) == 0 && waited++ < 1000) {
+    usleep(1000);
+  }
+  assert(rd.res == BYTESPERBLOCK);  // run by the worker alone
+
+  FsOp* done[1];
+  i32 n = fsReap(1, done);
+  assert(n == 1 && done[0] == &rd);
+  check(13, buf, 0, BYTESPERBLOCK, 33);
+}
+
+
+
+// ============================================================================
+// TEST 14 : A two-step chain on fsRun: reading block 30 completes, and its
+//           callback submits a write of those bytes over block 31
+//           512*30
+// ============================================================================
+static i8   g_t14buf[BYTESPERBLOCK];
+static FsOp g_t14write;
+
+void test14Done(FsOp* op) {         // read finished: copy it onward
+  g_t14write.op     = FSOPWRITE;
+  g_t14write.fd     = op->fd;
+  g_t14write.offset = 31 * BYTESPERBLOCK;
+  g_t14write.numb   = op->res;
+  g_t14write.buf    = op->buf;
+  g_t14write.done   = NULL;
+  fsSubmit(1, &g_t14write);
+}
+
+void test14(i32 fd) {
+  i8 buf[BUFSIZE];                  // buffer for reads and writes
+
+  FsOp rd = { FSOPREAD, fd, 30 * BYTESPERBLOCK, BYTESPERBLOCK, g_t14buf,
+              NULL, 0, test14Done };
+  fsSubmit(1, &rd);
+
+  i32 n = fsRun();
+  assert(n == 2);
+
+  memset(buf, 0, BUFSIZE);
+  i32 ret = fsPread(fd, BYTESPERBLOCK, buf, 31 * BYTESPERBLOCK);
+  assert(ret == BYTESPERBLOCK);
+
+  check(14, buf, 0, 512, 30);
+}
+
+
+
+// ============================================================================
+// TEST 15 : fsClone P5 into new file "P5C", then overwrite 100 bytes at 10
+//           into block 40 of the clone.  The clone sees its write; P5, which
+//           shared the block, does not
+//           P5: 512*40 ; P5C: 10*40, 100*33, 402*40
+// ============================================================================
+void test15(i32 fd) {
+  i8 buf[BUFSIZE];                  // buffer for reads and writes
+
+  i32 fdc = fsCreate("P5C");
+  i32 ret = fsClone(fd, fdc);
+  assert(ret == fsSize(fd));
+  checkValue(15, fsSize(fd), fsSize(fdc));
+
+  memset(buf, 33, 100);
+  fsPwrite(fdc, 100, buf, 40 * BYTESPERBLOCK + 10);
+
+  memset(buf, 0, BUFSIZE);
+  fsPread(fd, BYTESPERBLOCK, buf, 40 * BYTESPERBLOCK);
+  check(15, buf, 0, 512, 40);
+
+  memset(buf, 0, BUFSIZE);
+  fsPread(fdc, BYTESPERBLOCK, buf, 40 * BYTESPERBLOCK);
+  check(15, buf, 0,    10, 40);
+  check(15, buf, 10,  100, 33);
+  check(15, buf, 110, 402, 40);
+
+  fsClose(fdc);
+}
+
+
+
+// ============================================================================
+// TEST 16 : fsMap 700 bytes from 100 into block 25, writable.  Check what it
+//           shows, store 20 bytes at 500 into block 25, fsUnmap, and read
+//           block 26 back with fsPread
+//           mapped: 412*25, 288*26 ; block 26: 8*9, 504*26
+// ============================================================================
+void test16(i32 fd) {
+  i8 buf[BUFSIZE];                  // buffer for reads and writes
+
+  i8* p = fsMap(fd, 25 * BYTESPERBLOCK + 100, 700, FSMAPREAD | FSMAPWRITE);
+  assert(p != NULL);
+
+  check(16, p, 0,   412, 25);
+  check(16, p, 412, 288, 26);
+
+  memset(p + 400, 9, 20);
+  fsUnmap(p);
+
+  memset(buf, 0, BUFSIZE);
+  fsPread(fd, BYTESPERBLOCK, buf, 26 * BYTESPERBLOCK);
+  check(16, buf, 0,   8,   9);
+  check(16, buf, 8, 504,  26);
+}
+
+
+
+// ============================================================================
+// TEST 17 : fsReadDirPlus lists P5 and its clone P5C (from TEST 15), with
+//           sizes matching fsSize, and blocks still shared between them
+// ============================================================================
+void test17(i32 fd) {
+  DirPlus ents[NUMINODES];
+
+  i32 n = fsReadDirPlus(NUMINODES, ents);
+  assert(n == 2);
+
+  assert(strcmp(ents[0].name, "P5")  == 0);
+  assert(strcmp(ents[1].name, "P5C") == 0);
+  checkValue(17, fsSize(fd), ents[0].size);
+  checkValue(17, ents[0].size, ents[1].size);
+
+  if (ents[1].numShared > 0 && ents[1].numShared < ents[1].numBlocks) {
+    printf("TEST 17 : GOOD \n");
+  } else {
+    printf("TEST 17 : BAD  : P5C shares %d of %d blocks \n",
+      ents[1].numShared, ents[1].numBlocks);
+  }
+}
+
+
+
+// ============================================================================
+// TEST 18 : open P5 twice with FSAPPEND and interleave fsWrites of 100*61,
+//           700*62 and 30*63.  Each lands at EOF, whichever fd wrote the
+//           last one.  Read them back through 'fd'
+// ============================================================================
+void test18(i32 fd) {
+  i8 buf[BUFSIZE];                  // buffer for reads and writes
+
+  i32 size = fsSize(fd);
+  i32 fa = fsOpenFlags("P5", FSAPPEND);
+  i32 fb = fsOpenFlags("P5", FSAPPEND);
+
+  memset(buf, 61, 100);
+  fsWrite(fa, 100, buf);
+  memset(buf, 62, 700);
+  fsWrite(fb, 700, buf);
+  memset(buf, 63, 30);
+  fsWrite(fa, 30, buf);
+
+  checkCursor(18, size + 830, fsTell(fa));
+  checkValue(18, size + 830, fsSize(fd));
+
+  memset(buf, 0, BUFSIZE);
+  fsPread(fd, 830, buf, size);
+  check(18, buf, 0,   100, 61);
+  check(18, buf, 100, 700, 62);
+  check(18, buf, 800,  30, 63);
+
+  fsClose(fa);
+  fsClose(fb);
+}
+
+
+
+// ============================================================================
+// TEST 19 : on a fresh volume, fill "J" with 40 blocks of 30, then recreate
+//           it, so free blocks hold stale bytes.  Open "G" with FSAPPEND and
+//           append 100*30, which preallocates blocks 1-3.  fsPwrite block 3
+//           with 512*31.  Blocks 1 and 2, never written, read back as zeros,
+//           by fsPread and by an async read
+//           100*30, 924*0, 512*31
+// ============================================================================
+void test19() {
+  i8 buf[4 * BYTESPERBLOCK];
+
+  i32 vol = fsFormatAt("BFSDISK2");
+  i32 fj  = fsCreateAt(vol, "J");
+  memset(buf, 30, BYTESPERBLOCK);
+  for (i32 i = 0; i < 40; ++i) fsWrite(fj, BYTESPERBLOCK, buf);
+  fsClose(fj);
+  fsClose(fsCreateAt(vol, "J"));
+
+  fsClose(fsCreateAt(vol, "G"));
+  i32 fd = fsOpenAt(vol, "G", FSAPPEND);
+
+  fsAppend(fd, 100, buf);
+  memset(buf, 31, BYTESPERBLOCK);
+  fsPwrite(fd, BYTESPERBLOCK, buf, 3 * BYTESPERBLOCK);
+  checkValue(19, 4 * BYTESPERBLOCK, fsSize(fd));
+
+  memset(buf, 1, sizeof(buf));
+  fsPread(fd, sizeof(buf), buf, 0);
+  check(19, buf, 0,                 100,                   30);
+  check(19, buf, 100,               3 * BYTESPERBLOCK - 100, 0);
+  check(19, buf, 3 * BYTESPERBLOCK, BYTESPERBLOCK,         31);
+
+  memset(buf, 1, sizeof(buf));
+  FsOp rd = { FSOPREAD, fd, BYTESPERBLOCK, 2 * BYTESPERBLOCK, buf,
+              NULL, 0, NULL };
+  FsOp* done[1];
+  fsSubmit(1, &rd);
+  fsReap(1, done);
+  checkValue(19, 2 * BYTESPERBLOCK, rd.res);
+  check(19, buf, 0, 2 * BYTESPERBLOCK, 0);
+
+  fsClose(fd);
+  checkValue(19, 0, fsUnmount(vol));
+  remove("BFSDISK2");
+}
+
+
+
+// ============================================================================
+// TEST 20 : fsBatch creates B1 and B2, writes 600*71 and 100*72 into them,
+//           and closes both.  Reopen and read them back.  'fd' plays no part
+// ============================================================================
+void test20(i32 fd) {
+  i8 buf[BUFSIZE];                  // buffer for reads and writes
+  i8 b1[600], b2[100];
+
+  (void)fd;
+  memset(b1, 71, sizeof(b1));
+  memset(b2, 72, sizeof(b2));
+
+  FsBatchOp ops[] = {
+    { FSBCREATE, "B1", 0,        0,          NULL, 0 },
+    { FSBWRITE,  NULL, FSBLAST,  sizeof(b1), b1,   0 },
+    { FSBCLOSE,  NULL, FSBLAST,  0,          NULL, 0 },
+    { FSBCREATE, "B2", 0,        0,          NULL, 0 },
+    { FSBWRITE,  NULL, FSBLAST,  sizeof(b2), b2,   0 },
+    { FSBCLOSE,  NULL, FSBLAST,  0,          NULL, 0 },
+  };
+  fsBatch(6, ops);
+
+  i32 f1 = fsOpen("B1");
+  i32 f2 = fsOpen("B2");
+  assert(f1 > 0 && f2 > 0);
+  checkValue(20, 600, fsSize(f1));
+  checkValue(20, 100, fsSize(f2));
+
+  memset(buf, 0, BUFSIZE);
+  fsRead(f1, BUFSIZE, buf);
+  check(20, buf, 0, 600, 71);
+  fsRead(f2, BUFSIZE, buf);
+  check(20, buf, 0, 100, 72);
+
+  fsClose(f1);
+  fsClose(f2);
+}
+
+
+
+// ============================================================================
+// Writer thread for TEST 21: fill 4 blocks of the file open on fd 'arg' with
+// the value fd + 70, one fsWrite per block
+// ============================================================================
+void* test21Writer(void* arg) {
+  i32 fd = (i32)(intptr_t)arg;
+  i8 blk[BYTESPERBLOCK];
+  memset(blk, fd + 70, BYTESPERBLOCK);
+  for (i32 b = 0; b < 4; ++b) fsWrite(fd, BYTESPERBLOCK, blk);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// TEST 21 : two threads write T1 and T2 at the same time, while this thread
+//           reads P5.  Each file ends up with just its own writer's data
+// ============================================================================
+void test21(i32 fd) {
+  i8 buf[BUFSIZE];                  // buffer for reads and writes
+
+  i32 f1 = fsCreate("T1");
+  i32 f2 = fsCreate("T2");
+
+  pthread_t t1, t2;
+  pthread_create(&t1, NULL, test21Writer, (void*)(intptr_t)f1);
+  pthread_create(&t2, NULL, test21Writer, (void*)(intptr_t)f2);
+  for (i32 i = 0; i < 20; ++i) fsPread(fd, BYTESPERBLOCK, buf, 0);
+  pthread_join(t1, NULL);
+  pthread_join(t2, NULL);
+
+  checkValue(21, 4 * BYTESPERBLOCK, fsSize(f1));
+  checkValue(21, 4 * BYTESPERBLOCK, fsSize(f2));
+
+  fsPread(f1, BUFSIZE, buf, 0);
+  check(21, buf, 0, BUFSIZE, f1 + 70);
+  fsPread(f2, BUFSIZE, buf, 0);
+  check(21, buf, 0, BUFSIZE, f2 + 70);
+
+  fsClose(f1);
+  fsClose(f2);
+}
+
+
+
+// ============================================================================
+// Count the blocks marked free in the SuperBlock's free bitmap
+// ============================================================================
+i32 countFree() {
+  Super* super = bfsLoadSuper();
+  i32 n = 0;
+  for (i32 dbn = 0; dbn < BLOCKSPERDISK; ++dbn) {
+    if (super->freeMap[dbn / 8] & (1 << (dbn % 8))) ++n;
+  }
+  return n;
+}
+
+
+
+// ============================================================================
+// Writer thread for TEST 22: append 8 blocks with the value fd + 70 to the
+// file open on fd 'arg', one fsWrite per block
+// ============================================================================
+void* test22Writer(void* arg) {
+  i32 fd = (i32)(intptr_t)arg;
+  i8 blk[BYTESPERBLOCK];
+  memset(blk, fd + 70, BYTESPERBLOCK);
+  for (i32 b = 0; b < 8; ++b) fsWrite(fd, BYTESPERBLOCK, blk);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// TEST 22 : two threads allocate at once, appending 8 blocks each to T1 and
+//           T2 (4 blocks, from TEST 21).  No DBN goes to both: each file
+//           reads back its own data.  Once the threads exit and the files
+//           close, exactly 16 blocks plus 2 indirect blocks are gone from
+//           the free bitmap
+// ============================================================================
+void test22(i32 fd) {
+  i8 buf[BUFSIZE];                  // buffer for reads and writes
+
+  (void)fd;
+  i32 numFree = countFree();
+
+  i32 f1 = fsOpenFlags("T1", FSAPPEND);
+  i32 f2 = fsOpenFlags("T2", FSAPPEND);
+
+  pthread_t t1, t2;
+  pthread_create(&t1, NULL, test22Writer, (void*)(intptr_t)f1);
+  pthread_create(&t2, NULL, test22Writer, (void*)(intptr_t)f2);
+  pthread_join(t1, NULL);
+  pthread_join(t2, NULL);
+
+  checkValue(22, 12 * BYTESPERBLOCK, fsSize(f1));
+  checkValue(22, 12 * BYTESPERBLOCK, fsSize(f2));
+
+  fsPread(f1, BUFSIZE, buf, 8 * BYTESPERBLOCK);
+  check(22, buf, 0, BUFSIZE, f1 + 70);
+  fsPread(f2, BUFSIZE, buf, 8 * BYTESPERBLOCK);
+  check(22, buf, 0, BUFSIZE, f2 + 70);
+
+  fsClose(f1);
+  fsClose(f2);
+  checkValue(22, numFree - 18, countFree());
+}
+
+
+
+// ============================================================================
+// TEST 23 : one fsPread of 12 blocks, starting mid-block, is big enough to be
+//           split over the worker pool.  It matches the same bytes read one
+//           block at a time
+// ============================================================================
+void test23(i32 fd) {
+  static i8 big[12 * BYTESPERBLOCK];
+  i8 buf[BYTESPERBLOCK];
+
+  i32 offset = 30 * BYTESPERBLOCK + 100;
+  i32 numb   = fsPread(fd, sizeof(big), big, offset);
+  checkValue(23, sizeof(big), numb);
+
+  i32 bad = 0;
+  for (i32 b = 0; b < 12; ++b) {
+    fsPread(fd, BYTESPERBLOCK, buf, offset + b * BYTESPERBLOCK);
+    if (memcmp(buf, &big[b * BYTESPERBLOCK], BYTESPERBLOCK) != 0) ++bad;
+  }
+  checkValue(23, 0, bad);
+}
+
+
+
+// ============================================================================
+// TEST 24 : a second volume, formatted into BFSDISK2, holds its own "P5"
+//           beside BFSDISK's.  Its fds share one numbering with P5's.  A
+//           clone across volumes copies; writes to one volume leave the
+//           other alone; and the data is still there after an unmount and
+//           mount
+// ============================================================================
+void test24(i32 fd) {
+  i8 buf[BUFSIZE];                  // buffer for reads and writes
+  i8 before[BYTESPERBLOCK];         // P5's block 0, before the test
+
+  fsPread(fd, BYTESPERBLOCK, before, 0);
+
+  i32 vol = fsFormatAt("BFSDISK2");
+  i32 f2  = fsCreateAt(vol, "P5");
+  assert(f2 != fd);
+
+  memset(buf, 77, BUFSIZE);
+  fsWrite(f2, BUFSIZE, buf);
+  fsCopyFileRange(fd, 0, f2, 2048, BYTESPERBLOCK, FSCLONE);
+  checkValue(24, 2048 + BYTESPERBLOCK, fsSize(f2));
+
+  DirPlus ents[NUMINODES];
+  checkValue(24, 1, fsReadDirPlusAt(vol, NUMINODES, ents));
+  checkValue(24, 0, ents[0].numShared);
+
+  checkValue(24, EVOLBUSY, fsUnmount(vol));
+  fsClose(f2);
+  checkValue(24, 0, fsUnmount(vol));
+
+  vol = fsMountAt("BFSDISK2");
+  f2  = fsOpenAt(vol, "P5", 0);
+  fsPread(f2, BUFSIZE, buf, 0);
+  check(24, buf, 0, BUFSIZE, 77);
+  fsPread(f2, BYTESPERBLOCK, buf, 2048);
+  checkValue(24, 0, memcmp(buf, before, BYTESPERBLOCK));
+  fsClose(f2);
+  fsUnmount(vol);
+  remove("BFSDISK2");
+
+  fsPread(fd, BYTESPERBLOCK, buf, 0);
+  checkValue(24, 0, memcmp(buf, before, BYTESPERBLOCK));
+}
+
+
+
+// ============================================================================
+// TEST 25 : on a fresh volume, write 70 blocks, more than the write-back
+//           cache holds dirty, block 'b' all 'b'.  They read back at once;
+//           and after fsUnmount, the disk image itself holds them
+// ============================================================================
+void test25() {
+  i8 buf[BYTESPERBLOCK];
+  i32 numb = 70;
+
+  i32 vol = fsFormatAt("BFSDISK2");
+  i32 f2  = fsCreateAt(vol, "W");
+  for (i32 b = 0; b < numb; ++b) {
+    memset(buf, b, BYTESPERBLOCK);
+    fsWrite(f2, BYTESPERBLOCK, buf);
+  }
+
+  fsPread(f2, BYTESPERBLOCK, buf, 3 * BYTESPERBLOCK);
+  check(25, buf, 0, BYTESPERBLOCK, 3);
+
+  DirPlus ent;
+  fsReadDirPlusAt(vol, 1, &ent);
+  fsClose(f2);
+  checkValue(25, 0, fsUnmount(vol));
+
+  FILE* fp = fopen("BFSDISK2", "rb");
+  for (i32 b = 0; b < NUMDIRECT; ++b) {
+    fseek(fp, ent.inode.direct[b] * BYTESPERBLOCK, SEEK_SET);
+    if (fread(buf, 1, BYTESPERBLOCK, fp) != BYTESPERBLOCK) buf[0] = -1;
+    check(25, buf, 0, BYTESPERBLOCK, b);
+  }
+  fclose(fp);
+  remove("BFSDISK2");
+}
+
+
+
+// ============================================================================
+// TEST 26 : on a fresh volume, write 4 blocks of 29 to "M" and fsMap them,
+//           read-only: the disk image itself.  With the flushers paused,
+//           an fsPwrite of block 1, and one of 20 bytes into block 2, show
+//           through the mapping at once
+//           block 0: 512*29 ; 1: 512*30 ; 2: 100*29, 20*31, 392*29
+// ============================================================================
+void test26() {
+  i8 buf[4 * BYTESPERBLOCK];
+
+  i32 vol = fsFormatAt("BFSDISK2");
+  i32 fd  = fsCreateAt(vol, "M");
+  memset(buf, 29, sizeof(buf));
+  fsWrite(fd, sizeof(buf), buf);
+
+  i8* p = fsMap(fd, 0, sizeof(buf), FSMAPREAD);
+  assert(p != NULL && mapFind(p)->direct);
+
+  flushPause(1);                    // only the writer can write them
+  memset(buf, 30, BYTESPERBLOCK);
+  fsPwrite(fd, BYTESPERBLOCK, buf, BYTESPERBLOCK);
+  memset(buf, 31, 20);
+  fsPwrite(fd, 20, buf, 2 * BYTESPERBLOCK + 100);
+
+  check(26, p, 0,                         BYTESPERBLOCK, 29);
+  check(26, p, BYTESPERBLOCK,             BYTESPERBLOCK, 30);
+  check(26, p, 2 * BYTESPERBLOCK,         100,           29);
+  check(26, p, 2 * BYTESPERBLOCK + 100,   20,            31);
+  check(26, p, 2 * BYTESPERBLOCK + 120,   392,           29);
+  flushPause(0);
+
+  fsUnmap(p);
+  fsClose(fd);
+  checkValue(26, 0, fsUnmount(vol));
+  remove("BFSDISK2");
+}
+
+
+
+// ============================================================================
+// Reader thread for TEST 27: 100 times, look up P5 by name, check its size
+// is the 'arg' bytes it had before the test, and close it.  Return the
+// number of mismatches
+// ============================================================================
+void* test27Reader(void* arg) {
+  i32 size = (i32)(intptr_t)arg;
+  i32 bad  = 0;
+  for (i32 i = 0; i < 100; ++i) {
+    i32 fd = fsOpen("P5");
+    if (fsSize(fd) != size) ++bad;
+    fsClose(fd);
+  }
+  return (void*)(intptr_t)bad;
+}
+
+
+
+// ============================================================================
+// TEST 27 : two threads look up P5 and read its size, without locks, while
+//           this thread appends 10 x 100 bytes to T1, publishing a new Inode
+//           snapshot each time.  Readers always see P5 whole; T1 ends 1000
+//           bytes longer
+// ============================================================================
+void test27(i32 fd) {
+  i32 size = fsSize(fd);
+  i32 f1   = fsOpenFlags("T1", FSAPPEND);
+  i32 end  = fsSize(f1) + 1000;
+
+  i8 buf[100];
+  memset(buf, 23, sizeof(buf));
+
+  pthread_t t1, t2;
+  pthread_create(&t1, NULL, test27Reader, (void*)(intptr_t)size);
+  pthread_create(&t2, NULL, test27Reader, (void*)(intptr_t)size);
+  for (i32 i = 0; i < 10; ++i) fsWrite(f1, sizeof(buf), buf);
+
+  void* bad1;
+  void* bad2;
+  pthread_join(t1, &bad1);
+  pthread_join(t2, &bad2);
+
+  checkValue(27, 0, (i32)(intptr_t)bad1 + (i32)(intptr_t)bad2);
+  checkValue(27, end, fsSize(f1));
+  fsClose(f1);
+}
+
+
+
+// ============================================================================
+// Copy the disk image in file 'from' to file 'to', as it stands
+// ============================================================================
+void copyDisk(str from, str to) {
+  i8    buf[BYTESPERBLOCK];
+  FILE* in  = fopen(from, "rb");
+  FILE* out = fopen(to,   "wb");
+  i32 n;
+  while ((n = fread(buf, 1, BYTESPERBLOCK, in)) > 0) fwrite(buf, 1, n, out);
+  fclose(in);
+  fclose(out);
+}
+
+
+
+// ============================================================================
+// Commit the metadata of every mounted volume, and flush their disks
+// ============================================================================
+void syncDisks() {
+  FsOp sync = { FSOPSYNC, 0, 0, 0, NULL, NULL, 0, NULL };
+  fsSubmit(1, &sync);
+  fsRun();
+}
+
+
+
+// ============================================================================
+// TEST 28 : on a fresh volume, write 3 blocks to "J", block 'b' all 'b'+24,
+//           and sync, with the committer paused.  A copy of the disk image,
+//           taken then, stands for a crash before the journal wrote its
+//           metadata home: its Dir and Inodes blocks do not yet hold "J".
+//           Mounting the copy replays the journal: "J" is whole
+// ============================================================================
+void test28() {
+  i8  buf[BYTESPERBLOCK];
+  i32 numb = 3;
+
+  jnlPause(1);                              // nothing written home unasked
+  i32 vol = fsFormatAt("BFSDISK2");
+  i32 f2  = fsCreateAt(vol, "J");
+  for (i32 b = 0; b < numb; ++b) {
+    memset(buf, b + 24, BYTESPERBLOCK);
+    fsWrite(f2, BYTESPERBLOCK, buf);
+  }
+  fsClose(f2);
+
+  syncDisks();                              // logged; home at the next
+  copyDisk("BFSDISK2", "BFSDISK3");
+  jnlPause(0);
+  checkValue(28, 0, fsUnmount(vol));
+
+  FILE* fp = fopen("BFSDISK3", "rb");
+  fseek(fp, DBNDIR * BYTESPERBLOCK, SEEK_SET);
+  if (fread(buf, 1, BYTESPERBLOCK, fp) != BYTESPERBLOCK) buf[0] = 'J';
+  checkValue(28, 0, memchr(buf, 'J', BYTESPERBLOCK) != NULL);
+  fseek(fp, DBNINODES * BYTESPERBLOCK, SEEK_SET);
+  if (fread(buf, 1, BYTESPERBLOCK, fp) != BYTESPERBLOCK) buf[0] = 1;
+  checkValue(28, 0, ((Inode*)buf)->size);
+  fclose(fp);
+
+  i32 vol3 = fsMountAt("BFSDISK3");
+  i32 f3   = fsOpenAt(vol3, "J", 0);
+  checkValue(28, numb * BYTESPERBLOCK, fsSize(f3));
+  for (i32 b = 0; b < numb; ++b) {
+    fsPread(f3, BYTESPERBLOCK, buf, b * BYTESPERBLOCK);
+    check(28, buf, 0, BYTESPERBLOCK, b + 24);
+  }
+  fsClose(f3);
+  checkValue(28, 0, fsUnmount(vol3));
+  remove("BFSDISK2");
+  remove("BFSDISK3");
+}
+
+
+
+// ============================================================================
+// TEST 29 : on a fresh volume, fill "A" and "B" with 30 blocks each, 'b'+27
+//           and 'b'+57, leaving 11 blocks free.  Cloning "A" over "B" frees
+//           B's blocks, reusable only once that commits.  Writing 20 blocks
+//           to "C" then needs them: jnlBegin commits first, and every file
+//           reads back whole
+// ============================================================================
+void test29() {
+  static i8 buf[30 * BYTESPERBLOCK];
+  i32 numb = 30;
+  i32 more = 20;
+
+  i32 vol = fsFormatAt("BFSDISK2");
+  i32 fa  = fsCreateAt(vol, "A");
+  i32 fb  = fsCreateAt(vol, "B");
+  for (i32 f = 0; f < 2; ++f) {
+    for (i32 b = 0; b < numb; ++b) {
+      memset(buf + b * BYTESPERBLOCK, b + 27 + f * numb, BYTESPERBLOCK);
+    }
+    fsWrite(f == 0 ? fa : fb, numb * BYTESPERBLOCK, buf);
+  }
+  syncDisks();
+
+  checkValue(29, numb * BYTESPERBLOCK, fsClone(fa, fb));
+  i32 fc = fsCreateAt(vol, "C");
+  memset(buf, 27, more * BYTESPERBLOCK);
+  fsWrite(fc, more * BYTESPERBLOCK, buf);
+
+  for (i32 b = 0; b < numb; ++b) {
+    fsPread(fb, BYTESPERBLOCK, buf, b * BYTESPERBLOCK);
+    check(29, buf, 0, BYTESPERBLOCK, b + 27);
+  }
+  fsPread(fc, more * BYTESPERBLOCK, buf, 0);
+  check(29, buf, 0, more * BYTESPERBLOCK, 27);
+
+  fsClose(fa);
+  fsClose(fb);
+  fsClose(fc);
+  checkValue(29, 0, fsUnmount(vol));
+  remove("BFSDISK2");
+}
+
+
+
+// ============================================================================
+// TEST 30 : on a fresh copy-on-write volume, write 8 blocks to "C", block
+//           'b' all 'b'+25, and sync; then append 2 more, and sync again.
+//           Copies of the image stand for crashes after that sync, and
+//           during it, with the newer SuperBlock copy torn.  The first
+//           mounts with "C" at 10 blocks; the second falls back to the older
+//           copy, with "C" at 8 blocks, whole
+// ============================================================================
+void test30() {
+  i8  buf[8 * BYTESPERBLOCK];
+  i32 numb = 8;
+  i32 more = 2;
+
+  i32 vol = fsFormatCowAt("BFSDISK2");
+  i32 f2  = fsCreateAt(vol, "C");
+  for (i32 b = 0; b < numb; ++b) {
+    memset(buf + b * BYTESPERBLOCK, b + 25, BYTESPERBLOCK);
+  }
+  fsWrite(f2, numb * BYTESPERBLOCK, buf);
+  fsClose(f2);
+  syncDisks();
+
+  f2 = fsOpenAt(vol, "C", FSAPPEND);
+  for (i32 b = 0; b < more; ++b) {
+    memset(buf + b * BYTESPERBLOCK, numb + b + 25, BYTESPERBLOCK);
+  }
+  fsWrite(f2, more * BYTESPERBLOCK, buf);
+  syncDisks();
+  copyDisk("BFSDISK2", "BFSDISK3");
+  copyDisk("BFSDISK2", "BFSDISK4");
+  fsClose(f2);
+  checkValue(30, 0, fsUnmount(vol));
+
+  Super sb[2];                              // tear the newer copy
+  FILE* fp = fopen("BFSDISK4", "r+b");
+  for (i32 c = 0; c < 2; ++c) {
+    fseek(fp, c * BYTESPERBLOCK, SEEK_SET);
+    fread(&sb[c], sizeof(Super), 1, fp);
+  }
+  i32 newer = (sb[1].cowGen > sb[0].cowGen) ? 1 : 0;
+  sb[newer].freeMap[0] ^= 0xFF;
+  fseek(fp, newer * BYTESPERBLOCK, SEEK_SET);
+  fwrite(&sb[newer], sizeof(Super), 1, fp);
+  fclose(fp);
+
+  for (i32 d = 0; d < 2; ++d) {
+    i32 size = (d == 0) ? numb + more : numb;
+    i32 vol3 = fsMountAt(d == 0 ? "BFSDISK3" : "BFSDISK4");
+    i32 f3   = fsOpenAt(vol3, "C", 0);
+    checkValue(30, size * BYTESPERBLOCK, fsSize(f3));
+    for (i32 b = 0; b < size; ++b) {
+      fsPread(f3, BYTESPERBLOCK, buf, b * BYTESPERBLOCK);
+      check(30, buf, 0, BYTESPERBLOCK, b + 25);
+    }
+    fsClose(f3);
+    checkValue(30, 0, fsUnmount(vol3));
+  }
+  remove("BFSDISK2");
+  remove("BFSDISK3");
+  remove("BFSDISK4");
+}
+
+
+
 void p5test() {
 
   i32 fd = fsOpen("P5");    // open "P5" for testing
@@ -246,6 +1221,30 @@ void p5test() {
   test4(fd);
   test5(fd);
   test6(fd);
+  test7();
+  test8(fd);
+  test9(fd);
+  test10(fd);
+  test11(fd);
+  test12(fd);
+  test13(fd);
+  test14(fd);
+  test15(fd);
+  test16(fd);
+  test17(fd);
+  test18(fd);
+  test19();
+  test20(fd);
+  test21(fd);
+  test22(fd);
+  test23(fd);
+  test24(fd);
+  test25();
+  test26();
+  test27(fd);
+  test28();
+  test29();
+  test30();
 
   fsClose(fd);
 
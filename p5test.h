@@ -2,11 +2,17 @@
 #define P5TEST_H
 
 #include <assert.h>       // assert
-#include <stdio.h>        // fopen, printf, 
+#include <pthread.h>      // pthread_create, for TEST 21
+#include <stdint.h>       // intptr_t
+#include <stdio.h>        // fopen, printf, remove
 #include <string.h>       // memset
+#include <unistd.h>       // usleep, for TEST 13
 
 #include "alias.h"        // i32, etc
 #include "fs.h"           // fsOpen, etc
+#include "jnl.h"          // jnlPause, for TEST 28
+#include "flush.h"        // flushPause, for TEST 26
+#include "map.h"          // mapFind, for TEST 26
 
 #define BLOCKS        50
 #define BYTESPERBLOCK 512
@@ -14,11 +20,45 @@
 
 void check(i32 testnum, i8* buf, i32 start, i32 size, i32 val);
 void checkCursor(i32 testnum, i32 expected, i32 actual);
+void checkValue(i32 testnum, i32 expected, i32 actual);
+i32  countFree();
+void copyDisk(str from, str to);
 void createP5();
+void syncDisks();
 void test1(i32 fd);
 void test2(i32 fd);
 void test3(i32 fd);
 void test4(i32 fd);
+void test5(i32 fd);
+void test6(i32 fd);
+void test7();
+void test8(i32 fd);
+void test9(i32 fd);
+void test10(i32 fd);
+void test11(i32 fd);
+void test12(i32 fd);
+void test13(i32 fd);
+void test14(i32 fd);
+void test14Done(FsOp* op);
+void test15(i32 fd);
+void test16(i32 fd);
+void test17(i32 fd);
+void test18(i32 fd);
+void test19();
+void test20(i32 fd);
+void test21(i32 fd);
+void* test21Writer(void* arg);
+void test22(i32 fd);
+void* test22Writer(void* arg);
+void test23(i32 fd);
+void test24(i32 fd);
+void test25();
+void test26();
+void test27(i32 fd);
+void* test27Reader(void* arg);
+void test28();
+void test29();
+void test30();
 void p5test();
 
 #endif
\ No newline at end of file
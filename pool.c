@@ -0,0 +1,153 @@
+// ============================================================================
+// pool.c - a small pool of worker threads, for requests split into pieces
+// ============================================================================
+
+#include "bio.h"
+#include "pool.h"
+
+static pthread_mutex_t g_poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_poolWork = PTHREAD_COND_INITIALIZER;  // jobs queued
+static pthread_cond_t  g_poolDone = PTHREAD_COND_INITIALIZER;  // batch done
+static pthread_once_t  g_poolOnce = PTHREAD_ONCE_INIT;
+static PoolBatch*      g_poolHead = NULL;  // batches with jobs to hand out
+
+
+// ============================================================================
+// Hand out the next job of the first batch that has one, with g_poolLock
+// held.  Return its batch, with the job's index in '*job'; or NULL if no
+// batch has a job left
+// ============================================================================
+static PoolBatch* poolTake(i32* job) {
+  PoolBatch* b = g_poolHead;
+  if (b == NULL) return NULL;
+  *job = b->next++;
+  if (b->next == b->numjobs) g_poolHead = b->nextBatch;   // all handed out
+  return b;
+}
+
+
+
+// ============================================================================
+// Run job 'job' of batch 'b', without g_poolLock, then count it finished
+// ============================================================================
+static void poolDo(PoolBatch* b, i32 job) {
+  pthread_mutex_unlock(&g_poolLock);
+  b->fn(b->args[job]);
+  pthread_mutex_lock(&g_poolLock);
+  if (--b->left == 0) pthread_cond_broadcast(&g_poolDone);
+}
+
+
+
+// ============================================================================
+// Worker thread: run jobs as they are queued, for as long as the process
+// lives
+// ============================================================================
+static void* poolWorker(void* unused) {
+  (void)unused;
+  pthread_mutex_lock(&g_poolLock);
+  for (;;) {
+    i32 job;
+    PoolBatch* b = poolTake(&job);
+    if (b == NULL) {
+      pthread_cond_wait(&g_poolWork, &g_poolLock);
+      continue;
+    }
+    poolDo(b, job);
+  }
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Start the POOLTHREADS workers.  Run once, by pthread_once
+// ============================================================================
+static void poolStart() {
+  for (i32 i = 0; i < POOLTHREADS; ++i) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, poolWorker, NULL) != 0) FATAL(ENOMEM);
+    pthread_detach(t);
+  }
+}
+
+
+
+// ============================================================================
+// Job of poolReadBlocks: read one piece's blocks into its 'dst'.  It only
+// reads the disk: no metaLock, no block mapping
+// ============================================================================
+static void poolReadJob(void* arg) {
+  PoolRead* r = arg;
+  bfsSetVolume(r->vol);                   // act on the caller's volume
+  for (i32 i = 0; i < r->count; ++i) {
+    i8* dst = r->dst + i * BYTESPERBLOCK;
+    if (r->dbns[i] == 0) memset(dst, 0, BYTESPERBLOCK);   // hole
+    else                 bioRead(r->dbns[i], dst);
+  }
+}
+
+
+
+// ============================================================================
+// Read the 'count' blocks of the current volume whose DBNs are in 'dbns'
+// into 'dst', one after another; a DBN of 0, a hole, reads as zeroes.  The
+// run is cut into one piece per worker, plus one for the caller, and the
+// pieces are read at the same time.  The caller resolved 'dbns' with
+// bfsFbnToDbnRun, and holds the file's Incore lock until this returns, so
+// they still map the file.  On success, return 0
+// ============================================================================
+i32 poolReadBlocks(i16* dbns, i32 count, i8* dst) {
+  if (dbns == NULL || dst == NULL) FATAL(ENULLPTR);
+  if (count <= 0) return 0;
+
+  PoolRead reads[POOLTHREADS + 1];
+  void*    args [POOLTHREADS + 1];
+
+  i32 pieces = MIN(POOLTHREADS + 1, count);
+  i32 done   = 0;
+  for (i32 p = 0; p < pieces; ++p) {
+    i32 n = (count - done) / (pieces - p);         // spread the remainder
+    reads[p] = (PoolRead){ bfsVol(), dbns + done, n,
+                           dst + done * BYTESPERBLOCK };
+    args[p]  = &reads[p];
+    done    += n;
+  }
+
+  return poolRun(pieces, poolReadJob, args);
+}
+
+
+
+// ============================================================================
+// Run fn(args[i]) for each of the 'numjobs' jobs, on the worker threads and
+// on the calling thread, and return once every job has finished.  Jobs must
+// not call poolRun.  On success, return 0
+// ============================================================================
+i32 poolRun(i32 numjobs, void (*fn)(void* arg), void** args) {
+  if (fn == NULL || args == NULL) FATAL(ENULLPTR);
+  if (numjobs <= 0) return 0;
+
+  pthread_once(&g_poolOnce, poolStart);
+
+  PoolBatch b = { fn, args, numjobs, 0, numjobs, NULL };
+
+  pthread_mutex_lock(&g_poolLock);
+  PoolBatch** tail = &g_poolHead;               // queue behind other batches
+  while (*tail != NULL) tail = &(*tail)->nextBatch;
+  *tail = &b;
+  pthread_cond_broadcast(&g_poolWork);
+
+  while (b.next < b.numjobs) {                  // help with our own jobs
+    i32 job = b.next++;
+    if (b.next == b.numjobs) {                  // unlink: all handed out
+      for (tail = &g_poolHead; *tail != &b; tail = &(*tail)->nextBatch) {}
+      *tail = b.nextBatch;
+    }
+    poolDo(&b, job);
+  }
+
+  while (b.left > 0) pthread_cond_wait(&g_poolDone, &g_poolLock);
+  pthread_mutex_unlock(&g_poolLock);
+  return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef POOL_H
+#define POOL_H
+
+// ===================================================================
+// pool.h - a small pool of worker threads.  poolRun spreads one
+// request's independent pieces over the workers, and the caller,
+// and returns when all are done.  fsPreadv uses it to fetch the
+// blocks of one large read at the same time
+// ===================================================================
+
+#include "bfs.h"
+#include "alias.h"
+
+#define POOLTHREADS   4                 // worker threads
+#define POOLMINBLOCKS 8                 // smallest read worth splitting
+
+typedef struct PoolBatch PoolBatch;
+
+struct PoolBatch {        // PoolBatch: the jobs of one poolRun call
+  void  (*fn)(void* arg); // run once per job
+  void**  args;           // args[i] is the argument of job i
+  i32     numjobs;        // # jobs
+  i32     next;           // next job to hand out
+  i32     left;           // # jobs not yet finished
+  PoolBatch* nextBatch;   // next batch with jobs to hand out
+};
+
+typedef struct {          // PoolRead: one piece of poolReadBlocks
+  Volume* vol;            // volume holding the file
+  i16* dbns;              // DBN of each block of the piece.  0 => a hole
+  i32  count;             // # whole blocks in the piece
+  i8*  dst;               // room for count * BYTESPERBLOCK bytes
+} PoolRead;
+
+i32 poolReadBlocks(i16* dbns, i32 count, i8* dst);
+i32 poolRun(i32 numjobs, void (*fn)(void* arg), void** args);
+
+#endif